@@ -64,6 +64,13 @@
 
 - (void) setDatabase: (Database *)database
 {
+    NSError *err;
+
+    if(db && db != database && ![db close: &err]) {
+        NSAlert *alert = [NSAlert alertWithError: err];
+        [alert runModal];
+    }
+
     [database retain];
     [db release];
     db = database;
@@ -323,7 +330,7 @@
     }
     
     NSError *err;
-    if(![db save: &err]) {
+    if(![db saveRecord: r error: &err]) {
         NSAlert *alert = [NSAlert alertWithError: err];
         [alert runModal];
     }
@@ -26,6 +26,7 @@
 #import <Cocoa/Cocoa.h>
 
 #import "db/db.h"
+#import "db/dbiov3.h"
 #import "Group.h"
 
 
@@ -37,6 +38,10 @@
     NSMutableArray *objects;
     NSString *filename;
     NSString *key;
+
+    // Keeps the file up to date through a journal of the changes,
+    // created by the read or the first save with the current key.
+    pws::db_journal_v3 *journal;
 }
 
 // Returns nil in case of an error.
@@ -52,10 +57,19 @@
        database: (pws::pws_db *)database;
 - (void) dealloc;
 
-// Save methods return NO if there was an error.
+// Save methods return NO if there was an error. The changes are
+// appended to the journal of the file, the file itself is only written
+// from time to time, in the background, and by close:.
 - (BOOL) save: (NSError **)outError;
 - (BOOL) saveWithNewKey: (NSString *)password error: (NSError **)outError;
 
+// Saves the changes made to the record.
+- (BOOL) saveRecord: (Record *)record error: (NSError **)outError;
+
+// Writes the changes in the journal to the file, should be called
+// before the database is released.
+- (BOOL) close: (NSError **)outError;
+
 - (NSString *) filename;
 
 - (Record *) createNewRecordWithTitle: (NSString *)title inGroup: (Group *)group;
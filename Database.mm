@@ -65,6 +65,15 @@ static NSMutableArray *buildObjects(pws::pws_db &db)
     return [ret autorelease];
 }
 
+static pws::save_options saveOptions()
+{
+    // The order of the records is not kept anywhere but in the file,
+    // the edited ones can go to the end of it.
+    pws::save_options options;
+    options.incremental.move_changed_to_tail = true;
+    return options;
+}
+
 static NSError *convertExceptionToError(const pws::pws_io_exception &ex)
 {
     NSString *descrip = [NSString stringWithUTF8String: ex.what()];
@@ -99,15 +108,20 @@ static NSError *convertExceptionToError(const pws::pws_io_exception &ex)
 + (Database *) readFromFile: (NSString *)path withKey: (NSString *)password
                     error: (NSError **)outError
 {
+    pws::db_journal_v3 *j = 0;
+
     try {
-        pws::scoped_ptr<pws::db_reader> reader(
-            pws::create_reader([path UTF8String], [password UTF8String]));
-        pws::pws_db *database = reader->read();
+        j = new pws::db_journal_v3([path UTF8String], [password UTF8String],
+            saveOptions());
+        pws::pws_db *database = j->read();
         Database *ret = [[Database alloc] initWithPath: path
                                           key: password
                                           database: database];
+        ret->journal = j;
         return [ret autorelease];
     } catch(pws::pws_io_exception ex) {
+        delete j;
+
         if(outError) {
             *outError = convertExceptionToError(ex);
         }
@@ -134,6 +148,7 @@ static NSError *convertExceptionToError(const pws::pws_io_exception &ex)
 
 - (void) dealloc
 {
+    delete journal;
     delete db;
     [filename release];
     [key release];
@@ -143,8 +158,12 @@ static NSError *convertExceptionToError(const pws::pws_io_exception &ex)
 - (BOOL) save: (NSError **)outError
 {
     try {
-        pws::scoped_ptr<pws::db_writer> writer(pws::create_writer(*db));
-        writer->write(*db, [filename UTF8String], [key UTF8String]);
+        if(!journal) {
+            journal = new pws::db_journal_v3([filename UTF8String],
+                [key UTF8String], saveOptions());
+        }
+
+        journal->commit(*db);
         return YES;
     } catch(pws::pws_io_exception ex) {
         if(outError) {
@@ -157,12 +176,61 @@ static NSError *convertExceptionToError(const pws::pws_io_exception &ex)
 
 - (BOOL) saveWithNewKey: (NSString *)password error: (NSError **)outError
 {
+    try {
+        // Only the preamble of the file is written again, the journal
+        // stays valid. Without a journal the save writes the whole file.
+        if(journal) {
+            journal->change_key([password UTF8String]);
+        }
+    } catch(pws::pws_io_exception ex) {
+        if(outError) {
+            *outError = convertExceptionToError(ex);
+        }
+
+        return NO;
+    }
+
     [password retain];
     [key release];
     key = password;
+
+    return [self save: outError];
+}
+
+- (BOOL) saveRecord: (Record *)record error: (NSError **)outError
+{
+    try {
+        if(journal) {
+            journal->put_record(*[record dbRecord]);
+        }
+    } catch(pws::pws_io_exception ex) {
+        if(outError) {
+            *outError = convertExceptionToError(ex);
+        }
+
+        return NO;
+    }
+
     return [self save: outError];
 }
 
+- (BOOL) close: (NSError **)outError
+{
+    try {
+        if(journal && journal->needs_compaction()) {
+            journal->compact(*db);
+        }
+
+        return YES;
+    } catch(pws::pws_io_exception ex) {
+        if(outError) {
+            *outError = convertExceptionToError(ex);
+        }
+    }
+
+    return NO;
+}
+
 - (NSString *) filename
 {
     return filename;
@@ -208,6 +276,10 @@ static NSError *convertExceptionToError(const pws::pws_io_exception &ex)
 {
     Group *group = [record group];
 
+    if(journal) {
+        journal->delete_record(*[record dbRecord]);
+    }
+
     db->delete_record(*[record dbRecord]);
 
     if(group) {
@@ -0,0 +1,292 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "byteio.h"
+#include "exception.h"
+#include "util.h"
+
+
+namespace {
+
+// Size of the buffers used by the file descriptor backends.
+const size_t fd_buffer_size = 64 * 1024;
+
+// Some systems refuse to write more than 2 GB in one call.
+const size_t max_write_size = 1024 * 1024 * 1024;
+
+} // namespace
+
+
+pws::memory_source::memory_source()
+    : _data(0), _len(0), _pos(0)
+{
+}
+
+pws::memory_source::memory_source(const void *data, size_t len)
+    : _data((const unsigned char *)data), _len(len), _pos(0)
+{
+}
+
+void pws::memory_source::assign(const void *data, size_t len)
+{
+    _data = (const unsigned char *)data;
+    _len = len;
+    _pos = 0;
+}
+
+const unsigned char *pws::memory_source::read_rest(size_t &len)
+{
+    len = _len - _pos;
+    return read(len);
+}
+
+
+pws::mmap_source::mmap_source(const std::string &file)
+    : _map(0), _map_len(0)
+{
+    fd_guard f(open(file.c_str(), O_RDONLY));
+
+    if(f.fd() < 0) {
+        throw pws_io_exception(FILE_NOT_FOUND);
+    }
+
+    struct stat st;
+
+    if(fstat(f.fd(), &st) != 0) {
+        throw pws_io_exception();
+    }
+
+    // An empty file cannot be mapped, leave the source empty.
+    if(st.st_size == 0) {
+        return;
+    }
+
+    _map_len = st.st_size;
+    _map = mmap(0, _map_len, PROT_READ, MAP_PRIVATE, f.fd(), 0);
+
+    if(_map == MAP_FAILED) {
+        _map = 0;
+        throw pws_io_exception();
+    }
+
+    // The readers go through the file front to back exactly once.
+    madvise(_map, _map_len, MADV_SEQUENTIAL);
+
+    assign(_map, _map_len);
+}
+
+pws::mmap_source::~mmap_source()
+{
+    if(_map) {
+        munmap(_map, _map_len);
+    }
+}
+
+void pws::mmap_source::prefetch()
+{
+    if(_map == 0) {
+        return;
+    }
+
+    madvise(_map, _map_len, MADV_WILLNEED);
+
+    // Fault the pages in here rather than in the reader.
+    const size_t page = sysconf(_SC_PAGESIZE);
+    const volatile unsigned char *data = (const unsigned char *)_map;
+    unsigned char sum = 0;
+
+    for(size_t off = 0; off < _map_len; off += page) {
+        sum ^= data[off];
+    }
+}
+
+
+pws::fd_source::fd_source(int fd)
+    : _fd(fd), _buf(fd_buffer_size), _pos(0), _end(0), _limit(0)
+{
+}
+
+const unsigned char *pws::fd_source::read(size_t len)
+{
+    if(_end - _pos < len) {
+        if(_limit != 0 && len > _limit) {
+            throw pws_io_exception(LIMIT_EXCEEDED);
+        }
+
+        // Move the unread tail to the front and refill the rest.
+        memmove(&_buf[0], &_buf[0] + _pos, _end - _pos);
+        _end -= _pos;
+        _pos = 0;
+
+        if(_buf.size() < len) {
+            _buf.resize(len);
+        }
+
+        while(_end < len) {
+            if(!fill()) {
+                return 0;
+            }
+        }
+    }
+
+    const unsigned char *ret = &_buf[0] + _pos;
+    _pos += len;
+    return ret;
+}
+
+const unsigned char *pws::fd_source::read_rest(size_t &len)
+{
+    if(!fill_rest()) {
+        throw pws_io_exception(LIMIT_EXCEEDED);
+    }
+
+    len = _end - _pos;
+
+    const unsigned char *ret = &_buf[0] + _pos;
+    _pos = _end;
+    return ret;
+}
+
+void pws::fd_source::prefetch()
+{
+    // Going over the limit is reported by the read that follows.
+    fill_rest();
+}
+
+bool pws::fd_source::fill_rest()
+{
+    // The buffer grows to at most one byte over the limit, which is
+    // enough to tell that the data does not fit.
+    while(_limit == 0 || _end <= _limit) {
+        if(_end == _buf.size()) {
+            size_t size = _buf.size() * 2;
+
+            if(_limit != 0) {
+                size = std::min(size, _limit + 1);
+            }
+
+            _buf.resize(size);
+        }
+
+        if(!fill()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool pws::fd_source::fill()
+{
+    while(1) {
+        ssize_t n = ::read(_fd, &_buf[0] + _end, _buf.size() - _end);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) {
+            return false;
+        }
+
+        _end += n;
+        return true;
+    }
+}
+
+
+void pws::memory_sink::write(const void *buf, size_t len)
+{
+    _out.append((const char *)buf, len);
+}
+
+
+pws::fd_sink::fd_sink(int fd)
+    : _fd(fd), _buf(fd_buffer_size), _used(0)
+{
+}
+
+void pws::fd_sink::write(const void *buf, size_t len)
+{
+    // Large writes bypass the buffer altogether, what has been buffered
+    // goes along with them in the same system call.
+    if(len >= _buf.size()) {
+        write_fd(&_buf[0], _used, (const unsigned char *)buf, len);
+        _used = 0;
+        return;
+    }
+
+    if(_buf.size() - _used < len) {
+        flush();
+    }
+
+    memcpy(&_buf[0] + _used, buf, len);
+    _used += len;
+}
+
+void pws::fd_sink::flush()
+{
+    write_fd(&_buf[0], _used, 0, 0);
+    _used = 0;
+}
+
+void pws::fd_sink::write_fd(const unsigned char *head, size_t head_len,
+    const unsigned char *buf, size_t len)
+{
+    while(head_len + len > 0) {
+        struct iovec iov[2];
+
+        iov[0].iov_base = (void *)head;
+        iov[0].iov_len = std::min(head_len, max_write_size);
+        iov[1].iov_base = (void *)buf;
+        iov[1].iov_len = std::min(len, max_write_size - iov[0].iov_len);
+
+        ssize_t n = ::writev(_fd, iov, 2);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+
+        size_t n_head = std::min((size_t)n, head_len);
+
+        head += n_head;
+        head_len -= n_head;
+        buf += n - n_head;
+        len -= n - n_head;
+    }
+}
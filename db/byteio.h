@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_BYTEIO_H_
+#define _PWS_BYTEIO_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Sources and sinks of raw bytes the database readers and writers
+// work on, so that the codecs do not depend on where the bytes live.
+
+namespace pws {
+
+class byte_source {
+public:
+    virtual ~byte_source() {}
+
+    // Returns a pointer to the next len bytes of the source and advances
+    // past them, or 0 if fewer than len bytes are left. Unless stated
+    // otherwise by the implementation the data is only valid until the
+    // next call on the source.
+    virtual const unsigned char *read(size_t len) = 0;
+
+    // Returns a pointer to all the bytes left in the source and stores
+    // their number in len, the source is empty afterwards. The validity
+    // of the data is the same as for read().
+    virtual const unsigned char *read_rest(size_t &len) = 0;
+
+    // Brings the rest of the data close to the reader (into memory) so
+    // that the following reads do not wait for the storage. May be run
+    // on another thread as long as the source is not used meanwhile.
+    virtual void prefetch() {}
+
+    // Limits the number of bytes a source that copies the data keeps in
+    // memory, 0 stands for no limit. Reading more than that fails with
+    // pws_io_exception(LIMIT_EXCEEDED) and prefetch() stops at it.
+    virtual void set_limit(size_t len) {}
+};
+
+
+class byte_sink {
+public:
+    virtual ~byte_sink() {}
+
+    // Throws pws_io_exception(WRITE_ERROR) if the data cannot be written.
+    virtual void write(const void *buf, size_t len) = 0;
+
+    // Pushes any buffered data to the underlying storage. Buffered data
+    // that has not been flushed is lost when the sink is destroyed.
+    virtual void flush() {}
+};
+
+
+// Reads from a caller-owned memory buffer that must outlive the source.
+// The pointers returned by read() point straight into the buffer and
+// stay valid as long as the buffer does.
+class memory_source : public byte_source {
+public:
+    memory_source(const void *data, size_t len);
+
+    // Defined here so that callers that know the type of the source can
+    // have the call inlined.
+    virtual const unsigned char *read(size_t len)
+    {
+        if(_len - _pos < len) {
+            return 0;
+        }
+
+        const unsigned char *ret = _data + _pos;
+        _pos += len;
+        return ret;
+    }
+
+    virtual const unsigned char *read_rest(size_t &len);
+
+protected:
+    memory_source();
+
+    void assign(const void *data, size_t len);
+
+private:
+    memory_source(const memory_source &);
+    memory_source &operator= (const memory_source &);
+
+    const unsigned char *_data;
+    size_t _len;
+    size_t _pos;
+};
+
+
+// Maps the whole file into memory. The pointers returned by read()
+// point into the mapping and stay valid for the lifetime of the source.
+// Throws pws_io_exception(FILE_NOT_FOUND) if the file cannot be opened.
+class mmap_source : public memory_source {
+public:
+    explicit mmap_source(const std::string &file);
+    ~mmap_source();
+
+    virtual void prefetch();
+
+private:
+    void *_map;
+    size_t _map_len;
+};
+
+
+// Reads from a file descriptor through an internal buffer. The
+// descriptor is not owned by the source.
+class fd_source : public byte_source {
+public:
+    explicit fd_source(int fd);
+
+    virtual const unsigned char *read(size_t len);
+    virtual const unsigned char *read_rest(size_t &len);
+    virtual void prefetch();
+    virtual void set_limit(size_t len) { _limit = len; }
+
+private:
+    fd_source(const fd_source &);
+    fd_source &operator= (const fd_source &);
+
+    // Reads from the descriptor into the buffer after the data that
+    // has not been consumed yet. Returns false on the end of file.
+    bool fill();
+
+    // Reads the rest of the descriptor into the buffer. Returns false if
+    // the limit is reached before the end of file.
+    bool fill_rest();
+
+    int _fd;
+    std::vector<unsigned char> _buf;
+    size_t _pos;
+    size_t _end;
+    size_t _limit;
+};
+
+
+// Appends everything written to a caller-owned string.
+class memory_sink : public byte_sink {
+public:
+    explicit memory_sink(std::string &out) : _out(out) {}
+
+    virtual void write(const void *buf, size_t len);
+
+private:
+    memory_sink(const memory_sink &);
+    memory_sink &operator= (const memory_sink &);
+
+    std::string &_out;
+};
+
+
+// Writes to a file descriptor through an internal buffer. The
+// descriptor is not owned by the sink.
+class fd_sink : public byte_sink {
+public:
+    explicit fd_sink(int fd);
+
+    virtual void write(const void *buf, size_t len);
+    virtual void flush();
+
+private:
+    fd_sink(const fd_sink &);
+    fd_sink &operator= (const fd_sink &);
+
+    // Writes the two pieces of data one after the other.
+    void write_fd(const unsigned char *head, size_t head_len,
+        const unsigned char *buf, size_t len);
+
+    int _fd;
+    std::vector<unsigned char> _buf;
+    size_t _used;
+};
+
+}
+
+#endif
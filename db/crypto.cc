@@ -0,0 +1,1114 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "crypto.h"
+#include "crypto_impl.h"
+#include "util.h"
+
+#ifdef PWS_X86_KERNELS
+#include <cpuid.h>
+#endif
+
+namespace pws {
+
+const unsigned int sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+const unsigned int sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+namespace {
+
+inline unsigned int rotl(unsigned int x, int n)
+{
+    return (x << n) | (x >> (32 - n));
+}
+
+inline unsigned int rotr(unsigned int x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+inline unsigned int get_be32(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16)
+        | ((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+inline void put_be32(unsigned int n, unsigned char *p)
+{
+    p[0] = (unsigned char)(n >> 24);
+    p[1] = (unsigned char)(n >> 16);
+    p[2] = (unsigned char)(n >> 8);
+    p[3] = (unsigned char)n;
+}
+
+inline unsigned int get_le32(const unsigned char *p)
+{
+    return ((unsigned int)p[3] << 24) | ((unsigned int)p[2] << 16)
+        | ((unsigned int)p[1] << 8) | (unsigned int)p[0];
+}
+
+inline void put_le32(unsigned int n, unsigned char *p)
+{
+    p[0] = (unsigned char)n;
+    p[1] = (unsigned char)(n >> 8);
+    p[2] = (unsigned char)(n >> 16);
+    p[3] = (unsigned char)(n >> 24);
+}
+
+// Expands the first 16 words of the message schedule to all 64.
+inline void sha256_schedule(unsigned int w[64])
+{
+    for(int i = 16; i < 64; ++i) {
+        unsigned int s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18)
+            ^ (w[i - 15] >> 3);
+        unsigned int s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19)
+            ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+}
+
+// Runs the rounds over the message schedule and adds the result to the
+// state.
+inline void sha256_rounds(unsigned int state[8], const unsigned int w[64])
+{
+    unsigned int a = state[0], b = state[1], c = state[2], d = state[3];
+    unsigned int e = state[4], f = state[5], g = state[6], h = state[7];
+
+    for(int i = 0; i < 64; ++i) {
+        unsigned int t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25))
+            + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        unsigned int t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22))
+            + ((a & b) ^ (a & c) ^ (b & c));
+
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void sha256_compress_portable(unsigned int state[8],
+    const unsigned char *blocks, size_t n)
+{
+    unsigned int w[64];
+
+    for(; n > 0; --n, blocks += sha256::block_size) {
+        for(int i = 0; i < 16; ++i) {
+            w[i] = get_be32(blocks + 4 * i);
+        }
+
+        sha256_schedule(w);
+        sha256_rounds(state, w);
+    }
+}
+
+// The digest being hashed fills the first half of the only block, the
+// padding and the length in the second half stay the same, so they are
+// set once and the digest words go straight into the schedule.
+void sha256_stretch_portable(unsigned int digest[8], unsigned int n)
+{
+    unsigned int w[64];
+
+    memset(w, 0, sizeof(w));
+    w[8] = 0x80000000;
+    w[15] = 8 * sha256::digest_size;
+
+    for(; n > 0; --n) {
+        memcpy(w, digest, 8 * sizeof(w[0]));
+        sha256_schedule(w);
+
+        memcpy(digest, sha256_iv, 8 * sizeof(digest[0]));
+        sha256_rounds(digest, w);
+    }
+}
+
+// The fixed permutations q0 and q1 of Twofish are built from these
+// 4-bit tables, see section 4.3.5 of the Twofish paper.
+const unsigned char q_tables[2][4][16] = {
+    {
+        {0x8, 0x1, 0x7, 0xd, 0x6, 0xf, 0x3, 0x2,
+         0x0, 0xb, 0x5, 0x9, 0xe, 0xc, 0xa, 0x4},
+        {0xe, 0xc, 0xb, 0x8, 0x1, 0x2, 0x3, 0x5,
+         0xf, 0x4, 0xa, 0x6, 0x7, 0x0, 0x9, 0xd},
+        {0xb, 0xa, 0x5, 0xe, 0x6, 0xd, 0x9, 0x0,
+         0xc, 0x8, 0xf, 0x3, 0x2, 0x4, 0x7, 0x1},
+        {0xd, 0x7, 0xf, 0x4, 0x1, 0x2, 0x6, 0xe,
+         0x9, 0xb, 0x3, 0x0, 0x8, 0x5, 0xc, 0xa}
+    },
+    {
+        {0x2, 0x8, 0xb, 0xd, 0xf, 0x7, 0x6, 0xe,
+         0x3, 0x1, 0x9, 0x4, 0x0, 0xa, 0xc, 0x5},
+        {0x1, 0xe, 0x2, 0xb, 0x4, 0xc, 0x3, 0x7,
+         0x6, 0xd, 0xa, 0x5, 0xf, 0x9, 0x0, 0x8},
+        {0x4, 0xc, 0x7, 0x5, 0x1, 0x6, 0x9, 0xa,
+         0x0, 0xe, 0xd, 0x8, 0x2, 0xb, 0x3, 0xf},
+        {0xb, 0x9, 0x5, 0x1, 0xc, 0x3, 0xd, 0xe,
+         0x6, 0x4, 0x7, 0xf, 0x2, 0x0, 0x8, 0xa}
+    }
+};
+
+// The MDS matrix and the Reed-Solomon matrix the S-box keys are derived
+// with.
+const unsigned char mds_matrix[4][4] = {
+    {0x01, 0xef, 0x5b, 0x5b},
+    {0x5b, 0xef, 0xef, 0x01},
+    {0xef, 0x5b, 0x01, 0xef},
+    {0xef, 0x01, 0xef, 0x5b}
+};
+
+const unsigned char rs_matrix[4][8] = {
+    {0x01, 0xa4, 0x55, 0x87, 0x5a, 0x58, 0xdb, 0x9e},
+    {0xa4, 0x56, 0x82, 0xf3, 0x1e, 0xc6, 0x68, 0xe5},
+    {0x02, 0xa1, 0xfc, 0xc1, 0x47, 0xae, 0x3d, 0x19},
+    {0xa4, 0x55, 0x87, 0x5a, 0x58, 0xdb, 0x9e, 0x03}
+};
+
+const unsigned int mds_poly = 0x169;
+const unsigned int rs_poly = 0x14d;
+
+// q0 and q1, and the columns of the MDS matrix multiplied by every byte
+// value, built once by make_twofish_tables().
+unsigned char q_perm[2][256];
+unsigned int mds_columns[4][256];
+pthread_once_t twofish_tables_once = PTHREAD_ONCE_INIT;
+
+unsigned char gf_mult(unsigned int a, unsigned int b, unsigned int poly)
+{
+    unsigned int r = 0;
+
+    for(; b; b >>= 1) {
+        if(b & 1) {
+            r ^= a;
+        }
+
+        a <<= 1;
+        if(a & 0x100) {
+            a ^= poly;
+        }
+    }
+
+    return (unsigned char)r;
+}
+
+inline unsigned int ror4(unsigned int x)
+{
+    return ((x >> 1) | (x << 3)) & 0xf;
+}
+
+unsigned char q_permute(int n, unsigned int x)
+{
+    const unsigned char (*t)[16] = q_tables[n];
+
+    unsigned int a = x >> 4, b = x & 0xf;
+    unsigned int a1 = a ^ b, b1 = (a ^ ror4(b) ^ (8 * a)) & 0xf;
+    unsigned int a2 = t[0][a1], b2 = t[1][b1];
+    unsigned int a3 = a2 ^ b2, b3 = (a2 ^ ror4(b2) ^ (8 * a2)) & 0xf;
+
+    return (unsigned char)((t[3][b3] << 4) | t[2][a3]);
+}
+
+void make_twofish_tables()
+{
+    for(int x = 0; x < 256; ++x) {
+        q_perm[0][x] = q_permute(0, x);
+        q_perm[1][x] = q_permute(1, x);
+    }
+
+    for(int col = 0; col < 4; ++col) {
+        for(int x = 0; x < 256; ++x) {
+            unsigned int v = 0;
+
+            for(int row = 0; row < 4; ++row) {
+                v |= (unsigned int)gf_mult(mds_matrix[row][col], x, mds_poly)
+                    << (8 * row);
+            }
+
+            mds_columns[col][x] = v;
+        }
+    }
+}
+
+// The h function of Twofish before the MDS matrix, applied to the bytes
+// of y with the key words l, k is the key length in 64-bit words.
+void twofish_h_bytes(unsigned char y[4], const unsigned int *l, int k)
+{
+    const unsigned char *q0 = q_perm[0], *q1 = q_perm[1];
+
+    if(k == 4) {
+        y[0] = q1[y[0]] ^ (unsigned char)l[3];
+        y[1] = q0[y[1]] ^ (unsigned char)(l[3] >> 8);
+        y[2] = q0[y[2]] ^ (unsigned char)(l[3] >> 16);
+        y[3] = q1[y[3]] ^ (unsigned char)(l[3] >> 24);
+    }
+
+    if(k >= 3) {
+        y[0] = q1[y[0]] ^ (unsigned char)l[2];
+        y[1] = q1[y[1]] ^ (unsigned char)(l[2] >> 8);
+        y[2] = q0[y[2]] ^ (unsigned char)(l[2] >> 16);
+        y[3] = q0[y[3]] ^ (unsigned char)(l[2] >> 24);
+    }
+
+    y[0] = q1[q0[q0[y[0]] ^ (unsigned char)l[1]] ^ (unsigned char)l[0]];
+    y[1] = q0[q0[q1[y[1]] ^ (unsigned char)(l[1] >> 8)]
+        ^ (unsigned char)(l[0] >> 8)];
+    y[2] = q1[q1[q0[y[2]] ^ (unsigned char)(l[1] >> 16)]
+        ^ (unsigned char)(l[0] >> 16)];
+    y[3] = q0[q1[q1[y[3]] ^ (unsigned char)(l[1] >> 24)]
+        ^ (unsigned char)(l[0] >> 24)];
+}
+
+unsigned int twofish_h(unsigned int x, const unsigned int *l, int k)
+{
+    unsigned char y[4];
+
+    for(int i = 0; i < 4; ++i) {
+        y[i] = (unsigned char)(x >> (8 * i));
+    }
+
+    twofish_h_bytes(y, l, k);
+
+    return mds_columns[0][y[0]] ^ mds_columns[1][y[1]]
+        ^ mds_columns[2][y[2]] ^ mds_columns[3][y[3]];
+}
+
+inline unsigned int twofish_g(const twofish_key &key, unsigned int x)
+{
+    return key.s[0][x & 0xff] ^ key.s[1][(x >> 8) & 0xff]
+        ^ key.s[2][(x >> 16) & 0xff] ^ key.s[3][x >> 24];
+}
+
+void twofish_encrypt_portable(const twofish_key &key, unsigned char *out,
+    const unsigned char *in, size_t n)
+{
+    for(; n > 0; --n, in += 16, out += 16) {
+        unsigned int r0 = get_le32(in) ^ key.k[0];
+        unsigned int r1 = get_le32(in + 4) ^ key.k[1];
+        unsigned int r2 = get_le32(in + 8) ^ key.k[2];
+        unsigned int r3 = get_le32(in + 12) ^ key.k[3];
+
+        for(int i = 0; i < 16; i += 2) {
+            unsigned int t0 = twofish_g(key, r0);
+            unsigned int t1 = twofish_g(key, rotl(r1, 8));
+
+            r2 = rotr(r2 ^ (t0 + t1 + key.k[2 * i + 8]), 1);
+            r3 = rotl(r3, 1) ^ (t0 + 2 * t1 + key.k[2 * i + 9]);
+
+            t0 = twofish_g(key, r2);
+            t1 = twofish_g(key, rotl(r3, 8));
+
+            r0 = rotr(r0 ^ (t0 + t1 + key.k[2 * i + 10]), 1);
+            r1 = rotl(r1, 1) ^ (t0 + 2 * t1 + key.k[2 * i + 11]);
+        }
+
+        put_le32(r2 ^ key.k[4], out);
+        put_le32(r3 ^ key.k[5], out + 4);
+        put_le32(r0 ^ key.k[6], out + 8);
+        put_le32(r1 ^ key.k[7], out + 12);
+    }
+}
+
+void twofish_decrypt_portable(const twofish_key &key, unsigned char *out,
+    const unsigned char *in, size_t n)
+{
+    for(; n > 0; --n, in += 16, out += 16) {
+        unsigned int r2 = get_le32(in) ^ key.k[4];
+        unsigned int r3 = get_le32(in + 4) ^ key.k[5];
+        unsigned int r0 = get_le32(in + 8) ^ key.k[6];
+        unsigned int r1 = get_le32(in + 12) ^ key.k[7];
+
+        for(int i = 14; i >= 0; i -= 2) {
+            unsigned int t0 = twofish_g(key, r2);
+            unsigned int t1 = twofish_g(key, rotl(r3, 8));
+
+            r0 = rotl(r0, 1) ^ (t0 + t1 + key.k[2 * i + 10]);
+            r1 = rotr(r1 ^ (t0 + 2 * t1 + key.k[2 * i + 11]), 1);
+
+            t0 = twofish_g(key, r0);
+            t1 = twofish_g(key, rotl(r1, 8));
+
+            r2 = rotl(r2, 1) ^ (t0 + t1 + key.k[2 * i + 8]);
+            r3 = rotr(r3 ^ (t0 + 2 * t1 + key.k[2 * i + 9]), 1);
+        }
+
+        put_le32(r0 ^ key.k[0], out);
+        put_le32(r1 ^ key.k[1], out + 4);
+        put_le32(r2 ^ key.k[2], out + 8);
+        put_le32(r3 ^ key.k[3], out + 12);
+    }
+}
+
+}
+
+const crypto_backend portable_backend = {
+    "portable",
+    0,
+    sha256_compress_portable,
+    sha256_stretch_portable,
+    1,
+    sha256_stretch_portable,
+    twofish_encrypt_portable,
+    twofish_decrypt_portable
+};
+
+namespace {
+
+// The implementations from the fastest, the portable one must be last.
+const crypto_backend *const backends[] = {
+#ifdef PWS_X86_KERNELS
+    &shani_backend,
+    &avx512_backend,
+    &avx2_backend,
+    &sse2_backend,
+#endif
+    &portable_backend
+};
+
+const size_t n_backends = sizeof(backends) / sizeof(backends[0]);
+
+pthread_once_t init_once = PTHREAD_ONCE_INIT;
+crypto_backend active;
+bool usable[n_backends];
+
+bool hex_equal(const unsigned char *data, const char *hex, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for(size_t i = 0; i < len; ++i) {
+        if(hex[2 * i] != digits[data[i] >> 4]
+                || hex[2 * i + 1] != digits[data[i] & 0xf]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Hashes a message that fits in n_blocks blocks once padded.
+void sha256_padded(const crypto_backend &b, const char *msg, size_t n_blocks,
+    unsigned char *digest)
+{
+    unsigned char blocks[2 * sha256::block_size];
+    size_t len = strlen(msg);
+    size_t total = n_blocks * sha256::block_size;
+
+    memset(blocks, 0, sizeof(blocks));
+    memcpy(blocks, msg, len);
+    blocks[len] = 0x80;
+    put_be32((unsigned int)(len * 8), blocks + total - 4);
+
+    unsigned int state[8];
+    memcpy(state, sha256_iv, sizeof(state));
+    b.sha256_compress(state, blocks, n_blocks);
+
+    for(int i = 0; i < 8; ++i) {
+        put_be32(state[i], digest + 4 * i);
+    }
+}
+
+// The known answers from FIPS 180-2 and from the Twofish paper, the
+// Twofish ones encrypt a zero block with a zero key of each size. The
+// multi-block paths are run on copies of the same block and compared
+// with the portable implementation on varied data. The stretching is
+// checked with 1000 iterations over the hash of "abc".
+bool self_check(const crypto_backend &b)
+{
+    unsigned char digest[sha256::digest_size];
+
+    if(b.sha256_compress) {
+        sha256_padded(b, "abc", 1, digest);
+        if(!hex_equal(digest, "ba7816bf8f01cfea414140de5dae2223"
+                "b00361a396177a9cb410ff61f20015ad", sizeof(digest))) {
+            return false;
+        }
+
+        sha256_padded(b, "abcdbcdecdefdefgefghfghighijhijk"
+            "ijkljklmklmnlmnomnopnopq", 2, digest);
+        if(!hex_equal(digest, "248d6a61d20638b8e5c026930c3e6039"
+                "a33ce45964ff2167f6ecedd419db06c1", sizeof(digest))) {
+            return false;
+        }
+    }
+
+    static const char stretch_kat[] = "0a5afc0e280abf3d2254e6cf28d4cb5e"
+        "3f93d6a4d716278c14303adfdd4deccf";
+    unsigned int words[8];
+
+    sha256_padded(portable_backend, "abc", 1, digest);
+
+    for(int i = 0; i < 8; ++i) {
+        words[i] = get_be32(digest + 4 * i);
+    }
+
+    if(b.sha256_stretch) {
+        unsigned int out[8];
+
+        memcpy(out, words, sizeof(out));
+        b.sha256_stretch(out, 1000);
+
+        for(int i = 0; i < 8; ++i) {
+            put_be32(out[i], digest + 4 * i);
+        }
+
+        if(!hex_equal(digest, stretch_kat, sizeof(digest))) {
+            return false;
+        }
+    }
+
+    // Each lane starts from a different digest and the iterations are
+    // split in two calls, the first lane has the known answer.
+    if(b.sha256_stretch_lanes) {
+        size_t lanes = b.sha256_lanes;
+        std::vector<unsigned int> digests(8 * lanes);
+
+        for(size_t j = 0; j < lanes; ++j) {
+            for(int i = 0; i < 8; ++i) {
+                digests[i * lanes + j] = words[i] ^ (unsigned int)j;
+            }
+        }
+
+        b.sha256_stretch_lanes(&digests[0], 400);
+        b.sha256_stretch_lanes(&digests[0], 600);
+
+        for(size_t j = 0; j < lanes; ++j) {
+            unsigned int ref[8];
+
+            for(int i = 0; i < 8; ++i) {
+                ref[i] = words[i] ^ (unsigned int)j;
+            }
+
+            sha256_stretch_portable(ref, 1000);
+
+            for(int i = 0; i < 8; ++i) {
+                if(digests[i * lanes + j] != ref[i]) {
+                    return false;
+                }
+
+                put_be32(ref[i], digest + 4 * i);
+            }
+
+            if(j == 0 && !hex_equal(digest, stretch_kat, sizeof(digest))) {
+                return false;
+            }
+        }
+    }
+
+    static const char *const twofish_kat[] = {
+        "9f589f5cf6122c32b6bfec2f2ae8c35a",
+        "efa71f788965bd4453f860178fc19101",
+        "57ff739d4dc92c1bd7fc01700cc8216f"
+    };
+
+    const size_t n_blocks = 37;
+    unsigned char zero[32];
+    unsigned char in[n_blocks * 16], out[n_blocks * 16], ref[n_blocks * 16];
+    twofish_key key;
+
+    memset(zero, 0, sizeof(zero));
+
+    for(size_t i = 0; i < 3; ++i) {
+        twofish_setup(key, zero, 16 + 8 * i);
+
+        if(b.twofish_encrypt) {
+            memset(in, 0, sizeof(in));
+            b.twofish_encrypt(key, out, in, n_blocks);
+
+            for(size_t j = 0; j < n_blocks; ++j) {
+                if(!hex_equal(out + 16 * j, twofish_kat[i], 16)) {
+                    return false;
+                }
+            }
+        }
+
+        if(b.twofish_decrypt) {
+            for(size_t j = 0; j < n_blocks; ++j) {
+                for(size_t k = 0; k < 16; ++k) {
+                    in[16 * j + k] = (unsigned char)(j * 16 + k);
+                }
+            }
+
+            twofish_encrypt_portable(key, ref, in, n_blocks);
+            b.twofish_decrypt(key, out, ref, n_blocks);
+
+            if(memcmp(in, out, sizeof(in)) != 0) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// Fills active with the functions of the given implementations, the
+// first one that has a function wins.
+void merge(const crypto_backend *const *list, size_t n)
+{
+    memset(&active, 0, sizeof(active));
+    active.name = list[0]->name;
+
+    for(size_t i = 0; i < n; ++i) {
+        const crypto_backend &b = *list[i];
+
+        if(!active.sha256_compress) {
+            active.sha256_compress = b.sha256_compress;
+        }
+
+        if(!active.sha256_stretch) {
+            active.sha256_stretch = b.sha256_stretch;
+        }
+
+        if(!active.sha256_stretch_lanes) {
+            active.sha256_lanes = b.sha256_lanes;
+            active.sha256_stretch_lanes = b.sha256_stretch_lanes;
+        }
+
+        if(!active.twofish_encrypt) {
+            active.twofish_encrypt = b.twofish_encrypt;
+        }
+
+        if(!active.twofish_decrypt) {
+            active.twofish_decrypt = b.twofish_decrypt;
+        }
+    }
+
+    // With a single lane the best single chain is as good.
+    if(active.sha256_lanes == 1) {
+        active.sha256_stretch_lanes = active.sha256_stretch;
+    }
+}
+
+bool select_backend(const std::string &name)
+{
+    for(size_t i = 0; i < n_backends; ++i) {
+        if(usable[i] && name == backends[i]->name) {
+            const crypto_backend *list[] = {backends[i], &portable_backend};
+
+            merge(list, 2);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void init_backends()
+{
+    unsigned int features = cpu_features();
+    const crypto_backend *list[n_backends];
+    size_t n = 0;
+
+    for(size_t i = 0; i < n_backends; ++i) {
+        const crypto_backend &b = *backends[i];
+
+        usable[i] = (b.features & features) == b.features && self_check(b);
+
+        if(usable[i]) {
+            list[n++] = &b;
+        }
+    }
+
+    // Everything else is checked against the portable implementation,
+    // if that one is broken the program has been miscompiled.
+    if(!usable[n_backends - 1]) {
+        abort();
+    }
+
+    const char *name = getenv("PWS_CRYPTO_BACKEND");
+
+    if(name == 0 || !select_backend(name)) {
+        merge(list, n);
+    }
+}
+
+}
+
+}
+
+unsigned int pws::cpu_features()
+{
+    unsigned int features = 0;
+
+#ifdef PWS_X86_KERNELS
+    unsigned int eax, ebx, ecx, edx;
+
+    if(__get_cpuid(0, &eax, &ebx, &ecx, &edx) == 0) {
+        return 0;
+    }
+
+    unsigned int max_leaf = eax;
+
+    __cpuid(1, eax, ebx, ecx, edx);
+
+    if(edx & (1 << 26)) {
+        features |= CPU_SSE2;
+    }
+
+    if(ecx & (1 << 9)) {
+        features |= CPU_SSSE3;
+    }
+
+    // AVX2 and AVX-512 also need the system to save the wider registers,
+    // which is what OSXSAVE and XCR0 tell.
+    bool ymm_saved = false;
+    bool zmm_saved = false;
+
+    if((ecx & (1 << 27)) && (ecx & (1 << 28))) {
+        unsigned int xcr0_lo, xcr0_hi;
+
+        // xgetbv, spelled out for the assemblers that do not know it.
+        __asm__ __volatile__(".byte 0x0f, 0x01, 0xd0"
+            : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+        ymm_saved = (xcr0_lo & 0x06) == 0x06;
+        zmm_saved = (xcr0_lo & 0xe6) == 0xe6;
+    }
+
+    if(max_leaf >= 7) {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+        if(ymm_saved && (ebx & (1 << 5))) {
+            features |= CPU_AVX2;
+        }
+
+        if(zmm_saved && (ebx & (1 << 16))) {
+            features |= CPU_AVX512;
+        }
+
+        if(ebx & (1 << 29)) {
+            features |= CPU_SHA;
+        }
+    }
+#endif
+
+    return features;
+}
+
+void pws::twofish_setup(twofish_key &key, const unsigned char *data,
+    size_t len)
+{
+    pthread_once(&twofish_tables_once, make_twofish_tables);
+
+    unsigned char buf[32];
+    int k = len <= 16 ? 2 : (len <= 24 ? 3 : 4);
+
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, data, std::min(len, sizeof(buf)));
+
+    unsigned int even[4], odd[4], sbox_key[4];
+
+    for(int i = 0; i < k; ++i) {
+        even[i] = get_le32(buf + 8 * i);
+        odd[i] = get_le32(buf + 8 * i + 4);
+
+        unsigned char s[4];
+
+        for(int row = 0; row < 4; ++row) {
+            s[row] = 0;
+
+            for(int col = 0; col < 8; ++col) {
+                s[row] ^= gf_mult(rs_matrix[row][col], buf[8 * i + col],
+                    rs_poly);
+            }
+        }
+
+        sbox_key[k - 1 - i] = get_le32(s);
+    }
+
+    const unsigned int rho = 0x01010101;
+
+    for(int i = 0; i < 20; ++i) {
+        unsigned int a = twofish_h(2 * i * rho, even, k);
+        unsigned int b = rotl(twofish_h((2 * i + 1) * rho, odd, k), 8);
+
+        key.k[2 * i] = a + b;
+        key.k[2 * i + 1] = rotl(a + 2 * b, 9);
+    }
+
+    for(int x = 0; x < 256; ++x) {
+        unsigned char y[4];
+
+        y[0] = y[1] = y[2] = y[3] = (unsigned char)x;
+        twofish_h_bytes(y, sbox_key, k);
+
+        for(int col = 0; col < 4; ++col) {
+            key.s[col][x] = mds_columns[col][y[col]];
+        }
+    }
+
+    wipe(buf, sizeof(buf));
+    wipe(even, sizeof(even));
+    wipe(odd, sizeof(odd));
+    wipe(sbox_key, sizeof(sbox_key));
+}
+
+const pws::crypto_backend &pws::crypto()
+{
+    pthread_once(&init_once, init_backends);
+    return active;
+}
+
+std::vector<std::string> pws::crypto_backends()
+{
+    pthread_once(&init_once, init_backends);
+
+    std::vector<std::string> names;
+
+    for(size_t i = 0; i < n_backends; ++i) {
+        if(usable[i]) {
+            names.push_back(backends[i]->name);
+        }
+    }
+
+    return names;
+}
+
+bool pws::select_crypto_backend(const std::string &name)
+{
+    pthread_once(&init_once, init_backends);
+    return select_backend(name);
+}
+
+const size_t pws::sha256::digest_size;
+const size_t pws::sha256::block_size;
+const size_t pws::hmac_sha256::digest_size;
+const size_t pws::twofish_ecb::block_size;
+const size_t pws::twofish_cbc_encryption::block_size;
+const size_t pws::twofish_cbc_decryption::block_size;
+
+pws::sha256::sha256() : _impl(crypto())
+{
+    restart();
+}
+
+pws::sha256::~sha256()
+{
+    wipe(_state, sizeof(_state));
+    wipe(_buf, sizeof(_buf));
+}
+
+void pws::sha256::restart()
+{
+    memcpy(_state, sha256_iv, sizeof(_state));
+    _buf_len = 0;
+    _len = 0;
+}
+
+void pws::sha256::update(const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    _len += len;
+
+    if(_buf_len > 0) {
+        size_t n = std::min(len, block_size - _buf_len);
+
+        memcpy(_buf + _buf_len, p, n);
+        _buf_len += n;
+        p += n;
+        len -= n;
+
+        if(_buf_len < block_size) {
+            return;
+        }
+
+        _impl.sha256_compress(_state, _buf, 1);
+        _buf_len = 0;
+    }
+
+    size_t n_blocks = len / block_size;
+
+    if(n_blocks > 0) {
+        _impl.sha256_compress(_state, p, n_blocks);
+        p += n_blocks * block_size;
+        len -= n_blocks * block_size;
+    }
+
+    memcpy(_buf, p, len);
+    _buf_len = len;
+}
+
+void pws::sha256::final(unsigned char *digest)
+{
+    unsigned long long bits = _len * 8;
+
+    _buf[_buf_len++] = 0x80;
+
+    if(_buf_len > block_size - 8) {
+        memset(_buf + _buf_len, 0, block_size - _buf_len);
+        _impl.sha256_compress(_state, _buf, 1);
+        _buf_len = 0;
+    }
+
+    memset(_buf + _buf_len, 0, block_size - 8 - _buf_len);
+    put_be32((unsigned int)(bits >> 32), _buf + block_size - 8);
+    put_be32((unsigned int)bits, _buf + block_size - 4);
+    _impl.sha256_compress(_state, _buf, 1);
+
+    for(int i = 0; i < 8; ++i) {
+        put_be32(_state[i], digest + 4 * i);
+    }
+
+    restart();
+}
+
+pws::hmac_sha256::hmac_sha256()
+{
+    set_key(0, 0);
+}
+
+pws::hmac_sha256::~hmac_sha256()
+{
+    wipe(_inner, sizeof(_inner));
+    wipe(_outer, sizeof(_outer));
+}
+
+void pws::hmac_sha256::set_key(const void *key, size_t len)
+{
+    unsigned char pad[sha256::block_size];
+
+    memset(pad, 0, sizeof(pad));
+
+    if(len > sizeof(pad)) {
+        _hash.restart();
+        _hash.update(key, len);
+        _hash.final(pad);
+    } else if(len > 0) {
+        memcpy(pad, key, len);
+    }
+
+    for(size_t i = 0; i < sizeof(pad); ++i) {
+        pad[i] ^= 0x36;
+    }
+
+    memcpy(_inner, sha256_iv, sizeof(_inner));
+    _hash._impl.sha256_compress(_inner, pad, 1);
+
+    for(size_t i = 0; i < sizeof(pad); ++i) {
+        pad[i] ^= 0x36 ^ 0x5c;
+    }
+
+    memcpy(_outer, sha256_iv, sizeof(_outer));
+    _hash._impl.sha256_compress(_outer, pad, 1);
+
+    wipe(pad, sizeof(pad));
+    restart();
+}
+
+void pws::hmac_sha256::restart()
+{
+    memcpy(_hash._state, _inner, sizeof(_inner));
+    _hash._buf_len = 0;
+    _hash._len = sha256::block_size;
+}
+
+void pws::hmac_sha256::update(const void *data, size_t len)
+{
+    _hash.update(data, len);
+}
+
+void pws::hmac_sha256::final(unsigned char *mac)
+{
+    unsigned char inner[digest_size];
+
+    _hash.final(inner);
+
+    memcpy(_hash._state, _outer, sizeof(_outer));
+    _hash._len = sha256::block_size;
+    _hash.update(inner, sizeof(inner));
+    _hash.final(mac);
+
+    wipe(inner, sizeof(inner));
+    restart();
+}
+
+void pws::hmac_sha256::save(checkpoint &cp) const
+{
+    memcpy(cp.state, _hash._state, sizeof(cp.state));
+    memcpy(cp.buf, _hash._buf, _hash._buf_len);
+    cp.buf_len = _hash._buf_len;
+    cp.len = _hash._len;
+}
+
+void pws::hmac_sha256::restore(const checkpoint &cp)
+{
+    memcpy(_hash._state, cp.state, sizeof(cp.state));
+    memcpy(_hash._buf, cp.buf, cp.buf_len);
+    _hash._buf_len = cp.buf_len;
+    _hash._len = cp.len;
+}
+
+void pws::derive_key(const unsigned char *key, size_t len,
+    const char *label, unsigned char *out)
+{
+    hmac_sha256 hmac;
+
+    hmac.set_key(key, len);
+    hmac.update((const unsigned char *)label, strlen(label));
+    hmac.final(out);
+}
+
+pws::twofish_ecb::twofish_ecb() : _impl(crypto())
+{
+}
+
+pws::twofish_ecb::~twofish_ecb()
+{
+    wipe(&_key, sizeof(_key));
+}
+
+void pws::twofish_ecb::set_key(const void *key, size_t len)
+{
+    twofish_setup(_key, (const unsigned char *)key, len);
+}
+
+void pws::twofish_ecb::encrypt(unsigned char *out, const unsigned char *in,
+    size_t len)
+{
+    _impl.twofish_encrypt(_key, out, in, len / block_size);
+}
+
+void pws::twofish_ecb::decrypt(unsigned char *out, const unsigned char *in,
+    size_t len)
+{
+    _impl.twofish_decrypt(_key, out, in, len / block_size);
+}
+
+pws::twofish_cbc_encryption::twofish_cbc_encryption() : _impl(crypto())
+{
+}
+
+pws::twofish_cbc_encryption::~twofish_cbc_encryption()
+{
+    wipe(&_key, sizeof(_key));
+}
+
+void pws::twofish_cbc_encryption::set_key_with_iv(const void *key,
+    size_t len, const unsigned char *iv)
+{
+    twofish_setup(_key, (const unsigned char *)key, len);
+    memcpy(_iv, iv, sizeof(_iv));
+}
+
+void pws::twofish_cbc_encryption::process(unsigned char *out,
+    const unsigned char *in, size_t len)
+{
+    // Each block depends on the previous one, so there is nothing to
+    // gain from passing more than one block at a time.
+    for(size_t pos = 0; pos < len; pos += block_size) {
+        for(size_t i = 0; i < block_size; ++i) {
+            _iv[i] ^= in[pos + i];
+        }
+
+        _impl.twofish_encrypt(_key, out + pos, _iv, 1);
+        memcpy(_iv, out + pos, block_size);
+    }
+}
+
+pws::twofish_cbc_decryption::twofish_cbc_decryption() : _impl(crypto())
+{
+}
+
+pws::twofish_cbc_decryption::~twofish_cbc_decryption()
+{
+    wipe(&_key, sizeof(_key));
+}
+
+void pws::twofish_cbc_decryption::set_key_with_iv(const void *key,
+    size_t len, const unsigned char *iv)
+{
+    twofish_setup(_key, (const unsigned char *)key, len);
+    memcpy(_iv, iv, sizeof(_iv));
+}
+
+void pws::twofish_cbc_decryption::process(unsigned char *out,
+    const unsigned char *in, size_t len)
+{
+    // The blocks are decrypted independently a chunk at a time and then
+    // chained, from the last block to the first so that the ciphertext
+    // is not overwritten before it is used when out is the same as in.
+    const size_t chunk_blocks = 64;
+    unsigned char plain[chunk_blocks * block_size];
+    unsigned char next_iv[block_size];
+
+    for(size_t pos = 0; pos < len; ) {
+        size_t n = std::min(len - pos, sizeof(plain));
+        const unsigned char *c = in + pos;
+
+        _impl.twofish_decrypt(_key, plain, c, n / block_size);
+        memcpy(next_iv, c + n - block_size, block_size);
+
+        for(size_t i = n; i > block_size; i -= block_size) {
+            for(size_t j = 0; j < block_size; ++j) {
+                out[pos + i - block_size + j] =
+                    plain[i - block_size + j] ^ c[i - 2 * block_size + j];
+            }
+        }
+
+        for(size_t j = 0; j < block_size; ++j) {
+            out[pos + j] = plain[j] ^ _iv[j];
+        }
+
+        memcpy(_iv, next_iv, block_size);
+        pos += n;
+    }
+
+    wipe(plain, std::min(len, sizeof(plain)));
+}
@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_CRYPTO_H_
+#define _PWS_CRYPTO_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// The primitives the V3 format is built on (SHA-256, HMAC-SHA-256 and
+// Twofish) with several implementations of each. The fastest ones the
+// processor supports are picked on the first use, every implementation
+// has to pass a known-answer self-check before it is picked.
+
+namespace pws {
+
+// Processor features the implementations may need.
+enum cpu_feature_t {
+    CPU_SSE2 = 1 << 0,
+    CPU_SSSE3 = 1 << 1,
+    CPU_AVX2 = 1 << 2,
+    CPU_SHA = 1 << 3,
+    CPU_AVX512 = 1 << 4,
+};
+
+// Returns the cpu_feature_t flags of the processor, 0 on the other
+// processors and where the x86 implementations are not built.
+unsigned int cpu_features();
+
+
+// An expanded Twofish key: the round subkeys and the key dependent
+// S-boxes combined with the MDS matrix.
+struct twofish_key {
+    unsigned int k[40];
+    unsigned int s[4][256];
+};
+
+// Expands a key of 16, 24 or 32 bytes, shorter keys are padded with
+// zeros as the specification says.
+void twofish_setup(twofish_key &key, const unsigned char *data, size_t len);
+
+
+// One implementation of the primitives. The functions an implementation
+// does not have are 0 and are taken from the next implementation in
+// order of speed, the portable one has all of them.
+struct crypto_backend {
+    const char *name;
+
+    // The cpu_feature_t flags the implementation needs.
+    unsigned int features;
+
+    // Runs the SHA-256 compression function over n consecutive 64 byte
+    // blocks.
+    void (*sha256_compress)(unsigned int state[8],
+        const unsigned char *blocks, size_t n);
+
+    // Replaces the digest with its own SHA-256 hash n times, which is
+    // the loop of the V3 key stretching. The digest is passed as the
+    // eight big-endian words of the hash.
+    void (*sha256_stretch)(unsigned int digest[8], unsigned int n);
+
+    // The same as sha256_stretch for sha256_lanes digests at a time, each
+    // one in a lane of the vector registers. The digests are interleaved,
+    // word i of the digest in lane j is digests[i * sha256_lanes + j].
+    size_t sha256_lanes;
+    void (*sha256_stretch_lanes)(unsigned int *digests, unsigned int n);
+
+    // Encrypt or decrypt n independent 16 byte blocks, out and in may be
+    // the same buffer.
+    void (*twofish_encrypt)(const twofish_key &key, unsigned char *out,
+        const unsigned char *in, size_t n);
+    void (*twofish_decrypt)(const twofish_key &key, unsigned char *out,
+        const unsigned char *in, size_t n);
+};
+
+// Returns the functions in use, the name is the one of the fastest
+// implementation taking part. The first call picks the implementations
+// unless select_crypto_backend() has done it.
+const crypto_backend &crypto();
+
+// Returns the names of the implementations that can run on this
+// processor and have passed the self-check, the fastest first.
+std::vector<std::string> crypto_backends();
+
+// Makes crypto() use only the given implementation, and the portable
+// one for what it does not have, in order to test or benchmark it. The
+// PWS_CRYPTO_BACKEND environment variable does the same on the first
+// use. Returns false and leaves the selection as it was if there is no
+// such implementation or it cannot be used. Must not be called while
+// other threads may be using the primitives.
+bool select_crypto_backend(const std::string &name);
+
+
+class sha256 {
+public:
+    static const size_t digest_size = 32;
+    static const size_t block_size = 64;
+
+    sha256();
+    ~sha256();
+
+    void restart();
+    void update(const void *data, size_t len);
+
+    // Stores the digest of the data and restarts the hash.
+    void final(unsigned char *digest);
+
+private:
+    sha256(const sha256 &);
+    sha256 &operator= (const sha256 &);
+
+    const crypto_backend &_impl;
+    unsigned int _state[8];
+    unsigned char _buf[block_size];
+    size_t _buf_len;
+    unsigned long long _len;
+
+    friend class hmac_sha256;
+};
+
+
+class hmac_sha256 {
+public:
+    static const size_t digest_size = sha256::digest_size;
+
+    hmac_sha256();
+    ~hmac_sha256();
+
+    void set_key(const void *key, size_t len);
+    void update(const void *data, size_t len);
+
+    // Stores the MAC of the data and restarts with the same key.
+    void final(unsigned char *mac);
+
+    // The state after the data so far. A MAC with the same key carries
+    // on from there after restore(), as if it had been given the same
+    // data. The state is as secret as the key.
+    struct checkpoint {
+        unsigned int state[8];
+        unsigned char buf[sha256::block_size];
+        size_t buf_len;
+        unsigned long long len;
+    };
+
+    void save(checkpoint &cp) const;
+    void restore(const checkpoint &cp);
+
+private:
+    hmac_sha256(const hmac_sha256 &);
+    hmac_sha256 &operator= (const hmac_sha256 &);
+
+    void restart();
+
+    sha256 _hash;
+
+    // The hash states after the inner and the outer padded key.
+    unsigned int _inner[8];
+    unsigned int _outer[8];
+};
+
+// Derives a key for the purpose named by the label from another key, as
+// the MAC of the label. Stores hmac_sha256::digest_size bytes in out.
+void derive_key(const unsigned char *key, size_t len, const char *label,
+    unsigned char *out);
+
+
+// Twofish in ECB mode, used for the keys in the preamble.
+class twofish_ecb {
+public:
+    static const size_t block_size = 16;
+
+    twofish_ecb();
+    ~twofish_ecb();
+
+    void set_key(const void *key, size_t len);
+
+    // The length must be a multiple of the block size.
+    void encrypt(unsigned char *out, const unsigned char *in, size_t len);
+    void decrypt(unsigned char *out, const unsigned char *in, size_t len);
+
+private:
+    twofish_ecb(const twofish_ecb &);
+    twofish_ecb &operator= (const twofish_ecb &);
+
+    twofish_key _key;
+    const crypto_backend &_impl;
+};
+
+
+// Twofish in CBC mode. The chaining value carries over between the
+// calls to process(), so that a stream can be processed piece by piece.
+// The length passed to process() must be a multiple of the block size,
+// out and in may be the same buffer.
+class twofish_cbc_encryption {
+public:
+    static const size_t block_size = twofish_ecb::block_size;
+
+    twofish_cbc_encryption();
+    ~twofish_cbc_encryption();
+
+    void set_key_with_iv(const void *key, size_t len,
+        const unsigned char *iv);
+    void process(unsigned char *out, const unsigned char *in, size_t len);
+
+private:
+    twofish_cbc_encryption(const twofish_cbc_encryption &);
+    twofish_cbc_encryption &operator= (const twofish_cbc_encryption &);
+
+    twofish_key _key;
+    unsigned char _iv[block_size];
+    const crypto_backend &_impl;
+};
+
+
+class twofish_cbc_decryption {
+public:
+    static const size_t block_size = twofish_ecb::block_size;
+
+    twofish_cbc_decryption();
+    ~twofish_cbc_decryption();
+
+    void set_key_with_iv(const void *key, size_t len,
+        const unsigned char *iv);
+    void process(unsigned char *out, const unsigned char *in, size_t len);
+
+private:
+    twofish_cbc_decryption(const twofish_cbc_decryption &);
+    twofish_cbc_decryption &operator= (const twofish_cbc_decryption &);
+
+    twofish_key _key;
+    unsigned char _iv[block_size];
+    const crypto_backend &_impl;
+};
+
+}
+
+#endif
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_CRYPTO_IMPL_H_
+#define _PWS_CRYPTO_IMPL_H_
+
+#include "crypto.h"
+
+// The implementations of the primitives crypto() picks from, only for
+// use by the crypto code itself.
+
+// The x86 implementations are compiled with the instruction sets enabled
+// per function, so that the rest of the program keeps running on the
+// processors without them. That needs a compiler that knows the target
+// attribute, with older ones only the portable implementation is built.
+#if defined(__i386__) || defined(__x86_64__)
+#if defined(__has_attribute)
+#if __has_attribute(target)
+#define PWS_X86_KERNELS 1
+#endif
+#elif defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define PWS_X86_KERNELS 1
+#endif
+#endif
+
+namespace pws {
+
+// The initial hash value and the round constants of SHA-256.
+extern const unsigned int sha256_iv[8];
+extern const unsigned int sha256_k[64];
+
+extern const crypto_backend portable_backend;
+
+#ifdef PWS_X86_KERNELS
+extern const crypto_backend shani_backend;
+extern const crypto_backend avx512_backend;
+extern const crypto_backend avx2_backend;
+extern const crypto_backend sse2_backend;
+#endif
+
+}
+
+#endif
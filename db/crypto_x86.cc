@@ -0,0 +1,582 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "crypto_impl.h"
+
+// The implementations that use the x86 vector and SHA extensions. Each
+// function enables the instructions it needs itself, crypto() only
+// calls it on the processors that have them.
+
+#ifdef PWS_X86_KERNELS
+
+#include <immintrin.h>
+#include <string.h>
+
+namespace pws {
+
+namespace {
+
+// SHA-256 with the SHA extensions. The state is kept as the ABEF and
+// CDGH halves the sha256rnds2 instruction works on, each instruction
+// runs two rounds. Runs the rounds over the first 16 words of the
+// message schedule in w and adds the result to the state.
+__attribute__((target("sha,sse4.1,ssse3")))
+inline void sha256_rounds_shani(__m128i &state0, __m128i &state1,
+    __m128i w[4])
+{
+    __m128i abef = state0;
+    __m128i cdgh = state1;
+
+    for(int i = 0; i < 16; ++i) {
+        if(i >= 4) {
+            // W[t] = W[t-16] + s0(W[t-15]) + W[t-7] + s1(W[t-2]) for four
+            // words at a time.
+            __m128i t = _mm_sha256msg1_epu32(w[i & 3], w[(i + 1) & 3]);
+            t = _mm_add_epi32(t,
+                _mm_alignr_epi8(w[(i + 3) & 3], w[(i + 2) & 3], 4));
+            w[i & 3] = _mm_sha256msg2_epu32(t, w[(i + 3) & 3]);
+        }
+
+        __m128i msg = _mm_add_epi32(w[i & 3],
+            _mm_loadu_si128((const __m128i *)(sha256_k + 4 * i)));
+
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+    }
+
+    state0 = _mm_add_epi32(state0, abef);
+    state1 = _mm_add_epi32(state1, cdgh);
+}
+
+// Converts the state words A..H in order to the ABEF and CDGH halves.
+__attribute__((target("sha,sse4.1,ssse3")))
+inline void sha256_to_halves(__m128i abcd, __m128i efgh, __m128i &state0,
+    __m128i &state1)
+{
+    abcd = _mm_shuffle_epi32(abcd, 0xb1);
+    efgh = _mm_shuffle_epi32(efgh, 0x1b);
+    state0 = _mm_alignr_epi8(abcd, efgh, 8);
+    state1 = _mm_blend_epi16(efgh, abcd, 0xf0);
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+inline void sha256_from_halves(__m128i state0, __m128i state1,
+    __m128i &abcd, __m128i &efgh)
+{
+    __m128i feba = _mm_shuffle_epi32(state0, 0x1b);
+
+    state1 = _mm_shuffle_epi32(state1, 0xb1);
+    abcd = _mm_blend_epi16(feba, state1, 0xf0);
+    efgh = _mm_alignr_epi8(state1, feba, 8);
+}
+
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_compress_shani(unsigned int state[8],
+    const unsigned char *blocks, size_t n)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+        0x0405060700010203ULL);
+
+    __m128i state0, state1;
+
+    sha256_to_halves(_mm_loadu_si128((const __m128i *)state),
+        _mm_loadu_si128((const __m128i *)(state + 4)), state0, state1);
+
+    for(; n > 0; --n, blocks += 64) {
+        __m128i w[4];
+
+        for(int i = 0; i < 4; ++i) {
+            w[i] = _mm_shuffle_epi8(
+                _mm_loadu_si128((const __m128i *)(blocks + 16 * i)),
+                byte_swap);
+        }
+
+        sha256_rounds_shani(state0, state1, w);
+    }
+
+    __m128i abcd, efgh;
+
+    sha256_from_halves(state0, state1, abcd, efgh);
+    _mm_storeu_si128((__m128i *)state, abcd);
+    _mm_storeu_si128((__m128i *)(state + 4), efgh);
+}
+
+// The digest stays in registers between the iterations and is fed back
+// as the first half of the message, the second half is the constant
+// padding.
+__attribute__((target("sha,sse4.1,ssse3")))
+void sha256_stretch_shani(unsigned int digest[8], unsigned int n)
+{
+    const __m128i pad0 = _mm_set_epi32(0, 0, 0, (int)0x80000000);
+    const __m128i pad1 = _mm_set_epi32(8 * sha256::digest_size, 0, 0, 0);
+
+    __m128i iv0, iv1;
+
+    sha256_to_halves(_mm_loadu_si128((const __m128i *)sha256_iv),
+        _mm_loadu_si128((const __m128i *)(sha256_iv + 4)), iv0, iv1);
+
+    __m128i abcd = _mm_loadu_si128((const __m128i *)digest);
+    __m128i efgh = _mm_loadu_si128((const __m128i *)(digest + 4));
+
+    for(; n > 0; --n) {
+        __m128i w[4] = {abcd, efgh, pad0, pad1};
+        __m128i state0 = iv0, state1 = iv1;
+
+        sha256_rounds_shani(state0, state1, w);
+        sha256_from_halves(state0, state1, abcd, efgh);
+    }
+
+    _mm_storeu_si128((__m128i *)digest, abcd);
+    _mm_storeu_si128((__m128i *)(digest + 4), efgh);
+}
+
+// Several independent stretching chains at a time, one in each 32-bit
+// lane. The rounds are the plain SHA-256 ones on vectors, there is no
+// vector rotation, so it is made of two shifts.
+
+__attribute__((target("sse2")))
+inline __m128i rotr_sse2(__m128i x, int n)
+{
+    return _mm_or_si128(_mm_srli_epi32(x, n), _mm_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("sse2")))
+inline __m128i add_sse2(__m128i a, __m128i b)
+{
+    return _mm_add_epi32(a, b);
+}
+
+__attribute__((target("sse2")))
+void sha256_stretch_sse2(unsigned int *digests, unsigned int n)
+{
+    const int lanes = 4;
+
+    __m128i d[8], iv[8];
+
+    for(int i = 0; i < 8; ++i) {
+        d[i] = _mm_loadu_si128((const __m128i *)(digests + i * lanes));
+        iv[i] = _mm_set1_epi32((int)sha256_iv[i]);
+    }
+
+    for(; n > 0; --n) {
+        __m128i w[16];
+
+        for(int i = 0; i < 8; ++i) {
+            w[i] = d[i];
+        }
+
+        w[8] = _mm_set1_epi32((int)0x80000000);
+        for(int i = 9; i < 15; ++i) {
+            w[i] = _mm_setzero_si128();
+        }
+        w[15] = _mm_set1_epi32(8 * sha256::digest_size);
+
+        __m128i a = iv[0], b = iv[1], c = iv[2], e = iv[4];
+        __m128i f = iv[5], g = iv[6], h = iv[7], dd = iv[3];
+
+        for(int i = 0; i < 64; ++i) {
+            if(i >= 16) {
+                __m128i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m128i s0 = _mm_xor_si128(_mm_xor_si128(rotr_sse2(w15, 7),
+                    rotr_sse2(w15, 18)), _mm_srli_epi32(w15, 3));
+                __m128i s1 = _mm_xor_si128(_mm_xor_si128(rotr_sse2(w2, 17),
+                    rotr_sse2(w2, 19)), _mm_srli_epi32(w2, 10));
+
+                w[i & 15] = add_sse2(add_sse2(w[i & 15], s0),
+                    add_sse2(w[(i - 7) & 15], s1));
+            }
+
+            __m128i s1 = _mm_xor_si128(_mm_xor_si128(rotr_sse2(e, 6),
+                rotr_sse2(e, 11)), rotr_sse2(e, 25));
+            __m128i ch = _mm_xor_si128(_mm_and_si128(e, f),
+                _mm_andnot_si128(e, g));
+            __m128i t1 = add_sse2(add_sse2(h, s1), add_sse2(ch,
+                add_sse2(_mm_set1_epi32((int)sha256_k[i]), w[i & 15])));
+            __m128i s0 = _mm_xor_si128(_mm_xor_si128(rotr_sse2(a, 2),
+                rotr_sse2(a, 13)), rotr_sse2(a, 22));
+            __m128i maj = _mm_or_si128(_mm_and_si128(a, b),
+                _mm_and_si128(c, _mm_or_si128(a, b)));
+            __m128i t2 = add_sse2(s0, maj);
+
+            h = g;
+            g = f;
+            f = e;
+            e = add_sse2(dd, t1);
+            dd = c;
+            c = b;
+            b = a;
+            a = add_sse2(t1, t2);
+        }
+
+        d[0] = add_sse2(a, iv[0]);
+        d[1] = add_sse2(b, iv[1]);
+        d[2] = add_sse2(c, iv[2]);
+        d[3] = add_sse2(dd, iv[3]);
+        d[4] = add_sse2(e, iv[4]);
+        d[5] = add_sse2(f, iv[5]);
+        d[6] = add_sse2(g, iv[6]);
+        d[7] = add_sse2(h, iv[7]);
+    }
+
+    for(int i = 0; i < 8; ++i) {
+        _mm_storeu_si128((__m128i *)(digests + i * lanes), d[i]);
+    }
+}
+
+__attribute__((target("avx2")))
+inline __m256i rotr_avx2(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_srli_epi32(x, n),
+        _mm256_slli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+inline __m256i add_avx2(__m256i a, __m256i b)
+{
+    return _mm256_add_epi32(a, b);
+}
+
+__attribute__((target("avx2")))
+void sha256_stretch_avx2(unsigned int *digests, unsigned int n)
+{
+    const int lanes = 8;
+
+    __m256i d[8], iv[8];
+
+    for(int i = 0; i < 8; ++i) {
+        d[i] = _mm256_loadu_si256((const __m256i *)(digests + i * lanes));
+        iv[i] = _mm256_set1_epi32((int)sha256_iv[i]);
+    }
+
+    for(; n > 0; --n) {
+        __m256i w[16];
+
+        for(int i = 0; i < 8; ++i) {
+            w[i] = d[i];
+        }
+
+        w[8] = _mm256_set1_epi32((int)0x80000000);
+        for(int i = 9; i < 15; ++i) {
+            w[i] = _mm256_setzero_si256();
+        }
+        w[15] = _mm256_set1_epi32(8 * sha256::digest_size);
+
+        __m256i a = iv[0], b = iv[1], c = iv[2], e = iv[4];
+        __m256i f = iv[5], g = iv[6], h = iv[7], dd = iv[3];
+
+        for(int i = 0; i < 64; ++i) {
+            if(i >= 16) {
+                __m256i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(
+                    rotr_avx2(w15, 7), rotr_avx2(w15, 18)),
+                    _mm256_srli_epi32(w15, 3));
+                __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(
+                    rotr_avx2(w2, 17), rotr_avx2(w2, 19)),
+                    _mm256_srli_epi32(w2, 10));
+
+                w[i & 15] = add_avx2(add_avx2(w[i & 15], s0),
+                    add_avx2(w[(i - 7) & 15], s1));
+            }
+
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr_avx2(e, 6),
+                rotr_avx2(e, 11)), rotr_avx2(e, 25));
+            __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f),
+                _mm256_andnot_si256(e, g));
+            __m256i t1 = add_avx2(add_avx2(h, s1), add_avx2(ch,
+                add_avx2(_mm256_set1_epi32((int)sha256_k[i]), w[i & 15])));
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr_avx2(a, 2),
+                rotr_avx2(a, 13)), rotr_avx2(a, 22));
+            __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b),
+                _mm256_and_si256(c, _mm256_or_si256(a, b)));
+            __m256i t2 = add_avx2(s0, maj);
+
+            h = g;
+            g = f;
+            f = e;
+            e = add_avx2(dd, t1);
+            dd = c;
+            c = b;
+            b = a;
+            a = add_avx2(t1, t2);
+        }
+
+        d[0] = add_avx2(a, iv[0]);
+        d[1] = add_avx2(b, iv[1]);
+        d[2] = add_avx2(c, iv[2]);
+        d[3] = add_avx2(dd, iv[3]);
+        d[4] = add_avx2(e, iv[4]);
+        d[5] = add_avx2(f, iv[5]);
+        d[6] = add_avx2(g, iv[6]);
+        d[7] = add_avx2(h, iv[7]);
+    }
+
+    for(int i = 0; i < 8; ++i) {
+        _mm256_storeu_si256((__m256i *)(digests + i * lanes), d[i]);
+    }
+}
+
+// AVX-512 has rotations and three-input logic, which makes the rounds
+// shorter on top of the wider vectors.
+__attribute__((target("avx512f")))
+inline __m512i rotr_avx512(__m512i x, int n)
+{
+    return _mm512_rorv_epi32(x, _mm512_set1_epi32(n));
+}
+
+__attribute__((target("avx512f")))
+inline __m512i xor3_avx512(__m512i a, __m512i b, __m512i c)
+{
+    return _mm512_ternarylogic_epi32(a, b, c, 0x96);
+}
+
+__attribute__((target("avx512f")))
+void sha256_stretch_avx512(unsigned int *digests, unsigned int n)
+{
+    const int lanes = 16;
+
+    __m512i d[8], iv[8];
+
+    for(int i = 0; i < 8; ++i) {
+        d[i] = _mm512_loadu_si512(digests + i * lanes);
+        iv[i] = _mm512_set1_epi32((int)sha256_iv[i]);
+    }
+
+    for(; n > 0; --n) {
+        __m512i w[16];
+
+        for(int i = 0; i < 8; ++i) {
+            w[i] = d[i];
+        }
+
+        w[8] = _mm512_set1_epi32((int)0x80000000);
+        for(int i = 9; i < 15; ++i) {
+            w[i] = _mm512_setzero_si512();
+        }
+        w[15] = _mm512_set1_epi32(8 * sha256::digest_size);
+
+        __m512i a = iv[0], b = iv[1], c = iv[2], e = iv[4];
+        __m512i f = iv[5], g = iv[6], h = iv[7], dd = iv[3];
+
+        for(int i = 0; i < 64; ++i) {
+            if(i >= 16) {
+                __m512i w15 = w[(i - 15) & 15], w2 = w[(i - 2) & 15];
+                __m512i s0 = xor3_avx512(rotr_avx512(w15, 7),
+                    rotr_avx512(w15, 18), _mm512_srli_epi32(w15, 3));
+                __m512i s1 = xor3_avx512(rotr_avx512(w2, 17),
+                    rotr_avx512(w2, 19), _mm512_srli_epi32(w2, 10));
+
+                w[i & 15] = _mm512_add_epi32(_mm512_add_epi32(w[i & 15], s0),
+                    _mm512_add_epi32(w[(i - 7) & 15], s1));
+            }
+
+            __m512i s1 = xor3_avx512(rotr_avx512(e, 6), rotr_avx512(e, 11),
+                rotr_avx512(e, 25));
+            __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xca);
+            __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, s1),
+                _mm512_add_epi32(ch, _mm512_add_epi32(
+                    _mm512_set1_epi32((int)sha256_k[i]), w[i & 15])));
+            __m512i s0 = xor3_avx512(rotr_avx512(a, 2), rotr_avx512(a, 13),
+                rotr_avx512(a, 22));
+            __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xe8);
+            __m512i t2 = _mm512_add_epi32(s0, maj);
+
+            h = g;
+            g = f;
+            f = e;
+            e = _mm512_add_epi32(dd, t1);
+            dd = c;
+            c = b;
+            b = a;
+            a = _mm512_add_epi32(t1, t2);
+        }
+
+        d[0] = _mm512_add_epi32(a, iv[0]);
+        d[1] = _mm512_add_epi32(b, iv[1]);
+        d[2] = _mm512_add_epi32(c, iv[2]);
+        d[3] = _mm512_add_epi32(dd, iv[3]);
+        d[4] = _mm512_add_epi32(e, iv[4]);
+        d[5] = _mm512_add_epi32(f, iv[5]);
+        d[6] = _mm512_add_epi32(g, iv[6]);
+        d[7] = _mm512_add_epi32(h, iv[7]);
+    }
+
+    for(int i = 0; i < 8; ++i) {
+        _mm512_storeu_si512(digests + i * lanes, d[i]);
+    }
+}
+
+// Twofish decryption of eight blocks at a time, one block in each lane.
+// The key dependent S-boxes are looked up with gathers, the rest of the
+// rounds is the same as in the portable code.
+
+__attribute__((target("avx2")))
+inline __m256i rotl_avx2(__m256i x, int n)
+{
+    return _mm256_or_si256(_mm256_slli_epi32(x, n),
+        _mm256_srli_epi32(x, 32 - n));
+}
+
+__attribute__((target("avx2")))
+inline __m256i twofish_g_avx2(const twofish_key &key, __m256i x)
+{
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+
+    __m256i y = _mm256_i32gather_epi32((const int *)key.s[0],
+        _mm256_and_si256(x, byte_mask), 4);
+    y = _mm256_xor_si256(y, _mm256_i32gather_epi32((const int *)key.s[1],
+        _mm256_and_si256(_mm256_srli_epi32(x, 8), byte_mask), 4));
+    y = _mm256_xor_si256(y, _mm256_i32gather_epi32((const int *)key.s[2],
+        _mm256_and_si256(_mm256_srli_epi32(x, 16), byte_mask), 4));
+    y = _mm256_xor_si256(y, _mm256_i32gather_epi32((const int *)key.s[3],
+        _mm256_srli_epi32(x, 24), 4));
+
+    return y;
+}
+
+__attribute__((target("avx2")))
+void twofish_decrypt_avx2(const twofish_key &key, unsigned char *out,
+    const unsigned char *in, size_t n)
+{
+    const size_t lanes = 8;
+
+    // Word k of the block in lane j is the int at 4 * j + k.
+    const __m256i word_index = _mm256_set_epi32(28, 24, 20, 16, 12, 8, 4, 0);
+
+    for(; n >= lanes; n -= lanes, in += 16 * lanes, out += 16 * lanes) {
+        const int *words = (const int *)in;
+
+        __m256i r2 = _mm256_xor_si256(
+            _mm256_i32gather_epi32(words, word_index, 4),
+            _mm256_set1_epi32(key.k[4]));
+        __m256i r3 = _mm256_xor_si256(
+            _mm256_i32gather_epi32(words + 1, word_index, 4),
+            _mm256_set1_epi32(key.k[5]));
+        __m256i r0 = _mm256_xor_si256(
+            _mm256_i32gather_epi32(words + 2, word_index, 4),
+            _mm256_set1_epi32(key.k[6]));
+        __m256i r1 = _mm256_xor_si256(
+            _mm256_i32gather_epi32(words + 3, word_index, 4),
+            _mm256_set1_epi32(key.k[7]));
+
+        for(int i = 14; i >= 0; i -= 2) {
+            __m256i t0 = twofish_g_avx2(key, r2);
+            __m256i t1 = twofish_g_avx2(key, rotl_avx2(r3, 8));
+            __m256i f0 = _mm256_add_epi32(_mm256_add_epi32(t0, t1),
+                _mm256_set1_epi32(key.k[2 * i + 10]));
+            __m256i f1 = _mm256_add_epi32(_mm256_add_epi32(t0,
+                _mm256_add_epi32(t1, t1)),
+                _mm256_set1_epi32(key.k[2 * i + 11]));
+
+            r0 = _mm256_xor_si256(rotl_avx2(r0, 1), f0);
+            r1 = rotl_avx2(_mm256_xor_si256(r1, f1), 31);
+
+            t0 = twofish_g_avx2(key, r0);
+            t1 = twofish_g_avx2(key, rotl_avx2(r1, 8));
+            f0 = _mm256_add_epi32(_mm256_add_epi32(t0, t1),
+                _mm256_set1_epi32(key.k[2 * i + 8]));
+            f1 = _mm256_add_epi32(_mm256_add_epi32(t0,
+                _mm256_add_epi32(t1, t1)),
+                _mm256_set1_epi32(key.k[2 * i + 9]));
+
+            r2 = _mm256_xor_si256(rotl_avx2(r2, 1), f0);
+            r3 = rotl_avx2(_mm256_xor_si256(r3, f1), 31);
+        }
+
+        // There is no scatter in AVX2, the words are put back in place
+        // one by one.
+        unsigned int w[4][lanes];
+
+        _mm256_storeu_si256((__m256i *)w[0],
+            _mm256_xor_si256(r0, _mm256_set1_epi32(key.k[0])));
+        _mm256_storeu_si256((__m256i *)w[1],
+            _mm256_xor_si256(r1, _mm256_set1_epi32(key.k[1])));
+        _mm256_storeu_si256((__m256i *)w[2],
+            _mm256_xor_si256(r2, _mm256_set1_epi32(key.k[2])));
+        _mm256_storeu_si256((__m256i *)w[3],
+            _mm256_xor_si256(r3, _mm256_set1_epi32(key.k[3])));
+
+        for(size_t j = 0; j < lanes; ++j) {
+            for(int k = 0; k < 4; ++k) {
+                memcpy(out + 16 * j + 4 * k, &w[k][j], 4);
+            }
+        }
+    }
+
+    if(n > 0) {
+        portable_backend.twofish_decrypt(key, out, in, n);
+    }
+}
+
+}
+
+const crypto_backend shani_backend = {
+    "shani",
+    CPU_SSSE3 | CPU_SHA,
+    sha256_compress_shani,
+    sha256_stretch_shani,
+    0,
+    0,
+    0,
+    0
+};
+
+
+const crypto_backend avx512_backend = {
+    "avx512",
+    CPU_AVX512,
+    0,
+    0,
+    16,
+    sha256_stretch_avx512,
+    0,
+    0
+};
+
+const crypto_backend avx2_backend = {
+    "avx2",
+    CPU_AVX2,
+    0,
+    0,
+    8,
+    sha256_stretch_avx2,
+    0,
+    twofish_decrypt_avx2
+};
+
+const crypto_backend sse2_backend = {
+    "sse2",
+    CPU_SSE2,
+    0,
+    0,
+    4,
+    sha256_stretch_sse2,
+    0,
+    0
+};
+
+}
+
+#endif
@@ -23,17 +23,32 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <assert.h>
-#include <functional>
+#include <new>
 #include <string.h>
 
 #include "db.h"
 #include "exception.h"
 #include "platform.h"
+#include "util.h"
+
+
+namespace {
+
+// Number of view fields allocated at once.
+const size_t view_block_size = 4096;
+
+} // namespace
 
 
 pws::pws_field::pws_field(int type, const std::string &data)
-    : _type(type), _data(data)
+    : _type(type), _view(0), _view_len(0), _data(data)
+{
+}
+
+pws::pws_field::pws_field(int type, const char *data, size_t len)
+    : _type(type), _view(data), _view_len(len)
 {
 }
 
@@ -42,40 +57,49 @@ int pws::pws_field::get_type() const
     return _type;
 }
 
-const std::string &pws::pws_field::get_data() const
+const char *pws::pws_field::get_bytes() const
+{
+    return _view ? _view : _data.data();
+}
+
+size_t pws::pws_field::get_size() const
+{
+    return _view ? _view_len : _data.size();
+}
+
+std::string pws::pws_field::get_data() const
 {
-    return _data;
+    return std::string(get_bytes(), get_size());
 }
 
 unsigned int pws::pws_field::get_int16() const
 {
-    assert(_data.size() >= 2);
-    return get_int16le((const unsigned char *)_data.c_str());
+    assert(get_size() >= 2);
+    return get_int16le((const unsigned char *)get_bytes());
 }
 
 unsigned int pws::pws_field::get_int32() const
 {
-    assert(_data.size() >= 4);
-    return get_int32le((const unsigned char *)_data.c_str());
+    assert(get_size() >= 4);
+    return get_int32le((const unsigned char *)get_bytes());
 }
 
 void pws::pws_field::get_uuid(uuid_t out) const
 {
-    assert(_data.size() == 16);
-    memcpy(out, _data.c_str(), sizeof(uuid_t));
+    assert(get_size() == 16);
+    memcpy(out, get_bytes(), sizeof(uuid_t));
 }
 
 
 pws::field_holder::~field_holder()
 {
-    for(int i = 0; i < _fields.size(); ++i) {
-        delete _fields[i];
-    }
+    clear();
 }
 
 void pws::field_holder::add_raw_field(int type, const std::string &data)
 {
     _fields.push_back(new pws_field(type, data));
+    _changed = true;
 }
 
 void pws::field_holder::add_int16_field(int type, int data)
@@ -84,20 +108,34 @@ void pws::field_holder::add_int16_field(int type, int data)
     put_int16le(data, buf);
     _fields.push_back(
         new pws_field(type, std::string((char *)buf, sizeof(buf))));
+    _changed = true;
 }
 
 void pws::field_holder::add_uuid_field(int type, uuid_t data)
 {
     _fields.push_back(new pws_field(type,
         std::string((char *)data, sizeof(uuid_t))));
+    _changed = true;
+}
+
+void pws::field_holder::add_view_field(pws_field *field)
+{
+    _fields.push_back(field);
+    _changed = true;
 }
 
 void pws::field_holder::set_field(int type, const std::string &data)
 {
     for(int i = 0; i < _fields.size(); ++i) {
         if(_fields[i]->get_type() == type) {
-            delete _fields[i];
-            _fields[i] = new pws_field(type, data);
+            pws_field *field = new pws_field(type, data);
+
+            if(!_fields[i]->is_view()) {
+                delete _fields[i];
+            }
+
+            _fields[i] = field;
+            _changed = true;
             return;
         }
     }
@@ -108,44 +146,68 @@ void pws::field_holder::set_field(int type, const std::string &data)
 
 bool pws::field_holder::has_field(int type) const
 {
-    for(int i = 0; i < _fields.size(); ++i) {
-        if(_fields[i]->get_type() == type) {
-            return true;
+    return find_field(type) != 0;
+}
+
+void pws::field_holder::remove_field(int type)
+{
+    size_t n = 0;
+
+    // The fields are deleted as they are removed, the type of a field
+    // cannot be checked afterwards.
+    for(size_t i = 0; i < _fields.size(); ++i) {
+        if(_fields[i]->get_type() != type) {
+            _fields[n++] = _fields[i];
+        } else if(!_fields[i]->is_view()) {
+            delete _fields[i];
         }
     }
 
-    return false;
+    if(n != _fields.size()) {
+        _fields.resize(n);
+        _changed = true;
+    }
 }
 
-namespace {
+void pws::field_holder::clear()
+{
+    for(size_t i = 0; i < _fields.size(); ++i) {
+        if(!_fields[i]->is_view()) {
+            delete _fields[i];
+        }
+    }
+
+    if(!_fields.empty()) {
+        _fields.clear();
+        _changed = true;
+    }
+}
 
-struct field_type_equal
-        : public std::binary_function<int, pws::pws_field *, bool>
+pws::pws_field *pws::field_holder::find_field(int type)
 {
-    bool operator() (int type, const pws::pws_field *field) const
-    {
-        return field->get_type() == type;
+    for(size_t i = 0; i < _fields.size(); ++i) {
+        if(_fields[i]->get_type() == type) {
+            return _fields[i];
+        }
     }
-};
 
-} // namespace
+    return 0;
+}
 
-void pws::field_holder::remove_field(int type)
+const pws::pws_field *pws::field_holder::find_field(int type) const
 {
-    std::vector<pws_field *>::iterator i = std::remove_if(
-        _fields.begin(), _fields.end(), std::bind1st(field_type_equal(), type));
-    _fields.erase(i, _fields.end());
+    return const_cast<field_holder *>(this)->find_field(type);
 }
 
 pws::pws_field &pws::field_holder::get_field_by_type(int type)
 {
-    for(int i = 0; i < _fields.size(); ++i) {
-        if(_fields[i]->get_type() == type) {
-            return *(_fields[i]);
-        }
+    pws_field *field = find_field(type);
+
+    if(field == 0) {
+        throw field_not_found();
     }
 
-    throw field_not_found();
+    return *field;
 }
 
 const pws::pws_field &pws::field_holder::get_field_by_type(int type) const
@@ -193,47 +255,44 @@ pws::pws_record::pws_record(const std::string &title, const std::string &pass)
 
 std::string pws::pws_record::get_group() const
 {
-    try {
-        return _fields.get_field_by_type(GROUP).get_text();
-    } catch(field_not_found ex) {
-        return "";
-    }
+    const pws_field *f = _fields.find_field(GROUP);
+    return f ? std::string(f->get_bytes(), f->get_size()) : std::string();
 }
 
 std::string pws::pws_record::get_title() const
 {
-    try {
-        return _fields.get_field_by_type(TITLE).get_text();
-    } catch(field_not_found ex) {
-        return "";
-    }
+    const pws_field *f = _fields.find_field(TITLE);
+    return f ? std::string(f->get_bytes(), f->get_size()) : std::string();
 }
 
 std::string pws::pws_record::get_username() const
 {
-    try {
-        return _fields.get_field_by_type(USERNAME).get_text();
-    } catch(field_not_found ex) {
-        return "";
-    }
+    const pws_field *f = _fields.find_field(USERNAME);
+    return f ? std::string(f->get_bytes(), f->get_size()) : std::string();
 }
 
 std::string pws::pws_record::get_password() const
 {
-    try {
-        return _fields.get_field_by_type(PASSWORD).get_text();
-    } catch(field_not_found ex) {
-        return "";
-    }
+    const pws_field *f = _fields.find_field(PASSWORD);
+    return f ? std::string(f->get_bytes(), f->get_size()) : std::string();
 }
 
 std::string pws::pws_record::get_notes() const
 {
-    try {
-        return _fields.get_field_by_type(NOTES).get_text();
-    } catch(field_not_found ex) {
-        return "";
+    const pws_field *f = _fields.find_field(NOTES);
+    return f ? std::string(f->get_bytes(), f->get_size()) : std::string();
+}
+
+bool pws::pws_record::get_uuid(uuid_t out) const
+{
+    const pws_field *f = _fields.find_field(UUID);
+
+    if(f == 0 || f->get_size() != sizeof(uuid_t)) {
+        return false;
     }
+
+    memcpy(out, f->get_bytes(), sizeof(uuid_t));
+    return true;
 }
 
 void pws::pws_record::set_group(const std::string &g)
@@ -268,6 +327,7 @@ void pws::pws_record::add_raw_field(field_type_t type, const std::string &data)
 
 
 pws::pws_db::pws_db(int version)
+    : _loader(0), _views_used(0)
 {
     uuid_t uuid;
 
@@ -296,6 +356,22 @@ pws::pws_db::~pws_db()
     for(int i = 0; i < _records.size(); ++i) {
         delete _records[i];
     }
+
+    delete _loader;
+
+    // The header outlives this destructor, make sure it does not refer
+    // to the view fields any more.
+    _header.get_fields().clear();
+
+    for(size_t i = 0; i < _views_used; ++i) {
+        _view_blocks[i / view_block_size][i % view_block_size].~pws_field();
+    }
+
+    for(size_t i = 0; i < _view_blocks.size(); ++i) {
+        operator delete(_view_blocks[i]);
+    }
+
+    wipe(_plaintext);
 }
 
 pws::pws_record *pws::pws_db::create_record(
@@ -307,6 +383,10 @@ pws::pws_record *pws::pws_db::create_record(
 void pws::pws_db::add_record(pws_record *record)
 {
     _records.push_back(record);
+
+    if(_loader) {
+        _record_ids.push_back(0);
+    }
 }
 
 pws::pws_record *pws::pws_db::create_empty_record()
@@ -314,6 +394,52 @@ pws::pws_record *pws::pws_db::create_empty_record()
     return new pws_record();
 }
 
+int pws::pws_db::add_record_slots(int n)
+{
+    int first = _records.size();
+    _records.resize(first + n, 0);
+
+    if(_loader) {
+        _record_ids.resize(first + n, 0);
+    }
+
+    return first;
+}
+
+void pws::pws_db::set_record(int index, pws_record *record)
+{
+    _records[index] = record;
+}
+
+void pws::pws_db::set_record_loader(record_loader *loader, int n)
+{
+    _loader = loader;
+    _record_ids.resize(_records.size(), 0);
+
+    for(int i = 0; i < n; ++i) {
+        _records.push_back(0);
+        _record_ids.push_back(i);
+    }
+}
+
+pws::pws_record *pws::pws_db::load_record(int index) const
+{
+    if(!_loader) {
+        return _records[index];
+    }
+
+    scoped_lock lock(_load_mutex);
+
+    if(_records[index] == 0) {
+        // Loading a record may create view fields, the database only
+        // looks const from the outside.
+        _records[index] = _loader->load_record(
+            const_cast<pws_db &>(*this), _record_ids[index]);
+    }
+
+    return _records[index];
+}
+
 int pws::pws_db::num_records() const
 {
     return _records.size();
@@ -321,30 +447,77 @@ int pws::pws_db::num_records() const
 
 pws::pws_record &pws::pws_db::get_record_by_index(int index)
 {
-    return *(_records[index]);
+    return *load_record(index);
 }
 
 const pws::pws_record &pws::pws_db::get_record_by_index(int index) const
 {
-    return *(_records[index]);
+    return *load_record(index);
 }
 
 void pws::pws_db::delete_record(const pws_record &r)
 {
     for(int i = 0; i < _records.size(); ++i) {
         if(_records[i] == &r) {
-            delete _records[i];
+            delete_record_by_index(i);
             break;
         }
     }
-
-    std::vector<pws_record *>::iterator i = std::remove(
-        _records.begin(), _records.end(), &r);
-    _records.erase(i, _records.end());
 }
 
 void pws::pws_db::delete_record_by_index(int index)
 {
-    delete_record(*_records[index]);
+    // A record that has not been loaded does not need to be.
+    delete _records[index];
+    _records.erase(_records.begin() + index);
+
+    if(_loader) {
+        _record_ids.erase(_record_ids.begin() + index);
+    }
+}
+
+void pws::pws_db::move_record_to_end(int index)
+{
+    pws_record *record = _records[index];
+
+    _records.erase(_records.begin() + index);
+    _records.push_back(record);
+
+    if(_loader) {
+        size_t id = _record_ids[index];
+
+        _record_ids.erase(_record_ids.begin() + index);
+        _record_ids.push_back(id);
+    }
+}
+
+void pws::pws_db::swap_records(std::vector<pws_record *> &records)
+{
+    assert(_loader == 0);
+    _records.swap(records);
+}
+
+void pws::pws_db::adopt_plaintext(std::vector<unsigned char> &plaintext)
+{
+    wipe(_plaintext);
+    _plaintext.clear();
+    _plaintext.swap(plaintext);
+}
+
+pws::pws_field *pws::pws_db::create_view_field(int type,
+    const unsigned char *data, size_t len)
+{
+    if(_views_used == _view_blocks.size() * view_block_size) {
+        _view_blocks.push_back(static_cast<pws_field *>(
+            operator new(sizeof(pws_field) * view_block_size)));
+    }
+
+    pws_field *field = _view_blocks[_views_used / view_block_size]
+        + _views_used % view_block_size;
+
+    new(field) pws_field(type, (const char *)data, len);
+    ++_views_used;
+
+    return field;
 }
 
@@ -26,10 +26,13 @@
 #ifndef _PWS_DB_H_
 #define _PWS_DB_H_
 
+#include <stddef.h>
 #include <string>
 #include <vector>
 #include <uuid/uuid.h>
 
+#include "thread.h"
+
 
 namespace pws {
 
@@ -38,20 +41,36 @@ class pws_field {
 public:
     pws_field(int type, const std::string &data);
 
+    // Creates a field that refers to the given data instead of copying
+    // it, the data must outlive the field.
+    pws_field(int type, const char *data, size_t len);
+
     int get_type() const;
-    const std::string &get_data() const;
 
-    const std::string &get_text() const { return get_data(); }
+    // The raw data of the field, cheap for all kinds of fields.
+    const char *get_bytes() const;
+    size_t get_size() const;
+
+    // A copy of the data, built on each call for a field that refers
+    // to external data so that nothing is cached outside the database.
+    std::string get_data() const;
+
+    std::string get_text() const { return get_data(); }
     unsigned int get_time() const { return get_int32(); }
     unsigned int get_int16() const;
     unsigned int get_int32() const;
     void get_uuid(uuid_t out) const;
 
+    // True for the fields that refer to external data.
+    bool is_view() const { return _view != 0; }
+
 private:
     pws_field(const pws_field &);
     pws_field &operator= (const pws_field &);
 
     int _type;
+    const char *_view;
+    size_t _view_len;
     std::string _data;
 };
 
@@ -59,13 +78,18 @@ private:
 // A collection of fields.
 class field_holder {
 public:
-    field_holder() {}
+    field_holder() : _changed(true) {}
     ~field_holder();
 
     void add_raw_field(int type, const std::string &data);
     void add_int16_field(int type, int data);
     void add_uuid_field(int type, uuid_t data);
 
+    // Adds a field that refers to external data. Such fields are owned
+    // by the database that created them and are not deleted by the
+    // holder.
+    void add_view_field(pws_field *field);
+
     // Replaces the previous field of the same type, it is assumed
     // that there is only one occurence of the field. The effect of this
     // method is first calling remove_field() on the given type and then
@@ -76,9 +100,18 @@ public:
     // Will remove all fields of the given type.
     void remove_field(int type);
 
+    // Removes all the fields.
+    void clear();
+
     bool has_field(int type) const;
 
-    // Will return a first occurence of the field of the given type.
+    // Will return a first occurence of the field of the given type or 0
+    // if there is none.
+    pws_field *find_field(int type);
+    const pws_field *find_field(int type) const;
+
+    // The same as find_field() but throws field_not_found if there is
+    // no field of the given type.
     pws_field &get_field_by_type(int type);
     pws_field &get_field_by_index(int index);
     const pws_field &get_field_by_type(int type) const;
@@ -86,12 +119,19 @@ public:
 
     // Total number of fields in the store.
     int num_fields() const;
+
+    // Whether the fields have been changed since mark_unchanged() was
+    // called, a new holder counts as changed. Used by the writers that
+    // only write what has changed since the last save.
+    bool changed() const { return _changed; }
+    void mark_unchanged() { _changed = false; }
     
 private:
     field_holder(const field_holder &);
     field_holder &operator= (const field_holder &);
 
     std::vector<pws_field *> _fields;
+    bool _changed;
 };
 
 class pws_header {
@@ -161,6 +201,10 @@ public:
     std::string get_password() const;
     std::string get_notes() const;
 
+    // Stores the UUID of the record in out, returns false if the record
+    // has no UUID field of the right size.
+    bool get_uuid(uuid_t out) const;
+
     void set_group(const std::string &);
     void set_title(const std::string &);
     void set_username(const std::string &);
@@ -186,6 +230,20 @@ private:
 };
 
 
+class pws_db;
+
+// Builds the records of a database on demand, see
+// pws_db::set_record_loader().
+class record_loader {
+public:
+    virtual ~record_loader() {}
+
+    // Returns a new record with the given id, the caller assumes
+    // ownership of it.
+    virtual pws_record *load_record(pws_db &db, size_t id) = 0;
+};
+
+
 class pws_db {
 public:
     // Creates an empty database with the given version and generates
@@ -219,18 +277,74 @@ public:
     void delete_record(const pws_record &);
     void delete_record_by_index(int index);
 
+    // Moves the record at the given index after all the others, the
+    // records that followed it move one place up.
+    void move_record_to_end(int index);
+
     // Creates a new empty record. An application should not use this call
     // directly because it does not populate the required fields.
     pws_record *create_empty_record();
 
+    // Appends n empty record slots and returns the index of the first
+    // one. The slots are meant to be filled with set_record(), distinct
+    // slots may be filled from different threads. These methods are
+    // considered low-level and are used by the readers.
+    int add_record_slots(int n);
+    void set_record(int index, pws_record *record);
+
+    // Appends n records that are only built by the loader when they
+    // are accessed for the first time, their ids are 0 to n - 1. The
+    // database assumes ownership of the loader, which can be set only
+    // once. This method is considered low-level and is used by the
+    // readers.
+    void set_record_loader(record_loader *loader, int n);
+
+    // Exchanges the records of the database with the given ones, the
+    // database assumes ownership of the new records and the caller of
+    // the old ones. Cannot be used once there is a loader. This method
+    // is considered low-level and is used by save_scheduler to keep its
+    // copy of a database.
+    void swap_records(std::vector<pws_record *> &records);
+
+    // Takes over the decrypted contents of a database file, the buffer
+    // is left empty. The memory is wiped when the database is destroyed.
+    // This method is considered low-level and is used by the readers
+    // that keep the fields in place.
+    void adopt_plaintext(std::vector<unsigned char> &plaintext);
+
+    // Creates a field referring to data inside the adopted plaintext.
+    // The field is owned by the database and can be added to its header
+    // or records with field_holder::add_view_field(). This method is
+    // considered low-level and is used by the readers.
+    pws_field *create_view_field(int type, const unsigned char *data,
+        size_t len);
+
 private:
-    pws_db() {}
+    pws_db() : _loader(0), _views_used(0) {}
 
     pws_db(const pws_db &);
     pws_db &operator= (const pws_db &);
 
+    // Returns the record at the given index, loading it if needed. Safe
+    // to call from several threads on a const database.
+    pws_record *load_record(int index) const;
+
     pws_header _header;
-    std::vector<pws_record *> _records;
+
+    // The records that have not been loaded yet are null. Their loader
+    // ids are kept alongside if the database has a loader.
+    mutable std::vector<pws_record *> _records;
+    std::vector<size_t> _record_ids;
+    record_loader *_loader;
+
+    // Held while a record is looked up or loaded if there is a loader.
+    mutable mutex _load_mutex;
+
+    std::vector<unsigned char> _plaintext;
+
+    // The view fields are allocated in blocks rather than one by one.
+    std::vector<pws_field *> _view_blocks;
+    size_t _views_used;
 };
 
 }
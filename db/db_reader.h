@@ -26,13 +26,48 @@
 #ifndef _PWS_DB_READER_H_
 #define _PWS_DB_READER_H_
 
+#include "exception.h"
+
 namespace pws {
 
 class pws_db;
+struct db_visitor;
 
 struct db_reader {
     virtual ~db_reader() {}
     virtual pws_db *read() = 0;
+
+    // Passes the contents of the database to the visitor as they are
+    // read without building the database in memory.
+    virtual void visit(db_visitor &visitor) = 0;
+
+    // The same as read() and visit() but return false and store the
+    // error code instead of throwing pws_io_exception. They only spare
+    // the caller the try block: errors are still thrown inside the
+    // reader and caught here. What does not go through exceptions any
+    // more is the normal course of reading, such as the end of the
+    // encrypted data and looking up fields that are not there.
+    bool try_read(pws_db *&db, io_error_code_t &error)
+    {
+        try {
+            db = read();
+            return true;
+        } catch(pws_io_exception &ex) {
+            error = ex.error_code();
+            return false;
+        }
+    }
+
+    bool try_visit(db_visitor &visitor, io_error_code_t &error)
+    {
+        try {
+            visit(visitor);
+            return true;
+        } catch(pws_io_exception &ex) {
+            error = ex.error_code();
+            return false;
+        }
+    }
 };
 
 }
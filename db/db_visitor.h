@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_DB_VISITOR_H_
+#define _PWS_DB_VISITOR_H_
+
+#include <stddef.h>
+
+namespace pws {
+
+class byte_sink;
+
+// Receives the contents of a database while it is being read, see
+// db_reader::visit(). The data passed to the callbacks is valid only
+// during the call.
+//
+// The file is authenticated only after everything has been passed to
+// the visitor, so nothing received can be trusted until on_verified()
+// is called. If the authentication fails visit() throws
+// pws_io_exception(HMAC_DID_NOT_MATCH) instead.
+struct db_visitor {
+    virtual ~db_visitor() {}
+
+    virtual void on_header_field(int type, const char *data, size_t len) {}
+    virtual void on_record_begin() {}
+    virtual void on_field(int type, const char *data, size_t len) {}
+
+    // Called for each record field before its data is read. Returning a
+    // sink makes the data go to the sink a piece at a time instead of
+    // being collected and passed to on_field(), which suits the fields
+    // too large to be kept in memory.
+    virtual byte_sink *field_sink(int type, size_t len) { return 0; }
+
+    // Not called for an incomplete last record, such a record should
+    // be discarded the same way the readers drop it.
+    virtual void on_record_end() {}
+
+    virtual void on_verified() {}
+};
+
+}
+
+#endif
@@ -28,9 +28,28 @@
 
 pws::db_reader *pws::create_reader(const std::string &file,
     const std::string &key)
+{
+    return create_reader(file, key, read_options());
+}
+
+pws::db_reader *pws::create_reader(const std::string &file,
+    const std::string &key, const read_options &options)
+{
+    // TODO do real check
+    return new db_reader_v3(file, key, options);
+}
+
+pws::db_reader *pws::create_reader(byte_source &source,
+    const std::string &key)
+{
+    return create_reader(source, key, read_options());
+}
+
+pws::db_reader *pws::create_reader(byte_source &source,
+    const std::string &key, const read_options &options)
 {
     // TODO do real check
-    return new db_reader_v3(file, key);
+    return new db_reader_v3(source, key, options);
 }
 
 pws::db_writer *pws::create_writer(const pws_db &db)
@@ -33,11 +33,21 @@ namespace pws {
 class pws_db;
 class db_reader;
 class db_writer;
+class byte_source;
+struct read_options;
 
 
 // The caller assumes ownership of the reader.
 db_reader *create_reader(const std::string &file,
     const std::string &key);
+db_reader *create_reader(const std::string &file,
+    const std::string &key, const read_options &options);
+
+// Creates a reader over the given source, which must outlive the reader.
+// The caller assumes ownership of the reader.
+db_reader *create_reader(byte_source &source, const std::string &key);
+db_reader *create_reader(byte_source &source, const std::string &key,
+    const read_options &options);
 
 // The caller assumes ownership of the writer.
 db_writer *create_writer(const pws_db &db);
@@ -24,22 +24,29 @@
  */
 
 #include <algorithm>
-#include <cryptopp/hmac.h>
-#include <cryptopp/modes.h>
-#include <cryptopp/osrng.h>
-#include <cryptopp/sha.h>
-#include <cryptopp/twofish.h>
+#include <cryptopp/secblock.h>
+#include <fcntl.h>
+#include <new>
 #include <stdio.h>
 #include <string>
 #include <string.h>
+#include <sys/stat.h>
 #include <vector>
 #include <unistd.h>
 
 #include "dbiov3.h"
+#include "byteio.h"
+#include "crypto.h"
 #include "db.h"
+#include "db_visitor.h"
+#include "drbg.h"
 #include "exception.h"
+#include "journal.h"
 #include "keystretch.h"
 #include "platform.h"
+#include "record_index.h"
+#include "save_scheduler.h"
+#include "thread.h"
 #include "util.h"
 
 
@@ -47,15 +54,10 @@ namespace pws {
 
 namespace {
 
-const int BLOCK_SIZE = CryptoPP::Twofish::BLOCKSIZE;
+const int BLOCK_SIZE = twofish_ecb::block_size;
 
-// This is an exception thrown by a low level reading method
-// when an enf of file block is encountered.
-struct end_of_file {
-    static const char eof_tag[];
-};
-
-const char end_of_file::eof_tag[] = "PWS3-EOFPWS3-EOF";
+// The block that ends the encrypted data, it is stored unencrypted.
+const char eof_tag[] = "PWS3-EOFPWS3-EOF";
 
 const char pws_tag[] = {'P', 'W', 'S', '3'};
 
@@ -63,505 +65,3011 @@ const char pws_tag[] = {'P', 'W', 'S', '3'};
 // key when writing the file.
 const int keystretch_iter = 2048;
 
+// The tag, the salt, the number of iterations, the hash of the stretched
+// key, the two encrypted keys and the IV.
+const size_t preamble_size = 4 + 32 + 4 + sha256::digest_size
+    + 2 * 32 + twofish_ecb::block_size;
+
+// Field lengths are stored in 32 bits.
+const size_t max_field_len = 0xffffffffUL;
+
+// Up to this many bytes are reserved for a field as soon as its length
+// is known. A longer (or a corrupted) length makes the buffer grow as
+// the data comes in.
+const size_t max_field_reserve = 16 * 1024 * 1024;
+
+// The writer encrypts the whole blocks of a field in chunks of this
+// size.
+const size_t write_chunk_size = 16 * 1024;
+
+// The bulk decryption does not split the data into runs shorter than
+// this (in blocks), smaller runs are not worth a thread.
+const size_t min_blocks_per_thread = 4096;
+
+
+// The stream reader decrypts up to this many blocks at a time.
+const size_t read_ahead_blocks = 64;
+
+
+// The primitives the V3 reader and writer are built from. The codec
+// classes below take them as a template parameter so that their inner
+// loops make direct calls; another cipher or MAC implementation is
+// plugged in with a struct like this one.
+struct v3_codec {
+    typedef twofish_cbc_decryption decryption;
+    typedef twofish_cbc_encryption encryption;
+    typedef hmac_sha256 mac;
+};
+
+// Read from a source or write to a sink of a known type with a direct
+// call, which can be inlined, rather than through the virtual interface.
+// The abstract types are still read and written through it.
+template <class Source>
+inline const byte *source_read(Source &source, size_t len)
+{
+    return source.Source::read(len);
+}
+
+template <>
+inline const byte *source_read(byte_source &source, size_t len)
+{
+    return source.read(len);
+}
+
+template <class Sink>
+inline void sink_write(Sink &sink, const void *buf, size_t len)
+{
+    sink.Sink::write(buf, len);
+}
+
+template <>
+inline void sink_write(byte_sink &sink, const void *buf, size_t len)
+{
+    sink.write(buf, len);
+}
+
+
+// Throws pws_io_exception(LIMIT_EXCEEDED) if the value is over the
+// limit, a zero limit stands for no limit.
+void check_limit(size_t value, size_t limit)
+{
+    if(limit != 0 && value > limit) {
+        throw pws_io_exception(LIMIT_EXCEEDED);
+    }
+}
+
+// Returns the number of blocks a field with data of the given length
+// takes.
+size_t field_blocks(size_t len)
+{
+    size_t n_blocks = 1;
+
+    if(len > (size_t)BLOCK_SIZE - 5) {
+        n_blocks += (len - (BLOCK_SIZE - 5) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    }
+
+    return n_blocks;
+}
+
+// Returns the number of bytes the fields followed by the end field take
+// in the file and adds the bytes of padding among them to padding. No
+// fields take nothing at all, see writer::write_fields().
+size_t fields_size(const field_holder &fields, size_t &padding)
+{
+    if(fields.num_fields() == 0) {
+        return 0;
+    }
+
+    size_t size = BLOCK_SIZE;
+
+    padding += BLOCK_SIZE - 5;
+
+    for(int i = 0; i < fields.num_fields(); ++i) {
+        size_t len = fields.get_field_by_index(i).get_size();
+        size_t n = field_blocks(len) * BLOCK_SIZE;
+
+        size += n;
+        padding += n - 5 - len;
+    }
+
+    return size;
+}
+
+// Returns the size of the file the database is written to, the sizes
+// of the fields are all it depends on.
+size_t file_size(const pws_db &db, size_t &padding)
+{
+    size_t size = preamble_size;
+
+    padding = 0;
+    size += fields_size(db.get_header().get_fields(), padding);
+
+    for(int i = 0; i < db.num_records(); ++i) {
+        size += fields_size(db.get_record_by_index(i).get_fields(), padding);
+    }
+
+    return size + BLOCK_SIZE + hmac_sha256::digest_size;
+}
+
+
+// Decrypts a run of CBC blocks. Each plaintext block depends only on
+// its own and the preceding ciphertext block, so the runs are independent
+// as long as each one starts with the right IV.
+template <class Decryption>
+class cbc_decrypt_task : public runnable {
+public:
+    cbc_decrypt_task(const byte *key, int key_len, const byte *iv,
+            const byte *in, byte *out, size_t len)
+        : _key(key), _key_len(key_len), _iv(iv), _in(in), _out(out), _len(len)
+    {
+    }
+
+    virtual void run()
+    {
+        Decryption cipher;
+
+        cipher.set_key_with_iv(_key, _key_len, _iv);
+        cipher.process(_out, _in, _len);
+    }
+
+private:
+    const byte *_key;
+    int _key_len;
+    const byte *_iv;
+    const byte *_in;
+    byte *_out;
+    size_t _len;
+};
+
+// Decrypts n_blocks of CBC ciphertext using up to n_threads threads.
+template <class Decryption>
+void cbc_decrypt(const byte *key, int key_len, const byte *iv,
+    const byte *in, byte *out, size_t n_blocks, int n_threads)
+{
+    size_t n_runs = std::min((size_t)n_threads,
+        n_blocks / min_blocks_per_thread);
+    n_runs = std::max(n_runs, (size_t)1);
+
+    std::vector<cbc_decrypt_task<Decryption> > tasks;
+    size_t start = 0;
+
+    for(size_t i = 0; i < n_runs; ++i) {
+        size_t end = n_blocks * (i + 1) / n_runs;
+        const byte *run_iv = start == 0 ? iv : in + (start - 1) * BLOCK_SIZE;
+
+        tasks.push_back(cbc_decrypt_task<Decryption>(key, key_len, run_iv,
+            in + start * BLOCK_SIZE, out + start * BLOCK_SIZE,
+            (end - start) * BLOCK_SIZE));
+        start = end;
+    }
+
+    std::vector<runnable *> runs;
+
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        runs.push_back(&tasks[i]);
+    }
+
+    run_parallel(runs);
+}
+
+
+// Size (in blocks) of the chunks passed between the stages of the read
+// pipeline and the number of chunks in flight.
+const size_t pipeline_chunk_blocks = 4096;
+const size_t pipeline_chunks = 8;
+
+// A piece of the plaintext on its way through the read pipeline along
+// with the parts of it that have to go through the HMAC.
+struct pipeline_chunk {
+    pipeline_chunk() : data(pipeline_chunk_blocks * BLOCK_SIZE) {}
+
+    CryptoPP::SecByteBlock data;
+    size_t len;
+
+    // The EOF block follows the chunk.
+    bool last;
+
+    // The source ended before the EOF block.
+    bool truncated;
+
+    // (offset, length) pairs of the HMAC input in the order it has to
+    // be hashed.
+    std::vector<std::pair<size_t, size_t> > hmac_spans;
+};
+
+typedef bounded_queue<pipeline_chunk *> chunk_queue;
+
+// Decrypts the source chunk by chunk until the EOF block, the source
+// is left positioned right after it.
+template <class Decryption, class Source>
+class decrypt_stage : public runnable {
+public:
+    decrypt_stage(Source &source, Decryption &cipher,
+            chunk_queue &in, chunk_queue &out)
+        : _source(source), _cipher(cipher), _in(in), _out(out)
+    {
+    }
+
+    virtual void run()
+    {
+        pipeline_chunk *c;
+
+        while(_in.pop(c)) {
+            c->len = 0;
+            c->last = false;
+            c->truncated = false;
+            c->hmac_spans.clear();
+
+            while(c->len < c->data.size()) {
+                const byte *in = source_read(_source, BLOCK_SIZE);
+
+                if(in == 0) {
+                    c->truncated = true;
+                    break;
+                }
+
+                if(memcmp(in, eof_tag, BLOCK_SIZE) == 0) {
+                    c->last = true;
+                    break;
+                }
+
+                memcpy(c->data + c->len, in, BLOCK_SIZE);
+                c->len += BLOCK_SIZE;
+            }
+
+            // The whole chunk at once, so the cipher can work on several
+            // blocks in parallel.
+            _cipher.process(c->data, c->data, c->len);
+
+            bool done = c->last || c->truncated;
+
+            if(!_out.push(c) || done) {
+                return;
+            }
+        }
+    }
+
+private:
+    Source &_source;
+    Decryption &_cipher;
+    chunk_queue &_in;
+    chunk_queue &_out;
+};
+
+// Feeds the parts of the parsed chunks recorded by the parser to the
+// HMAC and recycles the chunks.
+template <class Mac>
+class hmac_stage : public runnable {
+public:
+    hmac_stage(Mac &hmac,
+            chunk_queue &in, chunk_queue &out)
+        : _hmac(hmac), _in(in), _out(out)
+    {
+    }
+
+    virtual void run()
+    {
+        pipeline_chunk *c;
+
+        while(_in.pop(c)) {
+            for(size_t i = 0; i < c->hmac_spans.size(); ++i) {
+                _hmac.update(c->data + c->hmac_spans[i].first,
+                    c->hmac_spans[i].second);
+            }
+
+            bool done = c->last || c->truncated;
+
+            if(!_out.push(c) || done) {
+                return;
+            }
+        }
+    }
+
+private:
+    Mac &_hmac;
+    chunk_queue &_in;
+    chunk_queue &_out;
+};
+
+// Runs the decryption and the HMAC on their own threads while the
+// caller parses the plaintext. The chunks circulate from the free
+// queue through the decryption, the parser and the HMAC back to the
+// free queue, so memory use is bounded by the number of chunks.
+template <class Codec, class Source>
+class read_pipeline {
+public:
+    typedef typename Codec::decryption decryption;
+    typedef typename Codec::mac mac;
+
+    read_pipeline(Source &source, decryption &cipher, mac &hmac)
+        : _chunks(pipeline_chunks), _free(pipeline_chunks),
+          _decrypted(pipeline_chunks), _parsed(pipeline_chunks),
+          _decrypt(source, cipher, _free, _decrypted),
+          _hash(hmac, _parsed, _free),
+          _decrypt_thread(_decrypt), _hash_thread(_hash),
+          _cur(0), _cur_pos(0), _done(false)
+    {
+        for(size_t i = 0; i < _chunks.size(); ++i) {
+            _free.push(&_chunks[i]);
+        }
+
+        try {
+            _decrypt_thread.start();
+            _hash_thread.start();
+        } catch(...) {
+            close();
+            throw;
+        }
+    }
+
+    ~read_pipeline()
+    {
+        close();
+    }
+
+    // Returns the next plaintext block, the data is valid until the
+    // next call. Returns 0 after the last block.
+    const byte *next_block()
+    {
+        while(_cur == 0 || _cur_pos == _cur->len) {
+            if(_done) {
+                return 0;
+            }
+
+            if(_cur) {
+                // The chunk is recycled by the other stages as soon as it
+                // is pushed, its flags cannot be looked at afterwards.
+                bool truncated = _cur->truncated;
+                bool last = _cur->last;
+
+                _parsed.push(_cur);
+                _cur = 0;
+
+                if(truncated) {
+                    throw pws_io_exception(MALFORMED_FILE);
+                }
+
+                if(last) {
+                    _done = true;
+                    return 0;
+                }
+            }
+
+            if(!_decrypted.pop(_cur)) {
+                throw pws_io_exception();
+            }
+
+            _cur_pos = 0;
+        }
+
+        const byte *ret = _cur->data + _cur_pos;
+        _cur_pos += BLOCK_SIZE;
+        return ret;
+    }
+
+    // Queues data of the block last returned by next_block() for
+    // the HMAC.
+    void hmac_update(const byte *data, size_t len)
+    {
+        _cur->hmac_spans.push_back(
+            std::make_pair((size_t)(data - _cur->data), len));
+    }
+
+    // Waits for the HMAC to go through all the data once next_block()
+    // has signalled the end of file.
+    void finish()
+    {
+        _decrypt_thread.join();
+        _hash_thread.join();
+    }
+
+private:
+    read_pipeline(const read_pipeline &);
+    read_pipeline &operator= (const read_pipeline &);
+
+    // Makes the stages give up, the threads are joined when destroyed.
+    void close()
+    {
+        _free.close();
+        _decrypted.close();
+        _parsed.close();
+    }
+
+    std::vector<pipeline_chunk> _chunks;
+    chunk_queue _free;
+    chunk_queue _decrypted;
+    chunk_queue _parsed;
+
+    decrypt_stage<decryption, Source> _decrypt;
+    hmac_stage<mac> _hash;
+
+    // Declared last so that the threads are joined before anything
+    // they use is destroyed.
+    thread _decrypt_thread;
+    thread _hash_thread;
+
+    pipeline_chunk *_cur;
+    size_t _cur_pos;
+    bool _done;
+};
+
+
+// A helper class that generates a unique temporary filename
+// alongside the given file and using the given file name as
+// a template. This class ensures that the temporary file is
+// removed when it is going out of scope.
+class tmp_file {
+public:
+    explicit tmp_file(const std::string &orig_name)
+    {
+        std::string dir(dirname(orig_name));
+
+        if(dir.empty()) {
+            dir = "./";
+        }
+
+        char *tm = tempnam(dir.c_str(), filename(orig_name + ".").c_str());
+        _tmp_name = tm;
+        free(tm);
+    }
+
+    ~tmp_file()
+    {
+        unlink(_tmp_name.c_str());
+    }
+
+    const std::string &name() const { return _tmp_name; }
+
+private:
+    tmp_file(const tmp_file &);
+    tmp_file &operator= (const tmp_file &);
+
+    std::string _tmp_name;
+};
+
+// Prefetches the source, meant to run while the key is being stretched.
+class prefetch_task : public runnable {
+public:
+    explicit prefetch_task(byte_source &source) : _source(source) {}
+
+    virtual void run() { _source.prefetch(); }
+
+private:
+    byte_source &_source;
+};
+
+
+// Records are not built on separate threads in groups smaller than this.
+const size_t min_records_per_thread = 256;
+
+// Location of a field in the bulk plaintext.
+struct field_span {
+    int type;
+    size_t offset;
+    size_t len;
+};
+
+// Reads the length and the type of the field at the given offset of the
+// plaintext. Returns the number of blocks the field takes or 0 if it does
+// not fit in the plaintext.
+size_t scan_field(const byte *plain, size_t plain_len, size_t pos,
+    field_span &span)
+{
+    if(plain_len - pos < (size_t)BLOCK_SIZE) {
+        return 0;
+    }
+
+    const byte *buf = plain + pos;
+
+    span.type = buf[4];
+    span.len = get_int32le(buf);
+    span.offset = pos + 5;
+
+    size_t n_blocks = field_blocks(span.len);
+
+    if(n_blocks > (plain_len - pos) / BLOCK_SIZE) {
+        return 0;
+    }
+
+    return n_blocks;
+}
+
+// Adds the fields found at the given offset of the plaintext up to the
+// end field as view fields. The fields must have been scanned before.
+// Returns the offset following the end field.
+size_t add_view_fields(pws_db &db, field_holder &fields, const byte *plain,
+    size_t plain_len, size_t pos)
+{
+    field_span span;
+    size_t n_blocks;
+
+    while((n_blocks = scan_field(plain, plain_len, pos, span)) != 0) {
+        pos += n_blocks * BLOCK_SIZE;
+
+        if(span.type == 0xff) {
+            break;
+        }
+
+        fields.add_view_field(db.create_view_field(span.type,
+            plain + span.offset, span.len));
+    }
+
+    return pos;
+}
+
+// Loads the records of a lazily read database from the plaintext the
+// database holds on to.
+class lazy_loader : public record_loader {
+public:
+    // Takes over the record offsets, the vector is left empty.
+    lazy_loader(const byte *plain, size_t plain_len,
+            std::vector<size_t> &offsets)
+        : _plain(plain), _plain_len(plain_len)
+    {
+        _offsets.swap(offsets);
+    }
+
+    virtual pws_record *load_record(pws_db &db, size_t id)
+    {
+        scoped_ptr<pws_record> rec(db.create_empty_record());
+        add_view_fields(db, rec->get_fields(), _plain, _plain_len,
+            _offsets[id]);
+        return rec.release();
+    }
+
+private:
+    const byte *_plain;
+    size_t _plain_len;
+    std::vector<size_t> _offsets;
+};
+
+// Builds the given range of records from the scanned fields. Record r
+// is made of the fields from bounds[r] up to bounds[r + 1], the header
+// ends at bounds[0].
+class record_build_task : public runnable {
+public:
+    record_build_task(pws_db &db, const byte *plain,
+        const std::vector<field_span> &spans,
+        const std::vector<pws_field *> &views,
+        const std::vector<size_t> &bounds, size_t first, size_t last,
+        int first_slot)
+        : _db(db), _plain(plain), _spans(spans), _views(views),
+          _bounds(bounds), _first(first), _last(last),
+          _first_slot(first_slot), _failed(false) {}
+
+    virtual void run();
+
+    // Returns true if the task ran out of memory.
+    bool failed() const { return _failed; }
+
+private:
+    pws_db &_db;
+    const byte *_plain;
+    const std::vector<field_span> &_spans;
+    const std::vector<pws_field *> &_views;
+    const std::vector<size_t> &_bounds;
+    size_t _first;
+    size_t _last;
+    int _first_slot;
+    bool _failed;
+};
+
+void record_build_task::run()
+{
+    try {
+        for(size_t r = _first; r < _last; ++r) {
+            scoped_ptr<pws_record> rec(_db.create_empty_record());
+            field_holder &fields = rec->get_fields();
+
+            for(size_t i = _bounds[r]; i < _bounds[r + 1]; ++i) {
+                const field_span &span = _spans[i];
+
+                if(span.type == 0xff) {
+                    continue;
+                }
+
+                if(!_views.empty()) {
+                    fields.add_view_field(_views[i]);
+                } else {
+                    fields.add_raw_field(span.type, std::string(
+                        (const char *)_plain + span.offset, span.len));
+                }
+            }
+
+            _db.set_record(_first_slot + (r - _first), rec.release());
+        }
+    } catch(...) {
+        _failed = true;
+    }
+}
+
+// Feeds the field data to the HMAC in the file order.
+template <class Mac>
+class hmac_task : public runnable {
+public:
+    hmac_task(Mac &hmac, const byte *plain,
+        const std::vector<field_span> &spans)
+        : _hmac(hmac), _plain(plain), _spans(spans) {}
+
+    virtual void run()
+    {
+        for(size_t i = 0; i < _spans.size(); ++i) {
+            _hmac.update(_plain + _spans[i].offset, _spans[i].len);
+        }
+    }
+
+private:
+    Mac &_hmac;
+    const byte *_plain;
+    const std::vector<field_span> &_spans;
+};
+
 
 // The reader should be discarded after calling the read() method.
+template <class Codec, class Source>
 class reader {
 public:
-    reader(FILE *file, const std::string &key);
+    typedef typename Codec::decryption decryption;
+    typedef typename Codec::mac mac;
+
+    reader(Source &source, const std::string &key,
+        const read_options &options);
+    ~reader();
+
+    pws_db *read();
+    void visit(db_visitor &visitor);
+
+    // Checks the preamble and sets up the cipher and the HMAC. Called
+    // by read() and visit(), the other users stop reading after it.
+    void open();
+
+    // The keys and the IV from the preamble, valid after open().
+    const byte *get_k() const { return _k; }
+    const byte *get_l() const { return _l; }
+    const byte *get_iv() const { return _iv; }
+
+private:
+    reader(const reader &);
+    reader &operator= (const reader &);
+
+    // Returns a pointer to the next len bytes of the source, the data
+    // is valid until the next read from the source.
+    const byte *read_file(size_t len);
+
+    // Returns the next decrypted block (of the cipher block size), the
+    // data is valid until the next call. Returns 0 if the block was
+    // the EOF block.
+    const byte *read_cbc();
+
+    // Reads the blocks up to the EOF block, but no more than
+    // read_ahead_blocks of them, and decrypts them into the span.
+    // Returns false if there were none left.
+    bool fill_span();
+
+    // Reads everything up to the EOF block and decrypts it in one go.
+    void decrypt_bulk();
+
+    // Feeds field data of the block last returned by read_cbc() to
+    // the HMAC.
+    void update_hmac(const byte *data, size_t len);
+
+    // Counts a field against the limits in the options, the end fields
+    // included.
+    void count_field(int type, size_t len);
+
+    void check_tag();
+    void check_passphrase();
+    void check_hmac();
+    void read_b_fields();
+
+    // Reads the fields up to the end field into the holder. Returns
+    // false if the data ends first.
+    bool read_fields(field_holder &fields);
+
+    void read_header(pws_db &db);
+    void read_records(pws_db &db);
+
+    // Reads one field and stores its type. The data buffer passed to
+    // the method will be filled in with the field's data. Returns false
+    // if the data ends before the field.
+    bool read_field(int &type, std::string &data);
+
+    // Reads the first block of a field, stores the type of the field and
+    // its length. The data has to be read with one of the following
+    // methods before the next field. Returns false if there are no
+    // fields left.
+    bool begin_field(int &type, size_t &len);
+
+    // Return false if the data ends in the middle of the field.
+    bool read_field_data(size_t len, std::string &data);
+    bool read_field_data(size_t len, byte_sink &out);
+
+    // Splits the bulk plaintext into fields and records and builds the
+    // database from them, see parse_bulk() for the details.
+    void parse_bulk(pws_db &db);
+
+    // Authenticates the bulk plaintext and builds the header, the
+    // records are only located and left to a loader.
+    void parse_lazy(pws_db &db);
+
+    // Writes the record index of the bulk plaintext to the index file.
+    void write_index();
+
+private:
+    Source &_source;
+    std::string _key;
+    std::string _stretched_key;
+    read_options _options;
+
+    decryption _cipher;
+    mac _hmac;
+
+    byte _k[BLOCK_SIZE * 2];
+    byte _l[BLOCK_SIZE * 2];
+    byte _iv[BLOCK_SIZE];
+
+    // The blocks decrypted ahead by read_cbc(), the offset of the next
+    // one to return and whether the EOF block has been read.
+    byte _span[read_ahead_blocks * BLOCK_SIZE];
+    size_t _span_len;
+    size_t _span_pos;
+    bool _span_eof;
+
+    // The plaintext of all the records and the stored HMAC when
+    // decrypting in bulk. The buffer might be handed over to the
+    // database, the data pointer stays valid regardless.
+    std::vector<byte> _plain;
+    const byte *_plain_data;
+    size_t _plain_len;
+    const byte *_saved_hmac;
+
+    // The first block of the field being read.
+    const byte *_field_block;
+
+    // What has been read so far, to check against the limits.
+    size_t _plain_read;
+    size_t _n_ends;
+    size_t _n_fields;
+
+    // The offsets in the bulk plaintext where the header and each of the
+    // records end.
+    std::vector<size_t> _record_ends;
+
+    scoped_ptr<read_pipeline<Codec, Source> > _pipeline;
+};
+
+
+// A point after the header or a record of a written file that a writer
+// can carry on from: where the file ends there, the last block of the
+// ciphertext up to there (the IV of the blocks that follow) and the
+// state of the HMAC.
+template <class Mac>
+struct record_mark {
+    size_t end;
+    byte block[BLOCK_SIZE];
+    typename Mac::checkpoint mac;
+};
+
+// Writes the preamble and the header in begin(), then the records one
+// at a time and the end of the file in finish(). The writer should be
+// discarded after calling finish(). The stream writer holds the writers
+// through this interface whatever they are composed of.
+class field_writer {
+public:
+    virtual ~field_writer() {}
+
+    virtual void begin(const field_holder &header) = 0;
+    virtual void write_field(int type, const char *data, size_t len) = 0;
+
+    // Writes a field of the given length reading its data from the
+    // source. Throws pws_io_exception(WRITE_ERROR) if the source is
+    // shorter or the field too long for the format.
+    virtual void write_field(int type, byte_source &source, size_t len) = 0;
+
+    // Writes the fields followed by the end field, nothing at all if
+    // there are no fields.
+    virtual void write_fields(const field_holder &fields) = 0;
+
+    virtual void finish() = 0;
+};
+
+template <class Codec, class Sink>
+class writer : public field_writer {
+public:
+    typedef typename Codec::encryption encryption;
+    typedef typename Codec::mac mac;
+
+    writer(Sink &sink, const std::string &key);
+    ~writer();
+
+    virtual void begin(const field_holder &header);
+    virtual void write_field(int type, const char *data, size_t len);
+    virtual void write_field(int type, byte_source &source, size_t len);
+    virtual void write_fields(const field_holder &fields);
+    virtual void finish();
+
+    typedef record_mark<mac> mark;
+
+    // Writes the whole database in one pass: the plaintext of all the
+    // fields is laid out in one buffer of the exact size, encrypted in
+    // one go and passed to the sink in one write, then the sink is
+    // flushed. Used instead of the other methods. If marks is not null
+    // the marks after the header and after each record are appended to
+    // it.
+    void write_db(const pws_db &db, std::vector<mark> *marks = 0);
+
+    // Writes the records from the given one on, the end of the file and
+    // the HMAC like write_db() does, carrying on from a mark of a file
+    // written with the given keys. The file up to the mark must have
+    // been written to the sink already. Appends the marks after the
+    // records written.
+    void write_tail(const pws_db &db, int from, const byte *k,
+        const byte *l, const mark &start, std::vector<mark> &marks);
+
+    // The keys of the file written by write_db().
+    const byte *k() const { return _k; }
+    const byte *l() const { return _l; }
+
+    // The HMAC at the end of the file, once it has been written.
+    const byte *hmac() const { return _file_hmac; }
+
+private:
+    writer(const writer &);
+    writer &operator= (const writer &);
+
+    void write_file(const void *buf, size_t len);
+
+    // Writes the preamble and sets up the cipher and the HMAC.
+    void write_preamble();
+
+    // Lays out a field as write_field() writes it at out, taking the
+    // padding from pad. Advances both past what has been used.
+    void put_field(int type, const char *data, size_t len, byte *&out,
+        const byte *&pad);
+    void put_fields(const field_holder &fields, byte *&out,
+        const byte *&pad);
+
+    // Lays out, encrypts and writes the fields of the records from the
+    // given one on, of the header first if it is -1, followed by the end
+    // of the file and the HMAC, then flushes the sink. The blocks are
+    // chained to the IV and go to the file at the offset pos.
+    void write_body(const pws_db &db, int from, size_t pos, const byte *iv,
+        std::vector<mark> *marks);
+
+    // Appends a mark for the end of the data laid out at out so far.
+    void add_mark(const byte *out, const byte *body,
+        std::vector<mark> *marks);
+
+    // Queues a block (of the cipher block size) from the buffer to be
+    // encrypted and written to the file.
+    void write_cbc(const void *buf);
+
+    // Encrypts the queued blocks and writes them to the file.
+    void flush_cbc();
+
+    void write_tag();
+    void write_passphrase();
+    void write_b_fields();
+    void write_iv();
+    void write_eof();
+    void write_hmac();
+
+private:
+    Sink &_sink;
+    std::string _key;
+    std::string _stretched_key;
+
+    drbg _rng;
+    encryption _cipher;
+    mac _hmac;
+
+    byte _k[BLOCK_SIZE * 2];
+    byte _l[BLOCK_SIZE * 2];
+    byte _iv[BLOCK_SIZE];
+    byte _file_hmac[mac::digest_size];
+
+    // The blocks queued by write_cbc(), also the buffer the whole blocks
+    // of long fields are encrypted in.
+    byte _pending[write_chunk_size];
+    size_t _pending_len;
+};
+
+
+template <class Codec, class Source>
+reader<Codec, Source>::reader(Source &source, const std::string &key,
+        const read_options &options)
+    : _source(source), _key(key), _options(options), _span_len(0),
+      _span_pos(0), _span_eof(false), _plain_data(0), _plain_len(0),
+      _saved_hmac(0), _field_block(0), _plain_read(0), _n_ends(0),
+      _n_fields(0), _pipeline(0)
+{
+    if(_options.lazy) {
+        _options.zero_copy = true;
+    }
+
+    if(!_options.index_file.empty()) {
+        _options.bulk = true;
+        _options.pipeline = false;
+    }
+
+    if(_options.zero_copy) {
+        _options.bulk = true;
+        _options.pipeline = false;
+    } else if(_options.pipeline) {
+        _options.bulk = false;
+    }
+
+    // A source that buffers the file must not take in more than a file
+    // within the limit can hold.
+    if(_options.max_plaintext != 0) {
+        _source.set_limit(preamble_size + _options.max_plaintext
+            + BLOCK_SIZE + hmac_sha256::digest_size);
+    }
+}
+
+template <class Codec, class Source>
+reader<Codec, Source>::~reader()
+{
+    wipe(_plain);
+    wipe(_span, sizeof(_span));
+}
+
+template <class Codec, class Source>
+const byte *reader<Codec, Source>::read_file(size_t len)
+{
+    const byte *buf = source_read(_source, len);
+
+    if(buf == 0) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    return buf;
+}
+
+template <class Codec, class Source>
+const byte *reader<Codec, Source>::read_cbc()
+{
+    // The limit is checked for whole fields by begin_field().
+    _plain_read += BLOCK_SIZE;
+
+    if(_pipeline.get()) {
+        return _pipeline->next_block();
+    }
+
+    if(_span_pos == _span_len && !fill_span()) {
+        return 0;
+    }
+
+    const byte *ret = _span + _span_pos;
+    _span_pos += BLOCK_SIZE;
+    return ret;
+}
+
+template <class Codec, class Source>
+bool reader<Codec, Source>::fill_span()
+{
+    _span_len = 0;
+    _span_pos = 0;
+
+    // Nothing is read past the EOF block, check_hmac() expects the
+    // source to be positioned right after it.
+    while(!_span_eof && _span_len < sizeof(_span)) {
+        const byte *in = read_file(BLOCK_SIZE);
+
+        if(memcmp(in, eof_tag, BLOCK_SIZE) == 0) {
+            _span_eof = true;
+            break;
+        }
+
+        memcpy(_span + _span_len, in, BLOCK_SIZE);
+        _span_len += BLOCK_SIZE;
+    }
+
+    // The blocks are decrypted in one go so that the cipher can work on
+    // several of them in parallel.
+    _cipher.process(_span, _span, _span_len);
+    return _span_len > 0;
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::decrypt_bulk()
+{
+    size_t len;
+    const byte *data = _source.read_rest(len);
+    size_t n_blocks = 0;
+
+    while(1) {
+        if((n_blocks + 1) * BLOCK_SIZE > len) {
+            throw pws_io_exception(MALFORMED_FILE);
+        }
+
+        if(memcmp(data + n_blocks * BLOCK_SIZE, eof_tag,
+                BLOCK_SIZE) == 0) {
+            break;
+        }
+
+        ++n_blocks;
+    }
+
+    size_t hmac_off = (n_blocks + 1) * BLOCK_SIZE;
+
+    if(len - hmac_off < mac::digest_size) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    check_limit(n_blocks * BLOCK_SIZE, _options.max_plaintext);
+
+    _saved_hmac = data + hmac_off;
+    _plain.resize(n_blocks * BLOCK_SIZE);
+    _plain_len = _plain.size();
+    _plain_data = _plain_len ? &_plain[0] : 0;
+
+    if(n_blocks > 0) {
+        int n_threads = _options.threads > 0 ? _options.threads : num_cpus();
+        cbc_decrypt<decryption>(_k, sizeof(_k), _iv, data, &_plain[0],
+            n_blocks, n_threads);
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::parse_bulk(pws_db &db)
+{
+    // The first pass only follows the length prefixes to find where the
+    // fields and the records are. A field running past the end of the
+    // plaintext ends the scan the same way the EOF block ends the
+    // stream reader.
+    std::vector<field_span> spans;
+    std::vector<size_t> bounds;
+    size_t pos = 0;
+
+    field_span span;
+    size_t n_blocks;
+
+    while((n_blocks = scan_field(_plain_data, _plain_len, pos, span)) != 0) {
+        count_field(span.type, span.len);
+        spans.push_back(span);
+        pos += n_blocks * BLOCK_SIZE;
+
+        if(span.type == 0xff) {
+            bounds.push_back(spans.size());
+            _record_ends.push_back(pos);
+        }
+    }
+
+    if(bounds.empty()) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    std::vector<pws_field *> views;
+
+    if(_options.zero_copy) {
+        views.resize(spans.size(), 0);
+
+        for(size_t i = 0; i < spans.size(); ++i) {
+            if(spans[i].type != 0xff) {
+                views[i] = db.create_view_field(spans[i].type,
+                    _plain_data + spans[i].offset, spans[i].len);
+            }
+        }
+    }
+
+    field_holder &header = db.get_header().get_fields();
+
+    for(size_t i = 0; i + 1 < bounds[0]; ++i) {
+        if(_options.zero_copy) {
+            header.add_view_field(views[i]);
+        } else {
+            header.add_raw_field(spans[i].type, std::string(
+                (const char *)_plain_data + spans[i].offset, spans[i].len));
+        }
+    }
+
+    // The second pass builds the records on as many threads as there
+    // are worth, while the HMAC goes over all the fields in order on
+    // one more thread. The fields of an incomplete last record are
+    // authenticated but the record itself is dropped.
+    size_t n_records = bounds.size() - 1;
+    int n_threads = _options.threads > 0 ? _options.threads : num_cpus();
+    size_t n_runs = std::min((size_t)n_threads,
+        n_records / min_records_per_thread);
+    n_runs = std::max(n_runs, (size_t)1);
+
+    int first_slot = db.add_record_slots(n_records);
+    std::vector<record_build_task> tasks;
+    size_t start = 0;
+
+    for(size_t i = 0; i < n_runs; ++i) {
+        size_t end = n_records * (i + 1) / n_runs;
+
+        tasks.push_back(record_build_task(db, _plain_data, spans, views,
+            bounds, start, end, first_slot + start));
+        start = end;
+    }
+
+    hmac_task<mac> hmac(_hmac, _plain_data, spans);
+    std::vector<runnable *> runs;
+
+    runs.push_back(&hmac);
+
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        runs.push_back(&tasks[i]);
+    }
+
+    run_parallel(runs);
+
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        if(tasks[i].failed()) {
+            throw std::bad_alloc();
+        }
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::parse_lazy(pws_db &db)
+{
+    // The offsets of the header and of each complete record, the
+    // fields of an incomplete last record are authenticated only.
+    std::vector<size_t> offsets;
+    size_t pos = 0;
+    size_t start = 0;
+    field_span span;
+    size_t n_blocks;
+
+    while((n_blocks = scan_field(_plain_data, _plain_len, pos, span)) != 0) {
+        count_field(span.type, span.len);
+        _hmac.update(_plain_data + span.offset, span.len);
+        pos += n_blocks * BLOCK_SIZE;
+
+        if(span.type == 0xff) {
+            offsets.push_back(start);
+            _record_ends.push_back(pos);
+            start = pos;
+        }
+    }
+
+    if(offsets.empty()) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    add_view_fields(db, db.get_header().get_fields(), _plain_data,
+        _plain_len, 0);
+    offsets.erase(offsets.begin());
+
+    int n_records = offsets.size();
+    db.set_record_loader(new lazy_loader(_plain_data, _plain_len, offsets),
+        n_records);
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::write_index()
+{
+    record_index index(_k, _l);
+
+    for(size_t r = 1; r < _record_ends.size(); ++r) {
+        size_t begin = _record_ends[r - 1];
+        size_t end = _record_ends[r];
+        size_t pos = begin;
+        field_span span;
+        size_t n_blocks;
+        record_location loc;
+
+        // Records without a UUID cannot be looked up and are left out.
+        while((n_blocks = scan_field(_plain_data, end, pos, span)) != 0) {
+            if(span.type == pws_record::UUID && span.len == sizeof(uuid_t)) {
+                break;
+            }
+
+            pos += n_blocks * BLOCK_SIZE;
+        }
+
+        if(n_blocks == 0) {
+            continue;
+        }
+
+        memcpy(loc.uuid, _plain_data + span.offset, sizeof(uuid_t));
+        loc.first_block = begin / BLOCK_SIZE;
+        loc.n_blocks = (end - begin) / BLOCK_SIZE;
+        index.record_mac(_plain_data + begin, end - begin, loc.mac);
+        index.add(loc);
+    }
+
+    tmp_file temp(_options.index_file);
+
+    {
+        fd_guard f(::open(temp.name().c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+            0600));
+
+        if(f.fd() < 0) {
+            throw pws_io_exception(CANNOT_WRITE_FILE);
+        }
+
+        fd_sink sink(f.fd());
+        index.save(sink, _saved_hmac);
+
+        if(!sync_file(f.fd())) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+    }
+
+    if(!rename_synced(temp.name(), _options.index_file)) {
+        throw pws_io_exception();
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::count_field(int type, size_t len)
+{
+    check_limit(len, _options.max_field_len);
+
+    if(type != 0xff) {
+        check_limit(++_n_fields, _options.max_fields_per_record);
+        return;
+    }
+
+    // The first end field is the end of the header.
+    check_limit(_n_ends++, _options.max_records);
+    _n_fields = 0;
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::update_hmac(const byte *data, size_t len)
+{
+    if(_pipeline.get()) {
+        _pipeline->hmac_update(data, len);
+    } else {
+        _hmac.update(data, len);
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::check_tag() {
+    const byte *buf = source_read(_source, sizeof(pws_tag));
+
+    if(buf == 0) {
+        throw pws_io_exception(INVALID_TAG);
+    }
+
+    if (memcmp(pws_tag, buf, sizeof(pws_tag)) != 0) {
+        throw pws_io_exception(INVALID_TAG);
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::check_passphrase()
+{
+    std::string salt((const char *)read_file(32), 32);
+    unsigned int n_iter = get_int32le(read_file(4));
+
+    sha256 h;
+    const int digestsize = sha256::digest_size;
+    byte key_hash[digestsize];
+    byte saved_key_hash[digestsize];
+
+    memcpy(saved_key_hash, read_file(digestsize), digestsize);
+
+    // Stretching the key takes a while, use the time to bring the rest
+    // of the file in.
+    prefetch_task prefetch(_source);
+    thread prefetch_thread(prefetch);
+
+    if(_options.pipeline) {
+        prefetch_thread.start();
+    }
+
+    _stretched_key = stretch_key(salt, _key, n_iter);
+    prefetch_thread.join();
+
+    h.update((const byte *)_stretched_key.c_str(), _stretched_key.length());
+    h.final(key_hash);
+
+    if (memcmp(key_hash, saved_key_hash, digestsize) != 0) {
+        throw pws_io_exception(INVALID_PASSWORD);
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::check_hmac()
+{
+    byte hmac_out[mac::digest_size];
+
+    _hmac.final(hmac_out);
+    const byte *buf = _saved_hmac ? _saved_hmac : read_file(sizeof(hmac_out));
+
+    if(memcmp(buf, hmac_out, sizeof(hmac_out)) != 0) {
+        throw pws_io_exception(HMAC_DID_NOT_MATCH);
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::read_b_fields()
+{
+    twofish_ecb twofish;
+
+    twofish.set_key((const byte *)_stretched_key.c_str(),
+        _stretched_key.length());
+
+    twofish.decrypt(_k, read_file(sizeof(_k)), sizeof(_k));
+    twofish.decrypt(_l, read_file(sizeof(_l)), sizeof(_l));
+}
+
+template <class Codec, class Source>
+bool reader<Codec, Source>::read_field(int &type, std::string &data)
+{
+    size_t len;
+
+    return begin_field(type, len) && read_field_data(len, data);
+}
+
+template <class Codec, class Source>
+bool reader<Codec, Source>::begin_field(int &type, size_t &len)
+{
+    _field_block = read_cbc();
+
+    if(!_field_block) {
+        return false;
+    }
+
+    len = get_int32le(_field_block);
+    type = _field_block[4];
+
+    count_field(type, len);
+    check_limit(_plain_read + (field_blocks(len) - 1) * BLOCK_SIZE,
+        _options.max_plaintext);
+
+    return true;
+}
+
+template <class Codec, class Source>
+bool reader<Codec, Source>::read_field_data(size_t len, std::string &data)
+{
+    data.clear();
+    data.reserve(std::min(len, max_field_reserve));
+
+    memory_sink sink(data);
+    return read_field_data(len, sink);
+}
+
+template <class Codec, class Source>
+bool reader<Codec, Source>::read_field_data(size_t len, byte_sink &out)
+{
+    size_t data_len = std::min(len, (size_t)BLOCK_SIZE - 5);
+
+    out.write(_field_block + 5, data_len);
+    update_hmac(_field_block + 5, data_len);
+    len -= data_len;
+
+    while(len > 0) {
+        const byte *buf = read_cbc();
+
+        if(!buf) {
+            return false;
+        }
+
+        data_len = std::min(len, (size_t)BLOCK_SIZE);
+        out.write(buf, data_len);
+        update_hmac(buf, data_len);
+        len -= data_len;
+    }
+
+    return true;
+}
+
+template <class Codec, class Source>
+bool reader<Codec, Source>::read_fields(field_holder &fields)
+{
+    std::string data;
+    int type;
+
+    while(read_field(type, data)) {
+        if(type == 0xff) {
+            return true;
+        }
+
+        fields.add_raw_field(type, data);
+    }
+
+    return false;
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::read_header(pws_db &db)
+{
+    if(!read_fields(db.get_header().get_fields())) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::read_records(pws_db &db)
+{
+    while(1) {
+        scoped_ptr<pws_record> rec(db.create_empty_record());
+
+        if(!read_fields(rec->get_fields())) {
+            break;
+        }
+
+        db.add_record(rec.release());
+    }
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::open()
+{
+    check_tag();
+    check_passphrase();
+    read_b_fields();
+    memcpy(_iv, read_file(sizeof(_iv)), sizeof(_iv));
+
+    _cipher.set_key_with_iv(_k, sizeof(_k), _iv);
+    _hmac.set_key(_l, sizeof(_l));
+}
+
+template <class Codec, class Source>
+pws_db *reader<Codec, Source>::read()
+{
+    scoped_ptr<pws_db> db(pws_db::create_empty());
+
+    open();
+
+    if(_options.bulk) {
+        decrypt_bulk();
+
+        // The fields are going to refer to the plaintext, so it has to
+        // live as long as the database.
+        if(_options.zero_copy) {
+            db->adopt_plaintext(_plain);
+        }
+
+        if(_options.lazy) {
+            parse_lazy(*db);
+        } else {
+            parse_bulk(*db);
+        }
+    } else {
+        if(_options.pipeline) {
+            _pipeline.reset(new read_pipeline<Codec, Source>(_source, _cipher,
+            _hmac));
+        }
+
+        read_header(*db);
+        read_records(*db);
+
+        if(_pipeline.get()) {
+            _pipeline->finish();
+        }
+    }
+
+    check_hmac();
+
+    if(!_options.index_file.empty()) {
+        write_index();
+    }
+
+    return db.release();
+}
+
+template <class Codec, class Source>
+void reader<Codec, Source>::visit(db_visitor &visitor)
+{
+    open();
+
+    if(_options.pipeline) {
+        _pipeline.reset(new read_pipeline<Codec, Source>(_source, _cipher,
+            _hmac));
+    }
+
+    std::string data;
+    int type;
+
+    while(1) {
+        if(!read_field(type, data)) {
+            throw pws_io_exception(MALFORMED_FILE);
+        }
+
+        if(type == 0xff) {
+            break;
+        }
+
+        visitor.on_header_field(type, data.data(), data.size());
+    }
+
+    size_t len;
+
+    while(begin_field(type, len)) {
+        bool complete = true;
+
+        visitor.on_record_begin();
+
+        while(complete && type != 0xff) {
+            byte_sink *sink = visitor.field_sink(type, len);
+
+            if(sink) {
+                complete = read_field_data(len, *sink);
+            } else {
+                complete = read_field_data(len, data);
+                if(complete) {
+                    visitor.on_field(type, data.data(), data.size());
+                }
+            }
+
+            complete = complete && begin_field(type, len);
+        }
+
+        // A record cut short by the end of the data never gets its
+        // on_record_end(), the other readers drop such records too.
+        if(!complete || !read_field_data(len, data)) {
+            break;
+        }
+
+        visitor.on_record_end();
+    }
+
+    if(_pipeline.get()) {
+        _pipeline->finish();
+    }
+
+    check_hmac();
+    visitor.on_verified();
+}
+
+template <class Codec, class Sink>
+writer<Codec, Sink>::writer(Sink &sink, const std::string &key)
+    : _sink(sink), _key(key), _pending_len(0)
+{
+}
+
+template <class Codec, class Sink>
+writer<Codec, Sink>::~writer()
+{
+    wipe(_pending, sizeof(_pending));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_file(const void *buf, size_t len)
+{
+    sink_write(_sink, buf, len);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_cbc(const void *buf)
+{
+    memcpy(_pending + _pending_len, buf, BLOCK_SIZE);
+    _pending_len += BLOCK_SIZE;
+
+    if(_pending_len == sizeof(_pending)) {
+        flush_cbc();
+    }
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::flush_cbc()
+{
+    if(_pending_len == 0) {
+        return;
+    }
+
+    _cipher.process(_pending, _pending, _pending_len);
+    write_file(_pending, _pending_len);
+    _pending_len = 0;
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_tag()
+{
+    write_file(pws_tag, sizeof(pws_tag));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_passphrase()
+{
+    char salt[32];
+    unsigned char n_iter[4];
+
+    _rng.generate((byte *)salt, sizeof(salt));
+    put_int32le(keystretch_iter, n_iter);
+
+    _stretched_key = stretch_key(std::string(salt, sizeof(salt)),
+        _key, keystretch_iter);
+
+    sha256 h;
+    const int digestsize = sha256::digest_size;
+    byte key_hash[digestsize];
+
+    h.update((const byte *)_stretched_key.c_str(), _stretched_key.length());
+    h.final(key_hash);
+
+    write_file(salt, sizeof(salt));
+    write_file(n_iter, sizeof(n_iter));
+    write_file(key_hash, sizeof(key_hash));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_b_fields()
+{
+    twofish_ecb twofish;
+
+    twofish.set_key((const byte *)_stretched_key.c_str(),
+        _stretched_key.length());
+
+    _rng.generate(_k, sizeof(_k));
+    _rng.generate(_l, sizeof(_l));
+
+    byte buf_k[sizeof(_k)];
+    byte buf_l[sizeof(_l)];
+
+    twofish.encrypt(buf_k, _k, sizeof(_k));
+    twofish.encrypt(buf_l, _l, sizeof(_l));
+
+    write_file(buf_k, sizeof(buf_k));
+    write_file(buf_l, sizeof(buf_l));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_iv()
+{
+    _rng.generate(_iv, sizeof(_iv));
+    write_file(_iv, sizeof(_iv));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_field(int type, const char *data, size_t len)
+{
+    memory_source source(data, len);
+    write_field(type, source, len);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_field(int type, byte_source &source, size_t len)
+{
+    if(len > max_field_len) {
+        throw pws_io_exception(WRITE_ERROR);
+    }
+
+    byte buf[BLOCK_SIZE];
+    size_t head_len = std::min(len, (size_t)BLOCK_SIZE - 5);
+    const byte *data = source.read(head_len);
+
+    if(data == 0) {
+        throw pws_io_exception(WRITE_ERROR);
+    }
+
+    // The first block holds the length, the type and the beginning of
+    // the data. Any unfilled space at the end of a block is padded
+    // with random data.
+    put_int32le(len, buf);
+    buf[4] = type;
+    memcpy(buf + 5, data, head_len);
+
+    if(head_len < (size_t)BLOCK_SIZE - 5) {
+        _rng.generate(buf + 5 + head_len, BLOCK_SIZE - 5 - head_len);
+    }
+
+    write_cbc(buf);
+    _hmac.update(buf + 5, head_len);
+    len -= head_len;
+
+    // The whole blocks go through the cipher a chunk at a time straight
+    // from the source, after the blocks queued before them.
+    if(len >= (size_t)BLOCK_SIZE) {
+        flush_cbc();
+    }
+
+    while(len >= (size_t)BLOCK_SIZE) {
+        size_t chunk_len = std::min(len / BLOCK_SIZE * BLOCK_SIZE,
+            sizeof(_pending));
+
+        if((data = source.read(chunk_len)) == 0) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+
+        _hmac.update(data, chunk_len);
+        _cipher.process(_pending, data, chunk_len);
+        write_file(_pending, chunk_len);
+        len -= chunk_len;
+    }
+
+    if(len > 0) {
+        if((data = source.read(len)) == 0) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+
+        memcpy(buf, data, len);
+        _rng.generate(buf + len, BLOCK_SIZE - len);
+
+        write_cbc(buf);
+        _hmac.update(buf, len);
+    }
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_fields(const field_holder &fields)
+{
+    if(fields.num_fields() == 0) {
+        return;
+    }
+
+    for(int i = 0; i < fields.num_fields(); ++i) {
+        const pws_field &f = fields.get_field_by_index(i);
+        write_field(f.get_type(), f.get_bytes(), f.get_size());
+    }
+
+    write_field(0xff, "", 0);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_eof()
+{
+    flush_cbc();
+
+    // write the EOF block
+    write_file(eof_tag, BLOCK_SIZE);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_hmac()
+{
+    _hmac.final(_file_hmac);
+    write_file(_file_hmac, sizeof(_file_hmac));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_preamble()
+{
+    write_tag();
+    write_passphrase();
+    write_b_fields();
+    write_iv();
+
+    _cipher.set_key_with_iv(_k, sizeof(_k), _iv);
+    _hmac.set_key(_l, sizeof(_l));
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::begin(const field_holder &header)
+{
+    write_preamble();
+    write_fields(header);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::put_field(int type, const char *data, size_t len,
+    byte *&out, const byte *&pad)
+{
+    if(len > max_field_len) {
+        throw pws_io_exception(WRITE_ERROR);
+    }
+
+    size_t n_pad = field_blocks(len) * BLOCK_SIZE - 5 - len;
+
+    put_int32le(len, out);
+    out[4] = type;
+    memcpy(out + 5, data, len);
+    memcpy(out + 5 + len, pad, n_pad);
+    _hmac.update(data, len);
+
+    out += 5 + len + n_pad;
+    pad += n_pad;
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::put_fields(const field_holder &fields, byte *&out,
+    const byte *&pad)
+{
+    if(fields.num_fields() == 0) {
+        return;
+    }
+
+    for(int i = 0; i < fields.num_fields(); ++i) {
+        const pws_field &f = fields.get_field_by_index(i);
+        put_field(f.get_type(), f.get_bytes(), f.get_size(), out, pad);
+    }
+
+    put_field(0xff, "", 0, out, pad);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::add_mark(const byte *out, const byte *body,
+    std::vector<mark> *marks)
+{
+    if(marks == 0) {
+        return;
+    }
+
+    // The offset and the block are filled in once the body has been
+    // encrypted.
+    marks->push_back(mark());
+    marks->back().end = out - body;
+    _hmac.save(marks->back().mac);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_body(const pws_db &db, int from, size_t pos,
+    const byte *iv, std::vector<mark> *marks)
+{
+    size_t n_pad = 0;
+    size_t data_len = 0;
+
+    if(from < 0) {
+        data_len += fields_size(db.get_header().get_fields(), n_pad);
+    }
+
+    for(int i = std::max(from, 0); i < db.num_records(); ++i) {
+        data_len += fields_size(db.get_record_by_index(i).get_fields(),
+            n_pad);
+    }
+
+    size_t len = data_len + BLOCK_SIZE + mac::digest_size;
+
+    // The padding of all the fields comes from the generator in one go.
+    std::vector<byte> padding(n_pad);
+    std::vector<byte> body(len);
+
+    // The body holds plaintext until it is encrypted in place, the
+    // padding is as secret.
+    try {
+        if(n_pad > 0) {
+            _rng.generate(&padding[0], n_pad);
+        }
+
+        byte *out = &body[0];
+        const byte *pad = n_pad > 0 ? &padding[0] : 0;
+        size_t first_mark = marks ? marks->size() : 0;
+
+        if(from < 0) {
+            put_fields(db.get_header().get_fields(), out, pad);
+            add_mark(out, &body[0], marks);
+        }
+
+        for(int i = std::max(from, 0); i < db.num_records(); ++i) {
+            put_fields(db.get_record_by_index(i).get_fields(), out, pad);
+            add_mark(out, &body[0], marks);
+        }
+
+        _cipher.process(&body[0], &body[0], data_len);
+        memcpy(&body[data_len], eof_tag, BLOCK_SIZE);
+        _hmac.final(_file_hmac);
+        memcpy(&body[data_len + BLOCK_SIZE], _file_hmac, sizeof(_file_hmac));
+
+        for(size_t i = first_mark; marks && i < marks->size(); ++i) {
+            mark &m = (*marks)[i];
+
+            memcpy(m.block, m.end > 0 ? &body[m.end - BLOCK_SIZE] : iv,
+                BLOCK_SIZE);
+            m.end += pos;
+        }
+
+        write_file(&body[0], len);
+        _sink.flush();
+    } catch(...) {
+        wipe(body);
+        wipe(padding);
+        throw;
+    }
+
+    wipe(padding);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_db(const pws_db &db, std::vector<mark> *marks)
+{
+    write_preamble();
+    write_body(db, -1, preamble_size, _iv, marks);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::write_tail(const pws_db &db, int from,
+    const byte *k, const byte *l, const mark &start, std::vector<mark> &marks)
+{
+    _cipher.set_key_with_iv(k, sizeof(_k), start.block);
+    _hmac.set_key(l, sizeof(_l));
+    _hmac.restore(start.mac);
+
+    write_body(db, from, start.end, start.block, &marks);
+}
+
+template <class Codec, class Sink>
+void writer<Codec, Sink>::finish()
+{
+    write_eof();
+    write_hmac();
+
+    _sink.flush();
+}
+
+// The compositions in use. Files are mapped into memory when read and
+// written through fd_sink, the sources and the sinks the callers pass
+// in are used through their virtual interface.
+typedef reader<v3_codec, memory_source> memory_reader;
+typedef reader<v3_codec, byte_source> source_reader;
+typedef writer<v3_codec, fd_sink> file_writer;
+typedef writer<v3_codec, byte_sink> sink_writer;
+
+// Reads the HMAC stored at the end of a database file.
+void read_file_hmac(const std::string &file, byte *hmac)
+{
+    const size_t hmac_size = hmac_sha256::digest_size;
+    fd_guard f(open(file.c_str(), O_RDONLY));
+    struct stat st;
+
+    if(f.fd() < 0) {
+        throw pws_io_exception(FILE_NOT_FOUND);
+    }
+
+    if(fstat(f.fd(), &st) != 0
+            || (size_t)st.st_size < preamble_size + BLOCK_SIZE + hmac_size
+            || pread(f.fd(), hmac, hmac_size, st.st_size - hmac_size)
+                != (ssize_t)hmac_size) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+}
+
+// Whether the two have the same modification time, to the nanosecond
+// where the file system keeps it.
+bool same_mtime(const struct stat &a, const struct stat &b)
+{
+#ifdef __APPLE__
+    return a.st_mtimespec.tv_sec == b.st_mtimespec.tv_sec
+        && a.st_mtimespec.tv_nsec == b.st_mtimespec.tv_nsec;
+#else
+    return a.st_mtim.tv_sec == b.st_mtim.tv_sec
+        && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+#endif
+}
+
+} // namespace
+
+
+db_reader_v3::db_reader_v3(const std::string &file, const std::string &key,
+        const read_options &options)
+    : _file(file), _key(key), _source(0), _options(options)
+{
+}
+
+db_reader_v3::db_reader_v3(byte_source &source, const std::string &key,
+        const read_options &options)
+    : _key(key), _source(&source), _options(options)
+{
+}
+
+pws_db *db_reader_v3::read()
+{
+    if(_source) {
+        source_reader r(*_source, _key, _options);
+        return r.read();
+    }
+
+    mmap_source source(_file);
+    memory_reader r(source, _key, _options);
+    return r.read();
+}
+
+void db_reader_v3::visit(db_visitor &visitor)
+{
+    read_options options = _options;
+    options.bulk = false;
+    options.zero_copy = false;
+    options.lazy = false;
+    options.index_file.clear();
+
+    if(_source) {
+        source_reader r(*_source, _key, options);
+        r.visit(visitor);
+        return;
+    }
+
+    mmap_source source(_file);
+    memory_reader r(source, _key, options);
+    r.visit(visitor);
+}
+
+
+struct db_stream_writer_v3::state {
+    explicit state(const std::string &file)
+        : _file(file), _temp(new tmp_file(file)),
+          _fd(new fd_guard(open(_temp->name().c_str(),
+              O_WRONLY | O_CREAT | O_TRUNC, 0666))),
+          _file_sink(0), _writer(0), _record_fields(0)
+    {
+        if(_fd->fd() < 0) {
+            throw pws_io_exception(CANNOT_WRITE_FILE);
+        }
+
+        _file_sink.reset(new fd_sink(_fd->fd()));
+    }
+
+    state()
+        : _temp(0), _fd(0), _file_sink(0), _writer(0), _record_fields(0)
+    {
+    }
+
+    // Only set when writing to a file.
+    std::string _file;
+    scoped_ptr<tmp_file> _temp;
+    scoped_ptr<fd_guard> _fd;
+    scoped_ptr<fd_sink> _file_sink;
+
+    scoped_ptr<field_writer> _writer;
+
+    // Number of fields written for the current record.
+    int _record_fields;
+};
+
+db_stream_writer_v3::db_stream_writer_v3(const std::string &file,
+        const std::string &key, const pws_header &header)
+{
+    scoped_ptr<state> s(new state(file));
+
+    s->_writer.reset(new file_writer(*s->_file_sink, key));
+    s->_writer->begin(header.get_fields());
+    _state = s.release();
+}
+
+db_stream_writer_v3::db_stream_writer_v3(byte_sink &sink,
+        const std::string &key, const pws_header &header)
+{
+    scoped_ptr<state> s(new state());
+
+    s->_writer.reset(new sink_writer(sink, key));
+    s->_writer->begin(header.get_fields());
+    _state = s.release();
+}
+
+db_stream_writer_v3::~db_stream_writer_v3()
+{
+    delete _state;
+}
+
+void db_stream_writer_v3::write_record(const pws_record &record)
+{
+    end_record();
+    _state->_writer->write_fields(record.get_fields());
+}
+
+void db_stream_writer_v3::write_field(int type, const char *data, size_t len)
+{
+    _state->_writer->write_field(type, data, len);
+    ++_state->_record_fields;
+}
+
+void db_stream_writer_v3::write_field(int type, byte_source &source,
+    size_t len)
+{
+    _state->_writer->write_field(type, source, len);
+    ++_state->_record_fields;
+}
+
+void db_stream_writer_v3::end_record()
+{
+    if(_state->_record_fields > 0) {
+        _state->_writer->write_field(0xff, "", 0);
+        _state->_record_fields = 0;
+    }
+}
+
+void db_stream_writer_v3::finish()
+{
+    end_record();
+    _state->_writer->finish();
+
+    if(_state->_temp.get() == 0) {
+        return;
+    }
+
+    if(!sync_file(_state->_fd->fd())) {
+        throw pws_io_exception(WRITE_ERROR);
+    }
+
+    // Close the temporary file before the move.
+    _state->_file_sink.reset(0);
+    _state->_fd.reset(0);
+
+    // Now that the write's been successful and is on the disk we can
+    // move the temporary file in place of the actual database.
+    if(!rename_synced(_state->_temp->name(), _state->_file)) {
+        throw pws_io_exception();
+    }
+}
+
+
+
+struct db_index_reader_v3::state {
+    state(const std::string &file, const std::string &key)
+        : _file(file), _key(key), _source(file), _data(0), _len(0),
+          _index(0), _db(pws_db::create_empty())
+    {
+    }
+
+    ~state()
+    {
+        wipe(_k, sizeof(_k));
+        wipe(_iv, sizeof(_iv));
+
+        if(!_key.empty()) {
+            wipe(&_key[0], _key.size());
+        }
+    }
+
+    std::string _file;
+    std::string _key;
+    mmap_source _source;
+
+    byte _k[BLOCK_SIZE * 2];
+    byte _iv[BLOCK_SIZE];
+
+    // The encrypted records, up to the EOF block.
+    const byte *_data;
+    size_t _len;
+
+    scoped_ptr<record_index> _index;
+
+    // Creates the fetched records.
+    scoped_ptr<pws_db> _db;
+};
+
+db_index_reader_v3::db_index_reader_v3(const std::string &file,
+    const std::string &index_file, const std::string &key)
+{
+    scoped_ptr<state> s(new state(file, key));
+
+    memory_reader r(s->_source, key, read_options());
+    r.open();
+
+    memcpy(s->_k, r.get_k(), sizeof(s->_k));
+    memcpy(s->_iv, r.get_iv(), sizeof(s->_iv));
+
+    // The file is not scanned for the EOF block, the index is tied to
+    // the HMAC that follows it anyway.
+    size_t len;
+    const byte *data = s->_source.read_rest(len);
+    const size_t tail = BLOCK_SIZE + record_index::mac_size;
+
+    if(len < tail || (len - tail) % BLOCK_SIZE != 0
+            || memcmp(data + len - tail, eof_tag,
+                BLOCK_SIZE) != 0) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    s->_data = data;
+    s->_len = len - tail;
+
+    s->_index.reset(new record_index(r.get_k(), r.get_l()));
+
+    mmap_source index_source(index_file);
+    s->_index->load(index_source, data + len - record_index::mac_size);
+
+    _state = s.release();
+}
+
+db_index_reader_v3::~db_index_reader_v3()
+{
+    delete _state;
+}
+
+pws_record *db_index_reader_v3::fetch(const uuid_t uuid)
+{
+    const record_location *loc = _state->_index->find(uuid);
+
+    if(loc == 0) {
+        return 0;
+    }
+
+    size_t n_blocks = _state->_len / BLOCK_SIZE;
+
+    if(loc->first_block > n_blocks || loc->n_blocks == 0
+            || loc->n_blocks > n_blocks - loc->first_block) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    // A CBC block only depends on itself and the preceding ciphertext
+    // block, the one before the first block is the IV.
+    const byte *in = _state->_data + loc->first_block * BLOCK_SIZE;
+    const byte *iv = loc->first_block == 0 ? _state->_iv : in - BLOCK_SIZE;
+    size_t len = loc->n_blocks * BLOCK_SIZE;
+    std::vector<byte> plain(len);
+
+    v3_codec::decryption cipher;
+    cipher.set_key_with_iv(_state->_k, sizeof(_state->_k), iv);
+    cipher.process(&plain[0], in, len);
+
+    byte mac[record_index::mac_size];
+    _state->_index->record_mac(&plain[0], len, mac);
+
+    if(memcmp(mac, loc->mac, sizeof(mac)) != 0) {
+        wipe(plain);
+        throw pws_io_exception(HMAC_DID_NOT_MATCH);
+    }
+
+    scoped_ptr<pws_record> rec(_state->_db->create_empty_record());
+    size_t pos = 0;
+    field_span span;
+    size_t n;
+
+    while((n = scan_field(&plain[0], len, pos, span)) != 0
+            && span.type != 0xff) {
+        rec->get_fields().add_raw_field(span.type, std::string(
+            (const char *)&plain[0] + span.offset, span.len));
+        pos += n * BLOCK_SIZE;
+    }
+
+    wipe(plain);
+    return rec.release();
+}
+
+void db_index_reader_v3::verify()
+{
+    db_visitor none;
+    mmap_source source(_state->_file);
+    memory_reader r(source, _state->_key, read_options());
+
+    r.visit(none);
+}
+
+void db_writer_v3::write(pws_db &db, const std::string &file,
+    const std::string &key)
+{
+    // TODO update the db with the user and host
+
+    size_t n_pad;
+    tmp_file temp(file);
+
+    {
+        fd_guard f(open(temp.name().c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+            0666));
+
+        if(f.fd() < 0) {
+            throw pws_io_exception(CANNOT_WRITE_FILE);
+        }
+
+        if(!preallocate(f.fd(), file_size(db, n_pad))) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+
+        fd_sink sink(f.fd());
+        file_writer w(sink, key);
+
+        w.write_db(db);
+
+        if(!sync_file(f.fd())) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+    }
+
+    // Now that the write's been successful and is on the disk we can
+    // move the temporary file in place of the actual database.
+    if(!rename_synced(temp.name(), file)) {
+        throw pws_io_exception();
+    }
+}
+
+void db_writer_v3::write(pws_db &db, byte_sink &sink, const std::string &key)
+{
+    sink_writer w(sink, key);
+    w.write_db(db);
+}
+
+size_t db_writer_v3::size_estimate(const pws_db &db) const
+{
+    size_t n_pad;
+    return file_size(db, n_pad);
+}
+
+void change_key_v3(const std::string &file, const std::string &old_key,
+    const std::string &new_key)
+{
+    const size_t salt_size = 32;
+    const size_t hash_size = sha256::digest_size;
+    const size_t keys_size = 2 * 32;
+
+    mmap_source source(file);
+    size_t len;
+    const byte *data = source.read_rest(len);
+
+    if(len < sizeof(pws_tag)
+            || memcmp(data, pws_tag, sizeof(pws_tag)) != 0) {
+        throw pws_io_exception(INVALID_TAG);
+    }
+
+    if(len < preamble_size + BLOCK_SIZE + hmac_sha256::digest_size) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    const byte *salt = data + sizeof(pws_tag);
+    const byte *iter = salt + salt_size;
+    const byte *hash = iter + 4;
+    const byte *keys = hash + hash_size;
+    unsigned int old_iter = get_int32le(iter);
+    byte key_hash[hash_size];
+    byte plain_keys[keys_size];
+    std::string stretched = stretch_key(
+        std::string((const char *)salt, salt_size), old_key, old_iter);
+    sha256 h;
+    twofish_ecb twofish;
+
+    h.update((const byte *)stretched.data(), stretched.length());
+    h.final(key_hash);
+
+    if(memcmp(key_hash, hash, hash_size) != 0) {
+        wipe(&stretched[0], stretched.size());
+        throw pws_io_exception(INVALID_PASSWORD);
+    }
+
+    twofish.set_key((const byte *)stretched.data(), stretched.length());
+    twofish.decrypt(plain_keys, keys, keys_size);
+    wipe(&stretched[0], stretched.size());
+
+    // A new salt, K and L wrapped by the new password, the IV as it was.
+    // The iterations are never fewer than the file had.
+    byte preamble[preamble_size];
+    byte *new_salt = preamble + sizeof(pws_tag);
+    byte *new_iter = new_salt + salt_size;
+    byte *new_hash = new_iter + 4;
+    byte *new_keys = new_hash + hash_size;
+    unsigned int n_iter = std::max((unsigned int)keystretch_iter, old_iter);
+    std::string new_stretched;
+    drbg rng;
+
+    memcpy(preamble, data, preamble_size);
+
+    try {
+        rng.generate(new_salt, salt_size);
+        put_int32le(n_iter, new_iter);
+
+        new_stretched = stretch_key(
+            std::string((const char *)new_salt, salt_size), new_key, n_iter);
+
+        sha256 h2;
+        h2.update((const byte *)new_stretched.data(), new_stretched.length());
+        h2.final(new_hash);
+
+        twofish.set_key((const byte *)new_stretched.data(),
+            new_stretched.length());
+        twofish.encrypt(new_keys, plain_keys, keys_size);
+    } catch(...) {
+        wipe(plain_keys, sizeof(plain_keys));
+
+        if(!new_stretched.empty()) {
+            wipe(&new_stretched[0], new_stretched.size());
+        }
+
+        throw;
+    }
+
+    wipe(plain_keys, sizeof(plain_keys));
+    wipe(&new_stretched[0], new_stretched.size());
+
+    tmp_file temp(file);
+
+    {
+        fd_guard f(open(temp.name().c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+            0666));
 
-    pws_db *read();
+        if(f.fd() < 0) {
+            throw pws_io_exception(CANNOT_WRITE_FILE);
+        }
 
-private:
-    reader(const reader &);
-    reader &operator= (const reader &);
+        if(!preallocate(f.fd(), len)) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
 
-    void read_file(void *buf, int len);
+        // The records and the HMAC only depend on K and L.
+        fd_sink sink(f.fd());
 
-    // Reads a block (of the cipher block size) into the buffer
-    // and decrypts it. Returns false if the block was the EOF block.
-    void read_cbc(void *buf);
+        sink.write(preamble, sizeof(preamble));
+        sink.write(data + preamble_size, len - preamble_size);
+        sink.flush();
 
-    void check_tag();
-    void check_passphrase();
-    void check_hmac();
-    void read_b_fields();
-    void read_fields(field_holder &fields);
-    void read_header(pws_db &db);
-    void read_records(pws_db &db);
+        if(!sync_file(f.fd())) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+    }
 
-    // Reads one fields and returns the type of the field. The data buffer
-    // passed to the method will be filled in with the field's data.
-    int read_field(std::string &data);
+    if(!rename_synced(temp.name(), file)) {
+        throw pws_io_exception();
+    }
+}
 
-private:
-    FILE *_file;
-    std::string _key;
-    std::string _stretched_key;
 
-    CryptoPP::CBC_Mode<CryptoPP::Twofish>::Decryption _cipher;
-    CryptoPP::HMAC<CryptoPP::SHA256> _hmac;
+struct db_incremental_writer_v3::state {
+    typedef file_writer::mark mark;
 
-    byte _k[BLOCK_SIZE * 2];
-    byte _l[BLOCK_SIZE * 2];
-    byte _iv[BLOCK_SIZE];
-};
+    state(const std::string &file, const std::string &key,
+            const incremental_options &options)
+        : _file(file), _key(key), _options(options), _hook(0),
+          _saved(false), _incremental_saves(0)
+    {
+    }
 
+    ~state()
+    {
+        wipe(_k, sizeof(_k));
+        wipe(_l, sizeof(_l));
+        drop_marks(0);
+    }
 
-// The writer should be discarded after calling the write() method.
-class writer {
-public:
-    writer(FILE *file, const pws_db &db, const std::string &key);
+    // Returns the index of the first record that differs from the one
+    // saved at the same place, the number of records if there is none.
+    int first_changed(pws_db &db) const;
 
-    void write();
+    void move_changed_to_tail(pws_db &db) const;
 
-private:
-    writer(const writer &);
-    writer &operator= (const writer &);
+    // Writes the whole file with new keys if from is -1, otherwise
+    // copies the file up to the end of the record before the given one
+    // and writes the rest with the same keys. The new file is synced and
+    // replaces the old one, with the hook called around the replacement.
+    // Keeps the marks up to the start of what has been written and
+    // appends the new ones to them.
+    void write(pws_db &db, int from);
 
-    void write_file(const void *buf, int len);
+    // Takes note of the records from the given one on as saved.
+    void remember_records(pws_db &db, int from);
 
-    // Writes a block (of the cipher block size) from the buffer to the file
-    // encrypting it.
-    void write_cbc(const void *buf);
+    // Whether the file is still the one the last save wrote.
+    bool file_unchanged() const;
 
-    void write_tag();
-    void write_passphrase();
-    void write_b_fields();
-    void write_iv();
-    void write_field(int type, const std::string &data);
-    void write_fields(const field_holder &fields);
-    void write_records();
-    void write_eof();
-    void write_hmac();
+    // Wipes and removes the marks from the given one on.
+    void drop_marks(size_t from);
 
-private:
-    FILE *_file;
-    const pws_db &_db;
+    std::string _file;
     std::string _key;
-    std::string _stretched_key;
+    incremental_options _options;
+    replace_hook *_hook;
 
-    CryptoPP::AutoSeededRandomPool _rng;
-    CryptoPP::CBC_Mode<CryptoPP::Twofish>::Encryption _cipher;
-    CryptoPP::HMAC<CryptoPP::SHA256> _hmac;
+    // Whether the file has been saved and the rest of the state is valid.
+    bool _saved;
+    int _incremental_saves;
 
     byte _k[BLOCK_SIZE * 2];
     byte _l[BLOCK_SIZE * 2];
-    byte _iv[BLOCK_SIZE];
-};
 
+    // The records as they were last saved, and the marks after the
+    // header and after each of them.
+    std::vector<const pws_record *> _records;
+    std::vector<mark> _marks;
 
-reader::reader(FILE *file, const std::string &key)
-    : _file(file), _key(key)
-{
-}
+    // The file as the last save left it, and the HMAC at its end.
+    struct stat _file_stat;
+    byte _file_hmac[hmac_sha256::digest_size];
+};
 
-void reader::read_file(void *buf, int len)
+void db_incremental_writer_v3::state::write(pws_db &db, int from)
 {
-    if(fread(buf, 1, len, _file) != len) {
+    // The file is mapped before anything is written, so that a file
+    // that cannot be read falls back to a full save with the state
+    // untouched.
+    scoped_ptr<mmap_source> old(from >= 0 ? new mmap_source(_file) : 0);
+    const mark *start = from >= 0 ? &_marks[from] : 0;
+    const byte *prefix = 0;
+
+    if(old.get() && (prefix = old->read(start->end)) == 0) {
         throw pws_io_exception(MALFORMED_FILE);
     }
-}
 
-void reader::read_cbc(void *buf)
-{
-    read_file(buf, BLOCK_SIZE);
+    tmp_file temp(_file);
+    std::vector<mark> marks;
+    struct stat st;
+    size_t n_pad;
+    byte k[sizeof(_k)];
+    byte l[sizeof(_l)];
+    byte hmac[hmac_sha256::digest_size];
 
-    if (memcmp(buf, end_of_file::eof_tag, BLOCK_SIZE) == 0) {
-        throw end_of_file();
-    }
+    {
+        fd_guard f(open(temp.name().c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+            0666));
 
-    _cipher.ProcessData((byte *)buf, (const byte *)buf, BLOCK_SIZE);
-}
+        if(f.fd() < 0) {
+            throw pws_io_exception(CANNOT_WRITE_FILE);
+        }
+
+        if(!preallocate(f.fd(), file_size(db, n_pad))) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
 
-void reader::check_tag() {
-    char buf[4];
+        fd_sink sink(f.fd());
+        file_writer w(sink, _key);
 
-    if(fread(buf, 1, sizeof(buf), _file) != sizeof(buf)) {
-        throw pws_io_exception(INVALID_TAG);
-    }
+        if(start) {
+            sink.write(prefix, start->end);
+            w.write_tail(db, from, _k, _l, *start, marks);
+        } else {
+            w.write_db(db, &marks);
+        }
 
-    if (memcmp(pws_tag, buf, sizeof(buf)) != 0) {
-        throw pws_io_exception(INVALID_TAG);
+        memcpy(k, start ? _k : w.k(), sizeof(k));
+        memcpy(l, start ? _l : w.l(), sizeof(l));
+        memcpy(hmac, w.hmac(), sizeof(hmac));
+
+        if(!sync_file(f.fd()) || fstat(f.fd(), &st) != 0) {
+            wipe(k, sizeof(k));
+            wipe(l, sizeof(l));
+            throw pws_io_exception(WRITE_ERROR);
+        }
     }
-}
 
-void reader::check_passphrase()
-{
-    char salt[32];
-    unsigned char n_iter[4];
+    try {
+        if(_hook) {
+            _hook->before_replace(k, l, hmac);
+        }
+    } catch(...) {
+        wipe(k, sizeof(k));
+        wipe(l, sizeof(l));
+        throw;
+    }
 
-    read_file(salt, sizeof(salt));
-    read_file(n_iter, sizeof(n_iter));
+    bool replaced = rename_synced(temp.name(), _file);
 
-    _stretched_key = stretch_key(std::string(salt, sizeof(salt)), _key,
-        get_int32le(n_iter));
+    if(_hook) {
+        _hook->after_replace(replaced);
+    }
 
-    CryptoPP::SHA256 h;
-    const int digestsize = CryptoPP::SHA256::DIGESTSIZE;
-    byte key_hash[digestsize];
-    byte saved_key_hash[digestsize];
+    memcpy(_k, k, sizeof(_k));
+    memcpy(_l, l, sizeof(_l));
+    wipe(k, sizeof(k));
+    wipe(l, sizeof(l));
 
-    read_file(saved_key_hash, sizeof(saved_key_hash));
+    if(!replaced) {
+        throw pws_io_exception();
+    }
 
-    h.Update((const byte *)_stretched_key.c_str(), _stretched_key.length());
-    h.Final(key_hash);
+    drop_marks(start ? from + 1 : 0);
 
-    if (memcmp(key_hash, saved_key_hash, digestsize) != 0) {
-        throw pws_io_exception(INVALID_PASSWORD);
+    if(!marks.empty()) {
+        _marks.insert(_marks.end(), marks.begin(), marks.end());
+        wipe(&marks[0], marks.size() * sizeof(mark));
     }
+
+    _file_stat = st;
+    memcpy(_file_hmac, hmac, sizeof(_file_hmac));
 }
 
-void reader::check_hmac()
+int db_incremental_writer_v3::state::first_changed(pws_db &db) const
 {
-    char buf[_hmac.DIGESTSIZE];
-    byte hmac_out[_hmac.DIGESTSIZE];
+    int n = std::min(db.num_records(), (int)_records.size());
+    int i = 0;
 
-    _hmac.Final(hmac_out);
-    read_file(buf, sizeof(buf));
+    while(i < n) {
+        const pws_record &r = db.get_record_by_index(i);
 
-    if(memcmp(buf, hmac_out, sizeof(buf)) != 0) {
-        throw pws_io_exception(HMAC_DID_NOT_MATCH);
+        if(&r != _records[i] || r.get_fields().changed()) {
+            break;
+        }
+
+        ++i;
     }
+
+    return i;
 }
 
-void reader::read_b_fields()
+void db_incremental_writer_v3::state::move_changed_to_tail(pws_db &db) const
 {
-    read_file(_k, sizeof(_k));
-    read_file(_l, sizeof(_l));
-
-    CryptoPP::ECB_Mode<CryptoPP::Twofish>::Decryption twofish;
+    int i = 0;
 
-    twofish.SetKey((const byte *)_stretched_key.c_str(),
-        _stretched_key.length());
-
-    twofish.ProcessData(_k, _k, sizeof(_k));
-    twofish.ProcessData(_l, _l, sizeof(_l));
+    for(int n = db.num_records(); n > 0; --n) {
+        if(db.get_record_by_index(i).get_fields().changed()) {
+            db.move_record_to_end(i);
+        } else {
+            ++i;
+        }
+    }
 }
 
-int reader::read_field(std::string &data)
+void db_incremental_writer_v3::state::remember_records(pws_db &db, int from)
 {
-    byte buf[BLOCK_SIZE];
+    _records.resize(from);
 
-    read_cbc(buf);
+    for(int i = from; i < db.num_records(); ++i) {
+        pws_record &r = db.get_record_by_index(i);
 
-    int type = buf[4];
-    int to_read = get_int32le(buf);
-    int data_len = std::min(to_read, BLOCK_SIZE - 5);
+        r.get_fields().mark_unchanged();
+        _records.push_back(&r);
+    }
+}
 
-    data.clear();
-    data.append((char *)buf + 5, data_len);
-    _hmac.Update((byte *)buf + 5, data_len);
-    to_read -= data_len;
+bool db_incremental_writer_v3::state::file_unchanged() const
+{
+    struct stat st;
+
+    if(stat(_file.c_str(), &st) != 0
+            || st.st_dev != _file_stat.st_dev
+            || st.st_ino != _file_stat.st_ino
+            || st.st_size != _file_stat.st_size
+            || !same_mtime(st, _file_stat)) {
+        return false;
+    }
 
-    while(to_read > 0) {
-        read_cbc(buf);
-        data_len = std::min(to_read, BLOCK_SIZE);
-        data.append((char *)buf, data_len);
-        _hmac.Update((byte *)buf, data_len);
-        to_read -= data_len;
+    // Where the timestamps are coarse, a file of the same size written
+    // soon after is told apart by its HMAC, no two saves share one.
+    byte hmac[hmac_sha256::digest_size];
+
+    try {
+        read_file_hmac(_file, hmac);
+    } catch(const pws_io_exception &) {
+        return false;
     }
 
-    return type;
+    return memcmp(hmac, _file_hmac, sizeof(hmac)) == 0;
 }
 
-void reader::read_fields(field_holder &fields)
+void db_incremental_writer_v3::state::drop_marks(size_t from)
 {
-    std::string data;
-    int type;
-
-    do {
-        type = read_field(data);
-        if(type != 0xff) {
-            fields.add_raw_field(type, data);
-        }
-    } while(type != 0xff);
+    if(from < _marks.size()) {
+        wipe(&_marks[from], (_marks.size() - from) * sizeof(mark));
+        _marks.resize(from);
+    }
 }
 
-void reader::read_header(pws_db &db)
+db_incremental_writer_v3::db_incremental_writer_v3(const std::string &file,
+        const std::string &key, const incremental_options &options)
+    : _state(new state(file, key, options))
 {
-    try {
-        read_fields(db.get_header().get_fields());
-    } catch(end_of_file ex) {
-        throw pws_io_exception(MALFORMED_FILE);
-    }
 }
 
-void reader::read_records(pws_db &db)
+db_incremental_writer_v3::~db_incremental_writer_v3()
 {
-    while(1) {
-        try {
-            scoped_ptr<pws_record> rec(db.create_empty_record());
-            read_fields(rec->get_fields());
-            db.add_record(rec.release());
-        } catch(end_of_file ex) {
-            break;
-        }
-    }
+    delete _state;
 }
 
-pws_db *reader::read()
+void db_incremental_writer_v3::save(pws_db &db)
 {
-    scoped_ptr<pws_db> db(pws_db::create_empty());
+    state &s = *_state;
+    field_holder &header = db.get_header().get_fields();
+    int interval = s._options.full_save_interval;
+    bool full = !s._saved || header.changed() || !s.file_unchanged()
+        || (interval > 0 && s._incremental_saves >= interval);
+    int from = -1;
+
+    if(!full) {
+        if(s._options.move_changed_to_tail) {
+            s.move_changed_to_tail(db);
+        }
 
-    check_tag();
-    check_passphrase();
-    read_b_fields();
-    read_file(_iv, sizeof(_iv));
+        from = s.first_changed(db);
 
-    _cipher.SetKeyWithIV(_k, sizeof(_k), _iv);
-    _hmac.SetKey(_l, sizeof(_l));
+        if(from == db.num_records() && from == (int)s._records.size()) {
+            return;
+        }
 
-    read_header(*db);
-    read_records(*db);
+        try {
+            s.write(db, from);
+            ++s._incremental_saves;
+        } catch(pws_io_exception &) {
+            // The full save is the fallback whatever has gone wrong, if
+            // it is something that stops it too it will say so.
+            full = true;
+        }
+    }
 
-    check_hmac();
+    if(full) {
+        // The state is no longer valid until the full save is through.
+        s._saved = false;
+        s.write(db, -1);
+        s._incremental_saves = 0;
+        from = 0;
+    }
 
-    return db.release();
+    header.mark_unchanged();
+    s.remember_records(db, from);
+    s._saved = true;
 }
 
-writer::writer(FILE *file, const pws_db &db, const std::string &key)
-    : _file(file), _db(db), _key(key)
+void db_incremental_writer_v3::rotate_keys()
 {
+    _state->_saved = false;
 }
 
-void writer::write_file(const void *buf, int len)
+void db_incremental_writer_v3::change_key(const std::string &key)
 {
-    if(fwrite(buf, 1, len, _file) != len) {
-        throw pws_io_exception(WRITE_ERROR);
+    state &s = *_state;
+    bool unchanged = s._saved && s.file_unchanged();
+    struct stat st;
+
+    if(s._saved || stat(s._file.c_str(), &st) == 0) {
+        change_key_v3(s._file, s._key, key);
     }
-}
 
-void writer::write_cbc(const void *buf)
-{
-    byte out[BLOCK_SIZE];
-    _cipher.ProcessData(out, (const byte *)buf, sizeof(out));
-    write_file(out, sizeof(out));
-}
+    s._key = key;
 
-void writer::write_tag()
-{
-    write_file(pws_tag, sizeof(pws_tag));
+    // The file has been replaced by this writer, not by someone else.
+    if(!unchanged || stat(s._file.c_str(), &s._file_stat) != 0) {
+        s._saved = false;
+    }
 }
 
-void writer::write_passphrase()
+void db_incremental_writer_v3::set_hook(replace_hook *hook)
 {
-    char salt[32];
-    unsigned char n_iter[4];
+    _state->_hook = hook;
+}
 
-    _rng.GenerateBlock((byte *)salt, sizeof(salt));
-    put_int32le(keystretch_iter, n_iter);
+struct db_journal_v3::state : public save_hook {
+    state(const std::string &file, const std::string &key,
+            const save_options &options)
+        : _file(file), _journal_file(file + ".journal"),
+          _next_file(file + ".journal.next"), _key(key), _journal(0),
+          _next(0), _compact(false), _scheduler(file, key, options, this)
+    {
+        memset(&_requested, 0, sizeof(_requested));
+        memset(&_written, 0, sizeof(_written));
+    }
 
-    _stretched_key = stretch_key(std::string(salt, sizeof(salt)),
-        _key, keystretch_iter);
+    ~state()
+    {
+        // Nothing may be left for the thread of the scheduler to write
+        // once this object starts to go.
+        _scheduler.flush();
+    }
 
-    CryptoPP::SHA256 h;
-    const int digestsize = CryptoPP::SHA256::DIGESTSIZE;
-    byte key_hash[digestsize];
+    // Asks the scheduler to write the database and takes note of where
+    // the journal was.
+    save_future request(pws_db &db);
 
-    h.Update((const byte *)_stretched_key.c_str(), _stretched_key.length());
-    h.Final(key_hash);
+    virtual void write_started();
+    virtual void before_replace(const unsigned char *k, const unsigned char *l,
+        const unsigned char *hmac);
+    virtual void after_replace(bool replaced);
 
-    write_file(salt, sizeof(salt));
-    write_file(n_iter, sizeof(n_iter));
-    write_file(key_hash, sizeof(key_hash));
-}
+    std::string _file;
+    std::string _journal_file;
+    std::string _next_file;
+    std::string _key;
 
-void writer::write_b_fields()
-{
-    CryptoPP::ECB_Mode<CryptoPP::Twofish>::Encryption twofish;
+    // Guards the rest but for the scheduler, the hook methods run on
+    // its thread. Held from before_replace() to after_replace().
+    mutable mutex _mutex;
 
-    twofish.SetKey((const byte *)_stretched_key.c_str(),
-        _stretched_key.length());
+    // Null until the database has been read or written, the journal
+    // is tied to the file as it was then.
+    scoped_ptr<journal> _journal;
 
-    _rng.GenerateBlock(_k, sizeof(_k));
-    _rng.GenerateBlock(_l, sizeof(_l));
+    // The journal of the file being written, in between
+    // before_replace() and after_replace().
+    scoped_ptr<journal> _next;
 
-    byte buf_k[sizeof(_k)];
-    byte buf_l[sizeof(_l)];
+    // Set if a change could not be noted in the journal.
+    bool _compact;
 
-    twofish.ProcessData(buf_k, _k, sizeof(_k));
-    twofish.ProcessData(buf_l, _l, sizeof(_l));
+    // Where the journal was at the last request and at the last one in
+    // the write under way, the file has the entries up to there.
+    journal::position _requested;
+    journal::position _written;
 
-    write_file(buf_k, sizeof(buf_k));
-    write_file(buf_l, sizeof(buf_l));
-}
+    // The last background compaction.
+    save_future _compaction;
 
-void writer::write_iv()
-{
-    _rng.GenerateBlock(_iv, sizeof(_iv));
-    write_file(_iv, sizeof(_iv));
-}
+    save_scheduler _scheduler;
+};
 
-void writer::write_field(int type, const std::string &data)
+save_future db_journal_v3::state::request(pws_db &db)
 {
-    byte buf[BLOCK_SIZE];
-    int to_write = data.size();
+    // The lock is not held while the scheduler is called, it calls
+    // write_started() with its own lock held.
+    save_future f = _scheduler.save(db);
+    scoped_lock lock(_mutex);
 
-    put_int32le(data.size(), buf);
-    buf[4] = type;
+    if(_journal.get()) {
+        _journal->get_position(_requested);
+    }
 
-    int buf_off = 5; // account for the len and type in the first block
-    int data_off = 0;
+    return f;
+}
 
-    do {
-        int copy_len = std::min(to_write, BLOCK_SIZE - buf_off);
+void db_journal_v3::state::write_started()
+{
+    scoped_lock lock(_mutex);
+    _written = _requested;
+}
 
-        memcpy(buf + buf_off, data.c_str() + data_off, copy_len);
+void db_journal_v3::state::before_replace(const unsigned char *k,
+    const unsigned char *l, const unsigned char *hmac)
+{
+    _mutex.lock();
 
-        // If there is some unfilled space at the end of the buffer,
-        // pad it with random data.
-        if((buf_off + copy_len) < sizeof(buf)) {
-            _rng.GenerateBlock(buf + buf_off + copy_len,
-                BLOCK_SIZE - buf_off - copy_len);
+    try {
+        if(_journal.get()) {
+            _next.reset(_journal->rebase(k, l, hmac, _written,
+                _journal_file, _next_file));
+        } else {
+            _next.reset(new journal(k, l, hmac));
         }
-
-        write_cbc(buf);
-        _hmac.Update(buf + buf_off, copy_len);
-
-        buf_off = 0;
-
-        data_off += copy_len;
-        to_write -= copy_len;
-    } while(to_write > 0);
+    } catch(...) {
+        _mutex.unlock();
+        throw;
+    }
 }
 
-void writer::write_fields(const field_holder &fields)
+void db_journal_v3::state::after_replace(bool replaced)
 {
-    if(fields.num_fields() == 0) {
-        return;
+    if(replaced && _next->size() == 0) {
+        // The file has all the changes. A journal left behind by a
+        // failure is tied to the old version of the file and ignored.
+        unlink(_journal_file.c_str());
+        _journal.reset(_next.release());
+    } else if(replaced && rename_synced(_next_file, _journal_file)) {
+        _journal.reset(_next.release());
+    } else if(replaced) {
+        // The new journal stays where read() finds it, the next commit
+        // writes the file again and starts another one.
+        _journal.reset(0);
+        _compact = true;
     }
 
-    for(int i = 0; i < fields.num_fields(); ++i) {
-        const pws_field &f = fields.get_field_by_index(i);
-        write_field(f.get_type(), f.get_data());
+    // The positions noted so far are of the old journal. Copying the
+    // whole of the new one is safe, the entries can be applied again.
+    if(replaced) {
+        memset(&_requested, 0, sizeof(_requested));
     }
 
-    write_field(0xff, std::string());
+    _next.reset(0);
+    _mutex.unlock();
 }
 
-void writer::write_records()
+db_journal_v3::db_journal_v3(const std::string &file, const std::string &key,
+        const save_options &options)
+    : _state(new state(file, key, options))
 {
-    for(int i = 0; i < _db.num_records(); ++i) {
-        const pws_record &r = _db.get_record_by_index(i);
-        write_fields(r.get_fields());
-    }
 }
 
-void writer::write_eof()
+db_journal_v3::~db_journal_v3()
 {
-    // write the EOF block
-    write_file(end_of_file::eof_tag, BLOCK_SIZE);
+    delete _state;
 }
 
-void writer::write_hmac()
+pws_db *db_journal_v3::read(const read_options &options)
 {
-    byte buf[_hmac.DIGESTSIZE];
-    _hmac.Final(buf);
-    write_file(buf, sizeof(buf));
+    state &s = *_state;
+    byte db_hmac[hmac_sha256::digest_size];
+
+    read_file_hmac(s._file, db_hmac);
+
+    mmap_source source(s._file);
+    memory_reader r(source, s._key, options);
+    scoped_ptr<pws_db> db(r.read());
+    scoped_ptr<journal> j(new journal(r.get_k(), r.get_l(), db_hmac));
+    bool compact = false;
+
+    // A crash during a compaction can leave the journal of the new
+    // file under the name it was written with.
+    if(!j->replay(s._journal_file, *db)
+            && j->replay(s._next_file, *db)) {
+        compact = !rename_synced(s._next_file, s._journal_file);
+    }
+
+    // Only the changes made from now on count.
+    db->get_header().get_fields().mark_unchanged();
+
+    scoped_lock lock(s._mutex);
+    s._journal.reset(j.release());
+    s._compact = compact;
+    return db.release();
 }
 
-void writer::write()
+void db_journal_v3::put_record(const pws_record &record)
 {
-    write_tag();
-    write_passphrase();
-    write_b_fields();
-    write_iv();
+    state &s = *_state;
+    scoped_lock lock(s._mutex);
+    uuid_t uuid;
 
-    _cipher.SetKeyWithIV(_k, sizeof(_k), _iv);
-    _hmac.SetKey(_l, sizeof(_l));
+    if(!s._journal.get()) {
+        return;
+    }
 
-    write_fields(_db.get_header().get_fields());
-    write_records();
+    if(!record.get_uuid(uuid)) {
+        s._compact = true;
+        return;
+    }
 
-    write_eof();
-    write_hmac();
+    s._journal->put_record(record);
 }
 
-} // namespace
-
-
-db_reader_v3::db_reader_v3(const std::string &file, const std::string &key)
-    : _file(file), _key(key)
+void db_journal_v3::put_field(const pws_record &record, int type)
 {
-}
+    state &s = *_state;
+    scoped_lock lock(s._mutex);
+    uuid_t uuid;
 
-pws_db *db_reader_v3::read()
-{
-    file_guard f(fopen(_file.c_str(), "rb"));
+    if(!s._journal.get()) {
+        return;
+    }
 
-    if(f.file() == 0) {
-        throw pws_io_exception(FILE_NOT_FOUND);
+    if(!record.get_uuid(uuid)) {
+        s._compact = true;
+        return;
     }
 
-    reader r(f.file(), _key);
-    return r.read();
+    const pws_field *f = record.get_fields().find_field(type);
+
+    if(f) {
+        s._journal->set_field(uuid, type,
+            std::string(f->get_bytes(), f->get_size()));
+    } else {
+        s._journal->remove_field(uuid, type);
+    }
 }
 
+void db_journal_v3::delete_record(const pws_record &record)
+{
+    state &s = *_state;
+    scoped_lock lock(s._mutex);
+    uuid_t uuid;
 
-namespace {
+    if(!s._journal.get()) {
+        return;
+    }
 
-// A helper class that generates a unique temporary filename
-// alongside the given file and using the given file name as
-// a template. This class ensures that the temporary file is
-// removed when it is going out of scope.
-class tmp_file {
-public:
-    explicit tmp_file(const std::string &orig_name)
-    {
-        std::string dir(dirname(orig_name));
+    if(!record.get_uuid(uuid)) {
+        s._compact = true;
+        return;
+    }
 
-        if(dir.empty()) {
-            dir = "./";
-        }
+    s._journal->delete_record(uuid);
+}
 
-        char *tm = tempnam(dir.c_str(), filename(orig_name + ".").c_str());
-        _tmp_name = tm;
-        free(tm);
-    }
+void db_journal_v3::commit(pws_db &db)
+{
+    state &s = *_state;
+    bool full;
 
-    ~tmp_file()
     {
-        unlink(_tmp_name.c_str());
-    }
-
-    const std::string &name() const { return _tmp_name; }
+        scoped_lock lock(s._mutex);
+        struct stat st;
 
-private:
-    tmp_file(const tmp_file &);
-    tmp_file &operator= (const tmp_file &);
+        full = !s._journal.get() || s._compact
+            || db.get_header().get_fields().changed();
 
-    std::string _tmp_name;
-};
+        if(!full) {
+            s._journal->commit(s._journal_file);
 
-} // namespace
+            if(stat(s._file.c_str(), &st) == 0
+                    && s._journal->size() <= (size_t)st.st_size / 2) {
+                return;
+            }
+        }
+    }
 
+    if(full) {
+        compact(db);
+    } else if(s._compaction.ready()) {
+        // The changes are in the journal already, if the compaction
+        // fails the next commit starts another one.
+        s._compaction = s.request(db);
+    }
+}
 
-void db_writer_v3::write(pws_db &db, const std::string &file,
-    const std::string &key)
+void db_journal_v3::compact(pws_db &db)
 {
-    tmp_file temp(file);
+    state &s = *_state;
 
-    // Create a scope to do a write in so that the temporary file is
-    // closed before the move.
     {
-        file_guard f(fopen(temp.name().c_str(), "wb"));
+        scoped_lock lock(s._mutex);
 
-        if(f.file() == 0) {
-            throw pws_io_exception(CANNOT_WRITE_FILE);
+        // The file gets the changes from the database itself.
+        if(s._journal.get()) {
+            s._journal->discard();
         }
+    }
 
-        // TODO update the db with the user and host
+    save_future f = s.request(db);
 
-        writer w(f.file(), db, key);
-        w.write();
-    }
+    s._scheduler.flush();
+    f.wait();
 
-    // Now that the write's been successful we can move the temporary file
-    // in place of the actual database.
-    if(rename(temp.name().c_str(), file.c_str()) != 0) {
-        throw pws_io_exception();
-    }
+    scoped_lock lock(s._mutex);
+    s._compact = false;
+}
+
+bool db_journal_v3::needs_compaction() const
+{
+    scoped_lock lock(_state->_mutex);
+
+    return _state->_compact || !_state->_compaction.ready()
+        || (_state->_journal.get() && _state->_journal->has_entries());
 }
 
+void db_journal_v3::change_key(const std::string &key)
+{
+    state &s = *_state;
+
+    s._scheduler.change_key(key);
+    s._key = key;
 }
 
+}
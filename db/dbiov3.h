@@ -26,6 +26,9 @@
 #ifndef _PWS_DB_IO_V3_H_
 #define _PWS_DB_IO_V3_H_
 
+#include <string>
+#include <uuid/uuid.h>
+
 #include "db_reader.h"
 #include "db_writer.h"
 
@@ -33,18 +36,84 @@
 
 namespace pws {
 
+class byte_source;
+class byte_sink;
+class pws_db;
+class pws_header;
+class pws_record;
+
+// Tunes how db_reader_v3 decodes a database. The defaults decrypt the
+// file block by block as it is read.
+struct read_options {
+    read_options() : bulk(false), threads(0), pipeline(false),
+        zero_copy(false), lazy(false), max_plaintext(0), max_field_len(0),
+        max_records(0), max_fields_per_record(0) {}
+
+    // Locates the end of the records up front and decrypts all of them
+    // in one go, then builds the records, splitting the work between
+    // several threads. The whole plaintext is kept in memory while the
+    // database is being built.
+    bool bulk;
+
+    // Number of threads used for the bulk decryption and parsing, 0
+    // stands for the number of processors.
+    int threads;
+
+    // Prefetches the file while the key is being stretched and then runs
+    // the decryption, the HMAC and the parsing as separate stages on
+    // their own threads. Takes precedence over bulk.
+    bool pipeline;
+
+    // Keeps the decrypted file in memory for the lifetime of the database
+    // and makes the fields refer to it instead of copying each of them.
+    // Implies bulk and takes precedence over pipeline.
+    bool zero_copy;
+
+    // Authenticates the whole file but only builds the header, each
+    // record is built from the plaintext the first time it is accessed.
+    // Implies zero_copy.
+    bool lazy;
+
+    // If set, the record index of the database is written to this file
+    // once the database has been authenticated, see db_index_reader_v3.
+    // Implies bulk and takes precedence over pipeline.
+    std::string index_file;
+
+    // Limits for reading untrusted files, 0 stands for no limit. A file
+    // over any of them fails with pws_io_exception(LIMIT_EXCEEDED) as
+    // soon as that is known, before the memory for it is allocated. The
+    // limit on the fields applies to the header too.
+    size_t max_plaintext;
+    size_t max_field_len;
+    size_t max_records;
+    size_t max_fields_per_record;
+};
+
 class db_reader_v3 : public db_reader {
 public:
-    db_reader_v3(const std::string &file, const std::string &key);
+    // Reads the given file through a memory mapping.
+    db_reader_v3(const std::string &file, const std::string &key,
+        const read_options &options = read_options());
+
+    // Reads from the given source, which must outlive the reader.
+    db_reader_v3(byte_source &source, const std::string &key,
+        const read_options &options = read_options());
 
     virtual pws_db *read();
 
+    // Streams the file through a small buffer. The options that keep the
+    // whole plaintext in memory (bulk, zero_copy, lazy and index_file) do
+    // not apply.
+    virtual void visit(db_visitor &visitor);
+
 private:
     db_reader_v3(const db_reader_v3 &);
     db_reader_v3 &operator= (const db_reader_v3 &);
 
     std::string _file;
     std::string _key;
+    byte_source *_source;
+    read_options _options;
 };
 
 
@@ -55,12 +124,253 @@ public:
     virtual void write(pws_db &db, const std::string &file,
         const std::string &key);
 
+    // Writes the database to the given sink and flushes it.
+    void write(pws_db &db, byte_sink &sink, const std::string &key);
+
+    // Returns the size of the file write() produces for the database.
+    // The size is exact, it only depends on the sizes of the fields.
+    size_t size_estimate(const pws_db &db) const;
+
 private:
     db_writer_v3(const db_writer_v3 &);
     db_writer_v3 &operator= (const db_writer_v3 &);
 };
 
+
+// Changes the password of a database file without touching the records:
+// checks the old password, writes a new preamble with a new salt and the
+// same K and L keys wrapped by the new password, and copies the rest of
+// the file as it is, the records and the HMAC depend on K and L only.
+// The new file replaces the old one as with db_writer_v3. Throws
+// pws_io_exception(INVALID_PASSWORD) if the old password is wrong.
+void change_key_v3(const std::string &file, const std::string &old_key,
+    const std::string &new_key);
+
+
+// Tunes how db_incremental_writer_v3 saves a database.
+struct incremental_options {
+    incremental_options() : move_changed_to_tail(false),
+        full_save_interval(100) {}
+
+    // Moves the records that have changed since the previous save after
+    // all the others before saving, so that a record edited over and
+    // over is soon at the end of the file and its next saves only
+    // rewrite the end. Changes the order of the records in the database.
+    bool move_changed_to_tail;
+
+    // Every this many saves after the last full one the whole file is
+    // written again with a new salt and new keys, 0 stands for never.
+    int full_save_interval;
+};
+
+// Tunes how save_scheduler writes a database.
+struct save_options {
+    save_options() : delay_ms(500) {}
+
+    // How long a write waits after the first request in it for more
+    // to come along.
+    unsigned int delay_ms;
+
+    incremental_options incremental;
+};
+
+// Lets the owner of a db_incremental_writer_v3 act around the moment the
+// new version of the file replaces the old one, see db_journal_v3.
+class replace_hook {
+public:
+    virtual ~replace_hook() {}
+
+    // Called once the new version is on the disk under a temporary name,
+    // with its K and L keys and its HMAC. If it throws the save fails
+    // with the file left as it was.
+    virtual void before_replace(const unsigned char *k, const unsigned char *l,
+        const unsigned char *hmac) = 0;
+
+    // Called after before_replace() has returned, once the file has been
+    // replaced or the rename has failed.
+    virtual void after_replace(bool replaced) = 0;
+};
+
+// Saves a database to the same file over and over, encrypting only the
+// records from the first one that has changed since the previous save.
+// For each record it keeps where the record ends in the file, the last
+// block of ciphertext and the state of the HMAC after it, along with
+// the keys of the file. A save copies the file up to the first changed,
+// added or removed record and carries on from there, the new file
+// replaces the old one once it is on the disk. The first save, a save
+// after the header has changed or the file has been changed by someone
+// else, and every options.full_save_interval-th save write the whole
+// file with new keys.
+class db_incremental_writer_v3 {
+public:
+    db_incremental_writer_v3(const std::string &file, const std::string &key,
+        const incremental_options &options = incremental_options());
+    ~db_incremental_writer_v3();
+
+    // The records are told apart by their addresses and
+    // field_holder::changed(), so all the saves must be of the same
+    // database. Does not touch the file if nothing has changed.
+    void save(pws_db &db);
+
+    // Makes the next save write the whole file with new keys.
+    void rotate_keys();
+
+    // Changes the password of the file with change_key_v3(), if there is
+    // a file, and saves with the new one from now on. The keys and the
+    // state of the file stay the same, so the saves carry on from where
+    // they were.
+    void change_key(const std::string &key);
+
+    // The hook, if not null, must outlive the writer.
+    void set_hook(replace_hook *hook);
+
+private:
+    db_incremental_writer_v3(const db_incremental_writer_v3 &);
+    db_incremental_writer_v3 &operator= (const db_incremental_writer_v3 &);
+
+    struct state;
+    state *_state;
+};
+
+
+// Keeps a database file up to date by appending the changes to a
+// journal next to it (the file name followed by ".journal") instead of
+// writing the whole file each time, see journal.h. The journal is
+// replayed when the database is read and compacted into the file when
+// asked to or, in the background, once it has grown to half the size
+// of the file. The file is written by a save_scheduler from a snapshot
+// of the database. The changes committed after the snapshot are carried
+// over to the journal of the new file, written next to it (with ".next"
+// appended to the journal name) before the file is replaced and renamed
+// over the old journal after, read() falls back on it in between.
+class db_journal_v3 {
+public:
+    db_journal_v3(const std::string &file, const std::string &key,
+        const save_options &options = save_options());
+
+    // Waits for the compaction under way, if any.
+    ~db_journal_v3();
+
+    // Reads the database and replays the journal over it. The caller
+    // assumes ownership of the database.
+    pws_db *read(const read_options &options = read_options());
+
+    // The following take note of a change made to the database, it is
+    // written by the next commit(). A change of a record without a UUID
+    // makes the next commit() compact instead.
+    void put_record(const pws_record &record);
+
+    // Takes note of the field of the given type as it is now, set or
+    // removed.
+    void put_field(const pws_record &record, int type);
+
+    // Must be called before the record is deleted.
+    void delete_record(const pws_record &record);
+
+    // Appends the changes noted since the last commit to the journal
+    // and syncs it to the disk, then starts a compaction in the
+    // background if the journal has grown to half the size of the file
+    // and none is under way. Compacts instead if the database has not
+    // been read or written through this object or if its header has
+    // changed. The database must stay the same one throughout, the
+    // compactions take note of its changes with field_holder::changed().
+    void commit(pws_db &db);
+
+    // Writes the database to the file and starts a new journal, waits
+    // until it is done. The changes that have not been committed need
+    // not have been noted.
+    void compact(pws_db &db);
+
+    // Whether the journal has any changes the file does not have.
+    bool needs_compaction() const;
+
+    // Changes the password of the file, see change_key_v3(), once the
+    // compaction under way is done. The journal stays valid as the keys
+    // of the file do not change.
+    void change_key(const std::string &key);
+
+private:
+    db_journal_v3(const db_journal_v3 &);
+    db_journal_v3 &operator= (const db_journal_v3 &);
+
+    struct state;
+    state *_state;
+};
+
+
+// Writes a database record by record, so that only the record being
+// written has to be in memory. When writing to a file the file is
+// replaced only by finish(), if the writer is destroyed before that
+// the file is left untouched.
+class db_stream_writer_v3 {
+public:
+    // Writes the preamble and the header right away.
+    db_stream_writer_v3(const std::string &file, const std::string &key,
+        const pws_header &header);
+
+    // Writes to the given sink, which must outlive the writer.
+    db_stream_writer_v3(byte_sink &sink, const std::string &key,
+        const pws_header &header);
+
+    ~db_stream_writer_v3();
+
+    void write_record(const pws_record &record);
+
+    // Writes a record field by field, the record is ended by
+    // end_record() or by writing the next record. A record without
+    // fields is not written at all.
+    void write_field(int type, const char *data, size_t len);
+    void end_record();
+
+    // Writes a field of the given length reading its data from the source
+    // a piece at a time, so that large fields do not have to be kept in
+    // memory. Throws pws_io_exception(WRITE_ERROR) if the source runs
+    // out early or the field is longer than the format allows (4 GB).
+    void write_field(int type, byte_source &source, size_t len);
+
+    // Writes the end of the file and the HMAC, flushes the data and
+    // moves the file in place. The writer cannot be used afterwards.
+    void finish();
+
+private:
+    db_stream_writer_v3(const db_stream_writer_v3 &);
+    db_stream_writer_v3 &operator= (const db_stream_writer_v3 &);
+
+    struct state;
+    state *_state;
+};
+
+
+// Fetches single records of a database using the record index written
+// by a read with read_options::index_file set. Only the blocks of the
+// requested record are decrypted. Each record is authenticated against
+// the index, verify() authenticates the whole file.
+class db_index_reader_v3 {
+public:
+    // Checks the password and loads the index. Throws
+    // pws_io_exception(STALE_INDEX) if the index was made for another
+    // version of the file.
+    db_index_reader_v3(const std::string &file, const std::string &index_file,
+        const std::string &key);
+    ~db_index_reader_v3();
+
+    // Returns 0 if the index has no record with the given UUID. Throws
+    // pws_io_exception(HMAC_DID_NOT_MATCH) if the record does not match
+    // the index. The caller assumes ownership of the record.
+    pws_record *fetch(const uuid_t uuid);
+
+    // Decrypts the whole file and checks its HMAC, throws
+    // pws_io_exception(HMAC_DID_NOT_MATCH) if it does not match.
+    void verify();
+
+private:
+    db_index_reader_v3(const db_index_reader_v3 &);
+    db_index_reader_v3 &operator= (const db_index_reader_v3 &);
+
+    struct state;
+    state *_state;
+};
+
 }
 
 #endif
-
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "drbg.h"
+#include "exception.h"
+#include "util.h"
+
+
+namespace {
+
+// SP 800-90A limits a generate request to 2^19 bits.
+const size_t max_request = 64 * 1024;
+
+pthread_once_t self_check_once = PTHREAD_ONCE_INIT;
+bool self_check_passed = false;
+
+void run_self_check()
+{
+    self_check_passed = pws::drbg_self_check();
+}
+
+int hex_digit(char c)
+{
+    return c <= '9' ? c - '0' : c - 'a' + 10;
+}
+
+void from_hex(const char *hex, unsigned char *out)
+{
+    for(; *hex; hex += 2) {
+        *out++ = (unsigned char)(hex_digit(hex[0]) << 4 | hex_digit(hex[1]));
+    }
+}
+
+// Reads the seed from the system random source.
+void read_system_seed(unsigned char *seed, size_t len)
+{
+    pws::fd_guard f(open("/dev/urandom", O_RDONLY));
+
+    if(f.fd() < 0) {
+        throw pws::pws_io_exception();
+    }
+
+    while(len > 0) {
+        ssize_t n = read(f.fd(), seed, len);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) {
+            throw pws::pws_io_exception();
+        }
+
+        seed += n;
+        len -= n;
+    }
+}
+
+} // namespace
+
+
+pws::drbg::drbg()
+    : _batch_pos(batch_size)
+{
+    pthread_once(&self_check_once, run_self_check);
+
+    if(!self_check_passed) {
+        throw pws_io_exception();
+    }
+
+    // The entropy input and the nonce.
+    unsigned char seed[seed_size];
+
+    read_system_seed(seed, sizeof(seed));
+    instantiate(seed, sizeof(seed));
+    wipe(seed, sizeof(seed));
+}
+
+pws::drbg::drbg(drbg &parent)
+    : _batch_pos(batch_size)
+{
+    unsigned char seed[seed_size];
+
+    parent.generate(seed, sizeof(seed));
+    instantiate(seed, sizeof(seed));
+    wipe(seed, sizeof(seed));
+}
+
+pws::drbg::drbg(const unsigned char *seed, size_t len)
+    : _batch_pos(batch_size)
+{
+    instantiate(seed, len);
+}
+
+pws::drbg::~drbg()
+{
+    wipe(_k, sizeof(_k));
+    wipe(_v, sizeof(_v));
+    wipe(_batch, sizeof(_batch));
+}
+
+void pws::drbg::instantiate(const unsigned char *seed, size_t len)
+{
+    memset(_k, 0, sizeof(_k));
+    memset(_v, 1, sizeof(_v));
+    update(seed, len);
+}
+
+void pws::drbg::update(const unsigned char *data, size_t len)
+{
+    for(unsigned char round = 0; round < 2; ++round) {
+        _hmac.set_key(_k, sizeof(_k));
+        _hmac.update(_v, sizeof(_v));
+        _hmac.update(&round, 1);
+
+        if(len > 0) {
+            _hmac.update(data, len);
+        }
+
+        _hmac.final(_k);
+
+        _hmac.set_key(_k, sizeof(_k));
+        _hmac.update(_v, sizeof(_v));
+        _hmac.final(_v);
+
+        if(len == 0) {
+            break;
+        }
+    }
+}
+
+void pws::drbg::generate_request(unsigned char *out, size_t len)
+{
+    _hmac.set_key(_k, sizeof(_k));
+
+    while(len > 0) {
+        size_t n = std::min(len, sizeof(_v));
+
+        _hmac.update(_v, sizeof(_v));
+        _hmac.final(_v);
+        memcpy(out, _v, n);
+
+        out += n;
+        len -= n;
+    }
+
+    update(0, 0);
+}
+
+void pws::drbg::generate(void *out, size_t len)
+{
+    unsigned char *p = (unsigned char *)out;
+
+    // Large requests are generated in place, they would go through the
+    // whole batch anyway.
+    if(len >= batch_size) {
+        for(size_t n; len > 0; p += n, len -= n) {
+            n = std::min(len, max_request);
+            generate_request(p, n);
+        }
+
+        return;
+    }
+
+    while(len > 0) {
+        if(_batch_pos == batch_size) {
+            generate_request(_batch, batch_size);
+            _batch_pos = 0;
+        }
+
+        size_t n = std::min(len, batch_size - _batch_pos);
+
+        memcpy(p, _batch + _batch_pos, n);
+        wipe(_batch + _batch_pos, n);
+
+        _batch_pos += n;
+        p += n;
+        len -= n;
+    }
+}
+
+bool pws::drbg_self_check()
+{
+    static const char seed_hex[] =
+        "ca851911349384bffe89de1cbdc46e6831e44d34a4fb935ee285dd14b71a7488"
+        "659ba96c601dc69fc902940805ec0ca8";
+    static const char expected_hex[] =
+        "e528e9abf2dece54d47c7e75e5fe302149f817ea9fb4bee6f4199697d04d5b89"
+        "d54fbb978a15b5c443c9ec21036d2460b6f73ebad0dc2aba6e624abf07745bc1"
+        "07694bb7547bb0995f70de25d6b29e2d3011bb19d27676c07162c8b5ccde0668"
+        "961df86803482cb37ed6d5c0bb8d50cf1f50d476aa0458bdaba806f48be9dcb8";
+
+    unsigned char seed[drbg::seed_size];
+    unsigned char expected[128];
+    unsigned char out[128];
+
+    from_hex(seed_hex, seed);
+    from_hex(expected_hex, expected);
+
+    // The test case asks for two blocks of output and checks the second.
+    drbg d(seed, sizeof(seed));
+
+    d.generate_request(out, sizeof(out));
+    d.generate_request(out, sizeof(out));
+
+    return memcmp(out, expected, sizeof(out)) == 0;
+}
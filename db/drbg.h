@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_DRBG_H_
+#define _PWS_DRBG_H_
+
+#include <stddef.h>
+
+#include "crypto.h"
+
+// The random data the writer needs (salts, keys, IVs and the padding of
+// the fields) comes from an HMAC_DRBG with SHA-256 as specified by NIST
+// SP 800-90A. It is seeded once from the system and generates the bytes
+// in large batches, so that the many small requests for padding cost
+// little more than a copy.
+
+namespace pws {
+
+class drbg {
+public:
+    // Seeds the generator from the system. Throws pws_io_exception() if
+    // the system source cannot be read or the generator fails its
+    // known-answer health test, which runs once per process before the
+    // first generator is seeded.
+    drbg();
+
+    // Seeds the generator from another one, so that another thread can
+    // generate data for the same file. A generator must not be used by
+    // two threads at once.
+    explicit drbg(drbg &parent);
+
+    ~drbg();
+
+    void generate(void *out, size_t len);
+
+private:
+    drbg(const drbg &);
+    drbg &operator= (const drbg &);
+
+    static const size_t seed_size = 48;
+    static const size_t batch_size = 16 * 1024;
+
+    // Seeds the generator with the given data, for the health test.
+    drbg(const unsigned char *seed, size_t len);
+
+    void instantiate(const unsigned char *seed, size_t len);
+
+    // The HMAC_DRBG update function, data may be 0.
+    void update(const unsigned char *data, size_t len);
+
+    // One generate request of SP 800-90A, len must not be over 64 KB.
+    void generate_request(unsigned char *out, size_t len);
+
+    hmac_sha256 _hmac;
+    unsigned char _k[hmac_sha256::digest_size];
+    unsigned char _v[hmac_sha256::digest_size];
+
+    // Generated ahead, the bytes before _batch_pos have been handed out
+    // and wiped.
+    unsigned char _batch[batch_size];
+    size_t _batch_pos;
+
+    friend bool drbg_self_check();
+};
+
+// Runs the known answer test from the NIST validation suite (HMAC_DRBG
+// SHA-256 without prediction resistance, COUNT 0). Returns false if the
+// output does not match.
+bool drbg_self_check();
+
+}
+
+#endif
@@ -38,6 +38,8 @@ char *error_table[] = {
     "File authentication code (HMAC) did not match",
     "Cannot open file for write",
     "Cannot write to file",
+    "Record index does not match the database",
+    "Database exceeds the configured limits",
 };
 
 } // namespace
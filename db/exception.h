@@ -43,6 +43,8 @@ enum io_error_code_t {
     HMAC_DID_NOT_MATCH,
     CANNOT_WRITE_FILE,
     WRITE_ERROR,
+    STALE_INDEX,
+    LIMIT_EXCEEDED,
     UNSPECIFIED,
 };
 
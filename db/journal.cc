@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "journal.h"
+#include "byteio.h"
+#include "crypto.h"
+#include "db.h"
+#include "exception.h"
+#include "platform.h"
+#include "util.h"
+
+namespace pws {
+
+namespace {
+
+const int BLOCK_SIZE = twofish_ecb::block_size;
+
+const char journal_tag[] = {'P', 'W', 'S', 'J'};
+
+// The tag, the database HMAC and the MAC of the two.
+const size_t header_size = sizeof(journal_tag) + 2 * journal::mac_size;
+
+// An entry is the length of its ciphertext, the IV, the ciphertext and
+// the MAC. The plaintext is the length of the body, the operation, the
+// UUID of the record and the body, padded with zeros to the block size.
+const size_t entry_overhead = 4 + BLOCK_SIZE + journal::mac_size;
+const size_t plain_head_size = 4 + 1 + sizeof(uuid_t);
+
+enum journal_op {
+    PUT_RECORD = 1,
+    SET_FIELD = 2,
+    REMOVE_FIELD = 3,
+    DELETE_RECORD = 4
+};
+
+void put_field_data(int type, const char *data, size_t len,
+    std::string &out)
+{
+    unsigned char head[5];
+
+    head[0] = type;
+    put_int32le(len, head + 1);
+    out.append((const char *)head, sizeof(head));
+    out.append(data, len);
+}
+
+} // namespace
+
+
+journal::journal(const unsigned char *k, const unsigned char *l,
+        const unsigned char *db_hmac)
+    : _size(0)
+{
+    derive_key(k, key_size, "PWS3 journal encryption", _enc_key);
+    derive_key(l, key_size, "PWS3 journal authentication", _mac_key);
+    memcpy(_db_hmac, db_hmac, mac_size);
+
+    // The header authenticates the tie to the database and starts the
+    // chain of MACs.
+    hmac_sha256 hmac;
+
+    hmac.set_key(_mac_key, key_size);
+    hmac.update(journal_tag, sizeof(journal_tag));
+    hmac.update(_db_hmac, mac_size);
+    hmac.final(_header_mac);
+
+    memcpy(_file_mac, _header_mac, mac_size);
+    memcpy(_last_mac, _header_mac, mac_size);
+}
+
+journal::~journal()
+{
+    wipe(_enc_key, sizeof(_enc_key));
+    wipe(_mac_key, sizeof(_mac_key));
+}
+
+void journal::put_record(const pws_record &record)
+{
+    uuid_t uuid;
+
+    if(!record.get_uuid(uuid)) {
+        throw pws_io_exception(WRITE_ERROR);
+    }
+
+    const field_holder &fields = record.get_fields();
+    std::string body;
+
+    for(int i = 0; i < fields.num_fields(); ++i) {
+        const pws_field &f = fields.get_field_by_index(i);
+        put_field_data(f.get_type(), f.get_bytes(), f.get_size(), body);
+    }
+
+    add_entry(PUT_RECORD, uuid, body);
+
+    if(!body.empty()) {
+        wipe(&body[0], body.size());
+    }
+}
+
+void journal::set_field(const uuid_t uuid, int type, const std::string &data)
+{
+    std::string body;
+
+    body += (char)type;
+    body += data;
+
+    add_entry(SET_FIELD, uuid, body);
+    wipe(&body[0], body.size());
+}
+
+void journal::remove_field(const uuid_t uuid, int type)
+{
+    add_entry(REMOVE_FIELD, uuid, std::string(1, (char)type));
+}
+
+void journal::delete_record(const uuid_t uuid)
+{
+    add_entry(DELETE_RECORD, uuid, std::string());
+}
+
+bool journal::has_entries() const
+{
+    return !_pending.empty() || _size > header_size;
+}
+
+void journal::entry_mac(const unsigned char *prev_mac,
+    const unsigned char *data, size_t len, unsigned char *mac) const
+{
+    hmac_sha256 hmac;
+
+    hmac.set_key(_mac_key, key_size);
+    hmac.update(prev_mac, mac_size);
+    hmac.update(data, len);
+    hmac.final(mac);
+}
+
+void journal::add_entry(int op, const uuid_t uuid, const std::string &body)
+{
+    if(body.size() > 0xffffffffUL - plain_head_size - BLOCK_SIZE) {
+        throw pws_io_exception(WRITE_ERROR);
+    }
+
+    size_t len = (plain_head_size + body.size() + BLOCK_SIZE - 1)
+        / BLOCK_SIZE * BLOCK_SIZE;
+    std::vector<unsigned char> plain(len, 0);
+
+    put_int32le(body.size(), &plain[0]);
+    plain[4] = op;
+    memcpy(&plain[5], uuid, sizeof(uuid_t));
+    memcpy(&plain[plain_head_size], body.data(), body.size());
+
+    add_plain(&plain[0], len);
+    wipe(plain);
+}
+
+void journal::add_plain(const unsigned char *plain, size_t len)
+{
+    size_t pos = _pending.size();
+    _pending.resize(pos + entry_overhead + len);
+
+    unsigned char *entry = &_pending[pos];
+    unsigned char *iv = entry + 4;
+
+    put_int32le(len, entry);
+    _rng.generate(iv, BLOCK_SIZE);
+
+    twofish_cbc_encryption cipher;
+    cipher.set_key_with_iv(_enc_key, key_size, iv);
+    cipher.process(iv + BLOCK_SIZE, plain, len);
+
+    entry_mac(_last_mac, entry, 4 + BLOCK_SIZE + len,
+        iv + BLOCK_SIZE + len);
+    memcpy(_last_mac, iv + BLOCK_SIZE + len, mac_size);
+}
+
+void journal::commit(const std::string &file)
+{
+    if(_pending.empty()) {
+        return;
+    }
+
+    int flags = O_WRONLY | O_CREAT | (_size == 0 ? O_TRUNC : 0);
+    fd_guard f(open(file.c_str(), flags, 0600));
+
+    if(f.fd() < 0) {
+        throw pws_io_exception(CANNOT_WRITE_FILE);
+    }
+
+    size_t new_size = std::max(_size, header_size) + _pending.size();
+
+    try {
+        if(lseek(f.fd(), _size, SEEK_SET) < 0) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+
+        fd_sink sink(f.fd());
+
+        if(_size == 0) {
+            sink.write(journal_tag, sizeof(journal_tag));
+            sink.write(_db_hmac, mac_size);
+            sink.write(_header_mac, mac_size);
+        }
+
+        sink.write(&_pending[0], _pending.size());
+        sink.flush();
+
+        // Anything past the entries would be taken for a torn entry.
+        if(ftruncate(f.fd(), new_size) != 0 || !sync_file(f.fd())) {
+            throw pws_io_exception(WRITE_ERROR);
+        }
+    } catch(pws_io_exception &) {
+        ftruncate(f.fd(), _size);
+        throw;
+    }
+
+    _pending.clear();
+    _size = new_size;
+    memcpy(_file_mac, _last_mac, mac_size);
+}
+
+void journal::discard()
+{
+    wipe(_pending);
+    _pending.clear();
+    memcpy(_last_mac, _file_mac, mac_size);
+}
+
+void journal::get_position(position &pos) const
+{
+    pos.size = _size;
+    memcpy(pos.mac, _file_mac, mac_size);
+}
+
+journal *journal::rebase(const unsigned char *k, const unsigned char *l,
+    const unsigned char *db_hmac, const position &from,
+    const std::string &file, const std::string &new_file) const
+{
+    scoped_ptr<journal> j(new journal(k, l, db_hmac));
+    size_t start = std::max(from.size, header_size);
+
+    if(_size > start) {
+        mmap_source source(file);
+        size_t len;
+        const unsigned char *data = source.read_rest(len);
+
+        if(len < _size) {
+            throw pws_io_exception(MALFORMED_FILE);
+        }
+
+        copy_entries(data + start, _size - start,
+            from.size < header_size ? _header_mac : from.mac, *j);
+    }
+
+    if(!_pending.empty()) {
+        copy_entries(&_pending[0], _pending.size(), _file_mac, *j);
+    }
+
+    j->commit(new_file);
+    return j.release();
+}
+
+void journal::copy_entries(const unsigned char *data, size_t len,
+    const unsigned char *mac, journal &to) const
+{
+    unsigned char prev[mac_size];
+    std::vector<unsigned char> plain;
+    size_t pos = 0;
+
+    memcpy(prev, mac, mac_size);
+
+    while(pos < len) {
+        size_t left = len - pos;
+        size_t n = left >= 4 ? get_int32le(data + pos) : 0;
+
+        if(left < entry_overhead || n == 0 || n % BLOCK_SIZE != 0
+                || n > left - entry_overhead) {
+            throw pws_io_exception(MALFORMED_FILE);
+        }
+
+        size_t entry_len = entry_overhead + n;
+        const unsigned char *stored = data + pos + entry_len - mac_size;
+
+        entry_mac(prev, data + pos, entry_len - mac_size, prev);
+
+        if(memcmp(prev, stored, mac_size) != 0) {
+            throw pws_io_exception(HMAC_DID_NOT_MATCH);
+        }
+
+        decrypt(data + pos + 4, n, plain);
+        to.add_plain(&plain[0], n);
+        wipe(plain);
+        pos += entry_len;
+    }
+}
+
+void journal::decrypt(const unsigned char *data, size_t len,
+    std::vector<unsigned char> &plain) const
+{
+    twofish_cbc_decryption cipher;
+
+    plain.resize(len);
+    cipher.set_key_with_iv(_enc_key, key_size, data);
+    cipher.process(&plain[0], data + BLOCK_SIZE, len);
+}
+
+bool journal::replay(const std::string &file, pws_db &db)
+{
+    struct stat st;
+
+    if(stat(file.c_str(), &st) != 0) {
+        return false;
+    }
+
+    mmap_source source(file);
+    size_t len;
+    const unsigned char *data = source.read_rest(len);
+
+    if(len < header_size
+            || memcmp(data, journal_tag, sizeof(journal_tag)) != 0) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    // A journal of another version of the database has been compacted
+    // into the file already, or belongs to a file that has been replaced.
+    if(memcmp(data + sizeof(journal_tag), _db_hmac, mac_size) != 0) {
+        return false;
+    }
+
+    if(memcmp(data + sizeof(journal_tag) + mac_size, _header_mac,
+            mac_size) != 0) {
+        throw pws_io_exception(HMAC_DID_NOT_MATCH);
+    }
+
+    unsigned char mac[mac_size];
+    memcpy(mac, _header_mac, mac_size);
+
+    // The records are looked up by their UUIDs once there are entries.
+    record_map records;
+    bool mapped = false;
+    size_t pos = header_size;
+
+    while(pos < len) {
+        size_t left = len - pos;
+
+        // Only the last entry can have been cut short, by a crash while
+        // it was being written, and then it runs past the end of the
+        // file. A length no entry can have is damage wherever it is.
+        if(left < 4) {
+            break;
+        }
+
+        size_t n = get_int32le(data + pos);
+
+        if(n == 0 || n % BLOCK_SIZE != 0) {
+            throw pws_io_exception(MALFORMED_FILE);
+        }
+
+        if(left < entry_overhead || n > left - entry_overhead) {
+            break;
+        }
+
+        size_t entry_len = entry_overhead + n;
+        unsigned char entry_mac_buf[mac_size];
+
+        entry_mac(mac, data + pos, entry_len - mac_size, entry_mac_buf);
+
+        // A complete entry has been committed and synced, whether or not
+        // it is the last one.
+        if(memcmp(entry_mac_buf, data + pos + entry_len - mac_size,
+                mac_size) != 0) {
+            throw pws_io_exception(HMAC_DID_NOT_MATCH);
+        }
+
+        if(!mapped) {
+            mapped = true;
+
+            for(int i = 0; i < db.num_records(); ++i) {
+                pws_record &r = db.get_record_by_index(i);
+                uuid_t uuid;
+
+                if(r.get_uuid(uuid)) {
+                    records[std::string((const char *)uuid,
+                        sizeof(uuid_t))] = &r;
+                }
+            }
+        }
+
+        apply_entry(data + pos + 4, n, db, records);
+        memcpy(mac, entry_mac_buf, mac_size);
+        pos += entry_len;
+    }
+
+    // A torn entry is left in the file, the next commit() writes over
+    // it.
+    memcpy(_file_mac, mac, mac_size);
+    memcpy(_last_mac, mac, mac_size);
+    _size = pos;
+    return true;
+}
+
+void journal::apply_entry(const unsigned char *data, size_t len, pws_db &db,
+    record_map &records)
+{
+    std::vector<unsigned char> plain;
+
+    decrypt(data, len, plain);
+
+    size_t body_len = get_int32le(&plain[0]);
+
+    if(len < plain_head_size || body_len > len - plain_head_size) {
+        wipe(plain);
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    int op = plain[4];
+    std::string uuid((const char *)&plain[5], sizeof(uuid_t));
+    const unsigned char *body = &plain[plain_head_size];
+    record_map::iterator i = records.find(uuid);
+    pws_record *record = i != records.end() ? i->second : 0;
+
+    switch(op) {
+    case PUT_RECORD: {
+        if(record == 0) {
+            record = db.create_empty_record();
+            db.add_record(record);
+            records[uuid] = record;
+        }
+
+        field_holder &fields = record->get_fields();
+        size_t pos = 0;
+
+        fields.clear();
+
+        while(pos < body_len) {
+            size_t n;
+
+            if(body_len - pos < 5
+                    || (n = get_int32le(body + pos + 1)) > body_len - pos - 5) {
+                wipe(plain);
+                throw pws_io_exception(MALFORMED_FILE);
+            }
+
+            fields.add_raw_field(body[pos],
+                std::string((const char *)body + pos + 5, n));
+            pos += 5 + n;
+        }
+
+        break;
+    }
+
+    case SET_FIELD:
+    case REMOVE_FIELD:
+        if(body_len < 1) {
+            wipe(plain);
+            throw pws_io_exception(MALFORMED_FILE);
+        }
+
+        // The entries of a record that is not there any more have been
+        // overtaken by its deletion.
+        if(record && op == SET_FIELD) {
+            record->get_fields().set_field(body[0],
+                std::string((const char *)body + 1, body_len - 1));
+        } else if(record) {
+            record->get_fields().remove_field(body[0]);
+        }
+
+        break;
+
+    case DELETE_RECORD:
+        if(record) {
+            records.erase(uuid);
+            db.delete_record(*record);
+        }
+
+        break;
+
+    default:
+        wipe(plain);
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    wipe(plain);
+}
+
+}
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_JOURNAL_H_
+#define _PWS_JOURNAL_H_
+
+#include <map>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <uuid/uuid.h>
+
+#include "drbg.h"
+
+// A sidecar file that logs the changes made to a database since its
+// file was last written, so that a change costs an append to the log
+// rather than a rewrite of the file. Each entry changes one record,
+// found by its UUID. The entries are encrypted and authenticated with
+// keys derived from the K and L keys of the database, and each MAC
+// covers the one before it so that entries cannot be dropped or moved.
+// Like the record index the journal is tied to one version of the
+// database file through the file's HMAC.
+
+namespace pws {
+
+class pws_db;
+class pws_record;
+
+class journal {
+public:
+    // Size of the database keys and of the HMAC the journal is tied to.
+    static const size_t key_size = 32;
+    static const size_t mac_size = 32;
+
+    // Derives the journal keys from the K and L keys of the database
+    // file with the given HMAC.
+    journal(const unsigned char *k, const unsigned char *l,
+        const unsigned char *db_hmac);
+    ~journal();
+
+    // The following queue an entry for commit(). A record is told by
+    // its UUID field, pws_io_exception(WRITE_ERROR) is thrown if it has
+    // none.
+
+    // Replaces the fields of the record with the same UUID, adds the
+    // record if there is none.
+    void put_record(const pws_record &record);
+
+    // Sets and removes a field the way field_holder does.
+    void set_field(const uuid_t uuid, int type, const std::string &data);
+    void remove_field(const uuid_t uuid, int type);
+
+    void delete_record(const uuid_t uuid);
+
+    // Appends the queued entries to the journal file and syncs it to
+    // the disk. A journal that has not been replayed starts a new file.
+    // If it fails the file is left as it was and the entries stay
+    // queued. Throws pws_io_exception(CANNOT_WRITE_FILE) or
+    // pws_io_exception(WRITE_ERROR).
+    void commit(const std::string &file);
+
+    // Drops the queued entries.
+    void discard();
+
+    // Applies the entries of the journal file to the database, commit()
+    // appends to them afterwards. Must be called before anything is
+    // queued. Returns false if there is no journal file or it was made
+    // for another version of the database, commit() starts a new file
+    // then. An entry that runs past the end of the file has been cut
+    // short by a crash during commit() and is skipped, the file is not
+    // changed and the next commit() writes over the entry. Throws
+    // pws_io_exception(MALFORMED_FILE) if an entry has a length no entry
+    // can have and pws_io_exception(HMAC_DID_NOT_MATCH) if any complete
+    // entry, the last one included, does not authenticate.
+    bool replay(const std::string &file, pws_db &db);
+
+    // Whether there are entries, committed or not.
+    bool has_entries() const;
+
+    // Size of the journal file as of the last replay() or commit().
+    size_t size() const { return _size; }
+
+    // A point in the journal file, the entries from there on can be
+    // carried over to the journal of a new version of the database.
+    struct position {
+        size_t size;
+        unsigned char mac[mac_size];
+    };
+
+    // The end of the file as of the last replay() or commit(). A
+    // position of size 0 stands for the start of the file.
+    void get_position(position &pos) const;
+
+    // Starts the journal of a new version of the database file, with
+    // the given keys and HMAC, from the entries of this journal from the
+    // given position on and the queued ones, and commits it to
+    // new_file. Used when the database has been written from a snapshot
+    // taken at that position: the entries after it are applied to the
+    // new file as well and the ones before are already in it. This
+    // journal is left as it was. Throws like commit() and replay().
+    // The caller assumes ownership of the new journal.
+    journal *rebase(const unsigned char *k, const unsigned char *l,
+        const unsigned char *db_hmac, const position &from,
+        const std::string &file, const std::string &new_file) const;
+
+private:
+    journal(const journal &);
+    journal &operator= (const journal &);
+
+    // Encrypts an entry, chains its MAC to the previous one and queues it.
+    void add_entry(int op, const uuid_t uuid, const std::string &body);
+
+    // Queues the plaintext of an entry, padded to the block size.
+    void add_plain(const unsigned char *plain, size_t len);
+
+    // Checks the MACs of the entries in the buffer, chained to mac, and
+    // queues them in the other journal. Throws
+    // pws_io_exception(MALFORMED_FILE) or
+    // pws_io_exception(HMAC_DID_NOT_MATCH).
+    void copy_entries(const unsigned char *data, size_t len,
+        const unsigned char *mac, journal &to) const;
+
+    // Decrypts the ciphertext of an entry that starts with the IV.
+    void decrypt(const unsigned char *data, size_t len,
+        std::vector<unsigned char> &plain) const;
+
+    // The records of a database by their UUIDs.
+    typedef std::map<std::string, pws_record *> record_map;
+
+    // Decrypts the data of an entry and applies it to the database.
+    void apply_entry(const unsigned char *data, size_t len, pws_db &db,
+        record_map &records);
+
+    void entry_mac(const unsigned char *prev_mac, const unsigned char *data,
+        size_t len, unsigned char *mac) const;
+
+    unsigned char _enc_key[key_size];
+    unsigned char _mac_key[key_size];
+    unsigned char _db_hmac[mac_size];
+
+    // The MAC of the file header, the MAC of the last entry in the file
+    // and the MAC the next entry is chained to, the header MAC for the
+    // first entry.
+    unsigned char _header_mac[mac_size];
+    unsigned char _file_mac[mac_size];
+    unsigned char _last_mac[mac_size];
+
+    std::vector<unsigned char> _pending;
+    size_t _size;
+
+    drbg _rng;
+};
+
+}
+
+#endif
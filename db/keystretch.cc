@@ -24,28 +24,154 @@
  */
 
 #include "keystretch.h"
-#include <cryptopp/sha.h>
+#include "crypto.h"
+#include "util.h"
 
 
+namespace {
+
+const int digest_words = pws::sha256::digest_size / 4;
+
+// Hashes the key and the salt, which is where the iterations start,
+// into the words the iterations work on.
+void initial_digest(const std::string &salt, const std::string &key,
+    unsigned int *words)
+{
+    pws::sha256 h0;
+    unsigned char buf[pws::sha256::digest_size];
+
+    h0.update(key.data(), key.length());
+    h0.update(salt.data(), salt.length());
+    h0.final(buf);
+
+    for(int i = 0; i < digest_words; ++i) {
+        words[i] = (unsigned int)buf[4 * i] << 24
+            | (unsigned int)buf[4 * i + 1] << 16
+            | (unsigned int)buf[4 * i + 2] << 8 | buf[4 * i + 3];
+    }
+
+    pws::wipe(buf, sizeof(buf));
+}
+
+// Returns the digest words as the bytes of the stretched key. The words
+// are taken stride apart.
+std::string digest_string(const unsigned int *words, size_t stride = 1)
+{
+    unsigned char buf[pws::sha256::digest_size];
+
+    for(int i = 0; i < digest_words; ++i) {
+        unsigned int w = words[i * stride];
+
+        buf[4 * i] = (unsigned char)(w >> 24);
+        buf[4 * i + 1] = (unsigned char)(w >> 16);
+        buf[4 * i + 2] = (unsigned char)(w >> 8);
+        buf[4 * i + 3] = (unsigned char)w;
+    }
+
+    std::string ret((char *)buf, sizeof(buf));
+    pws::wipe(buf, sizeof(buf));
+
+    return ret;
+}
+
+}
+
 std::string pws::stretch_key(const std::string &salt,
     const std::string &key, int n_iter)
 {
-    const int digestsize = CryptoPP::SHA256::DIGESTSIZE;
+    // The iterations run on the words of the digest, without going
+    // through the general purpose hashing.
+    unsigned int words[digest_words];
+
+    initial_digest(salt, key, words);
+
+    if(n_iter > 0) {
+        crypto().sha256_stretch(words, n_iter);
+    }
+
+    std::string ret = digest_string(words);
+    wipe(words, sizeof(words));
+
+    return ret;
+}
+
+void pws::stretch_keys(const std::vector<stretch_job> &jobs,
+    std::vector<std::string> &out)
+{
+    const crypto_backend &impl = crypto();
+    const size_t lanes = impl.sha256_lanes;
+    const size_t none = (size_t)-1;
+
+    // The digests of the lanes, interleaved as the kernel wants them, the
+    // job in each lane and the iterations it has left.
+    std::vector<unsigned int> digests(digest_words * lanes);
+    std::vector<size_t> lane_job(lanes, none);
+    std::vector<unsigned int> left(lanes);
+    size_t next = 0;
+
+    out.clear();
+    out.resize(jobs.size());
+
+    while(1) {
+        size_t busy = 0;
 
-    CryptoPP::SHA256 h0;
-    byte buf[digestsize];
+        for(size_t j = 0; j < lanes; ++j) {
+            while(lane_job[j] == none && next < jobs.size()) {
+                const stretch_job &job = jobs[next];
+                unsigned int words[digest_words];
 
-    h0.Update((const byte *)key.c_str(), key.length());
-    h0.Update((const byte *)salt.c_str(), salt.length());
-    h0.Final(buf);
+                initial_digest(job.salt, job.key, words);
 
-    for (int i = 0; i < n_iter; ++i) {
-        CryptoPP::SHA256 h;
+                if(job.n_iter <= 0) {
+                    out[next] = digest_string(words);
+                } else {
+                    for(int i = 0; i < digest_words; ++i) {
+                        digests[i * lanes + j] = words[i];
+                    }
 
-        h.Update(buf, digestsize);
-        h.Final(buf);
+                    lane_job[j] = next;
+                    left[j] = job.n_iter;
+                }
+
+                wipe(words, sizeof(words));
+                ++next;
+            }
+
+            if(lane_job[j] != none) {
+                ++busy;
+            }
+        }
+
+        if(busy == 0) {
+            break;
+        }
+
+        // Run until the first of the jobs is done. The lanes without a
+        // job hash whatever they hold, which costs nothing extra.
+        unsigned int step = 0;
+
+        for(size_t j = 0; j < lanes; ++j) {
+            if(lane_job[j] != none && (step == 0 || left[j] < step)) {
+                step = left[j];
+            }
+        }
+
+        impl.sha256_stretch_lanes(&digests[0], step);
+
+        for(size_t j = 0; j < lanes; ++j) {
+            if(lane_job[j] == none) {
+                continue;
+            }
+
+            left[j] -= step;
+
+            if(left[j] == 0) {
+                out[lane_job[j]] = digest_string(&digests[j], lanes);
+                lane_job[j] = none;
+            }
+        }
     }
 
-    return std::string((char *)buf, sizeof(buf));
+    wipe(digests.empty() ? 0 : &digests[0],
+        digests.size() * sizeof(digests[0]));
 }
-
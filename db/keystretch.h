@@ -27,6 +27,7 @@
 #define _PWS_KEYSTRETCH_H_
 
 #include <string>
+#include <vector>
 
 namespace pws {
 
@@ -35,6 +36,24 @@ namespace pws {
 std::string stretch_key(const std::string &salt,
     const std::string &key, int n_iter);
 
+// The arguments of one stretch_key() call in a batch.
+struct stretch_job {
+    stretch_job(const std::string &s, const std::string &k, int n)
+        : salt(s), key(k), n_iter(n) {}
+
+    std::string salt;
+    std::string key;
+    int n_iter;
+};
+
+// Stretches the keys of all the jobs, the same as stretch_key() does,
+// running as many of them at a time as there are vector lanes for
+// SHA-256 on the processor. The iteration counts may differ, a job that
+// is done makes room for the next one. The keys are stored in out in
+// the order of the jobs.
+void stretch_keys(const std::vector<stretch_job> &jobs,
+    std::vector<std::string> &out);
+
 }
 
 #endif
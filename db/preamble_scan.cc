@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "preamble_scan.h"
+#include "crypto.h"
+#include "exception.h"
+#include "platform.h"
+#include "thread.h"
+#include "util.h"
+
+namespace pws {
+
+namespace {
+
+// Layout of the V3 preamble.
+const size_t tag_len = 4;
+const size_t salt_len = 32;
+const size_t iter_len = 4;
+const size_t preamble_len = 152;
+
+// The EOF block and the HMAC at the end of the file.
+const size_t trailer_len = 16 + 32;
+const char eof_tag[] = "PWS3-EOFPWS3-EOF";
+
+const size_t block_size = 16;
+
+// Number of bytes of the salt hash shown in the fingerprint.
+const size_t fingerprint_len = 8;
+
+// The files are handed out to the threads in batches of this size.
+const size_t scan_batch = 32;
+
+// Reading the preamble mostly waits for the storage, so there are more
+// threads than processors by default.
+const int min_scan_threads = 8;
+
+std::string hex(const unsigned char *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+
+    for(size_t i = 0; i < len; ++i) {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 0xf];
+    }
+
+    return out;
+}
+
+// Reads exactly len bytes at the given offset of the file, returns
+// false if the file is shorter or cannot be read.
+bool read_at(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+
+    while(done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, offset + done);
+
+        if(n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if(n <= 0) {
+            return false;
+        }
+
+        done += n;
+    }
+
+    return true;
+}
+
+void list_files(const std::string &dir, std::vector<std::string> &files)
+{
+    DIR *d = opendir(dir.c_str());
+
+    if(d == 0) {
+        return;
+    }
+
+    while(struct dirent *e = readdir(d)) {
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+
+        std::string path = dir + "/" + e->d_name;
+        struct stat st;
+
+        if(lstat(path.c_str(), &st) != 0) {
+            continue;
+        }
+
+        if(S_ISDIR(st.st_mode)) {
+            list_files(path, files);
+        } else if(S_ISREG(st.st_mode)) {
+            files.push_back(path);
+        }
+    }
+
+    closedir(d);
+}
+
+// Scans the files in batches taken from a shared cursor.
+class scan_task : public runnable {
+public:
+    scan_task(const std::vector<std::string> &files,
+            std::vector<preamble_info> &out, size_t &next, mutex &m)
+        : _files(files), _out(out), _next(next), _mutex(m) {}
+
+    virtual void run()
+    {
+        while(1) {
+            size_t first;
+
+            {
+                scoped_lock lock(_mutex);
+                first = _next;
+                _next = std::min(_next + scan_batch, _files.size());
+            }
+
+            if(first == _files.size()) {
+                break;
+            }
+
+            size_t last = std::min(first + scan_batch, _files.size());
+
+            for(size_t i = first; i < last; ++i) {
+                _out[i] = scan_preamble(_files[i]);
+            }
+        }
+    }
+
+private:
+    const std::vector<std::string> &_files;
+    std::vector<preamble_info> &_out;
+    size_t &_next;
+    mutex &_mutex;
+};
+
+} // namespace
+
+
+preamble_info scan_preamble(const std::string &file)
+{
+    preamble_info info;
+    info.path = file;
+
+    fd_guard f(open(file.c_str(), O_RDONLY));
+    struct stat st;
+    unsigned char buf[preamble_len];
+
+    if(f.fd() < 0 || fstat(f.fd(), &st) != 0) {
+        return info;
+    }
+
+    info.file_size = st.st_size;
+
+    // The size has to fit whole blocks between the preamble and the
+    // trailer, and the trailer has to start with the EOF block.
+    unsigned char eof[block_size];
+
+    if(info.file_size < preamble_len + trailer_len
+            || (info.file_size - preamble_len - trailer_len) % block_size
+                != 0) {
+        return info;
+    }
+
+    if(!read_at(f.fd(), buf, sizeof(buf), 0)
+            || memcmp(buf, "PWS3", tag_len) != 0
+            || !read_at(f.fd(), eof, sizeof(eof),
+                info.file_size - trailer_len)
+            || memcmp(eof, eof_tag, block_size) != 0) {
+        return info;
+    }
+
+    const unsigned char *salt = buf + tag_len;
+    unsigned char salt_hash[sha256::digest_size];
+
+    sha256 h;
+    h.update(salt, salt_len);
+    h.final(salt_hash);
+
+    info.valid = true;
+    info.iterations = get_int32le(salt + salt_len);
+    info.salt_fingerprint = hex(salt_hash, fingerprint_len);
+    info.n_blocks = (info.file_size - preamble_len - trailer_len)
+        / block_size;
+
+    return info;
+}
+
+void scan_directory(const std::string &dir, std::vector<preamble_info> &out,
+    int n_threads)
+{
+    struct stat st;
+
+    if(stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+        throw pws_io_exception(FILE_NOT_FOUND);
+    }
+
+    std::vector<std::string> files;
+    list_files(dir, files);
+
+    if(n_threads <= 0) {
+        n_threads = std::max(num_cpus(), min_scan_threads);
+    }
+
+    size_t first = out.size();
+    out.resize(first + files.size());
+
+    std::vector<preamble_info> results(files.size());
+    size_t next = 0;
+    mutex m;
+    std::vector<scan_task> tasks(std::min((size_t)n_threads,
+        (files.size() + scan_batch - 1) / scan_batch),
+        scan_task(files, results, next, m));
+    std::vector<runnable *> runs;
+
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        runs.push_back(&tasks[i]);
+    }
+
+    run_parallel(runs);
+
+    for(size_t i = 0; i < results.size(); ++i) {
+        out[first + i] = results[i];
+    }
+}
+
+}
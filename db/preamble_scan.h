@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_PREAMBLE_SCAN_H_
+#define _PWS_PREAMBLE_SCAN_H_
+
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+// Inspects V3 database files without the password. The preamble of a
+// V3 file (the tag, the salt, the number of key stretching iterations,
+// the password hash, the encrypted keys and the IV) is not encrypted,
+// which is enough to audit the iteration counts and to spot copies of
+// the same database by their salts.
+
+namespace pws {
+
+struct preamble_info {
+    preamble_info() : valid(false), iterations(0), file_size(0),
+        n_blocks(0) {}
+
+    std::string path;
+
+    // True if the file could be read, has a complete V3 preamble and
+    // ends with whole blocks, the EOF block and room for the HMAC. The
+    // contents cannot be checked without the password.
+    bool valid;
+
+    unsigned int iterations;
+
+    // A hex string derived from the salt, copies of the same database
+    // share it.
+    std::string salt_fingerprint;
+
+    unsigned long long file_size;
+
+    // The number of encrypted blocks expected from the file size,
+    // including the header.
+    unsigned long long n_blocks;
+};
+
+// Reads the preamble of the given file.
+preamble_info scan_preamble(const std::string &file);
+
+// Scans all the regular files in the directory tree, reading several
+// files at a time on the given number of threads (0 picks a default).
+// Symbolic links are not followed. Throws
+// pws_io_exception(FILE_NOT_FOUND) if the directory cannot be opened,
+// the files that cannot be read are reported as not valid.
+void scan_directory(const std::string &dir, std::vector<preamble_info> &out,
+    int n_threads = 0);
+
+}
+
+#endif
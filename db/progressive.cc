@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include "progressive.h"
+#include "db.h"
+
+namespace pws {
+
+progressive_reader::progressive_reader(db_reader *reader)
+    : _reader(reader), _db(pws_db::create_empty()), _current(0),
+      _header_ready(false), _cancel(false), _state(LOADING),
+      _error(UNSPECIFIED), _thread(*this)
+{
+    try {
+        _thread.start();
+    } catch(const pws_io_exception &) {
+        // Without a thread the reading simply happens right here.
+        run();
+    }
+}
+
+progressive_reader::~progressive_reader()
+{
+    {
+        scoped_lock lock(_mutex);
+        _cancel = true;
+    }
+
+    _thread.join();
+
+    for(size_t i = 0; i < _records.size(); ++i) {
+        delete _records[i];
+    }
+}
+
+progressive_reader::state_t progressive_reader::get_state() const
+{
+    scoped_lock lock(_mutex);
+    return _state;
+}
+
+io_error_code_t progressive_reader::get_error() const
+{
+    scoped_lock lock(_mutex);
+    return _error;
+}
+
+const pws_header *progressive_reader::get_header() const
+{
+    scoped_lock lock(_mutex);
+
+    if(!_header_ready || _state == INVALID) {
+        return 0;
+    }
+
+    return &_db->get_header();
+}
+
+int progressive_reader::num_records() const
+{
+    scoped_lock lock(_mutex);
+    return _state == INVALID ? 0 : _records.size();
+}
+
+const pws_record *progressive_reader::get_record_by_index(int index) const
+{
+    scoped_lock lock(_mutex);
+
+    if(_state == INVALID) {
+        return 0;
+    }
+
+    return _records[index];
+}
+
+int progressive_reader::wait_for_records(int n) const
+{
+    scoped_lock lock(_mutex);
+
+    while(_state == LOADING && _records.size() < (size_t)n) {
+        _changed.wait(_mutex);
+    }
+
+    return _state == INVALID ? 0 : _records.size();
+}
+
+progressive_reader::state_t progressive_reader::wait() const
+{
+    scoped_lock lock(_mutex);
+
+    while(_state == LOADING) {
+        _changed.wait(_mutex);
+    }
+
+    return _state;
+}
+
+pws_db *progressive_reader::release()
+{
+    if(wait() == INVALID) {
+        throw pws_io_exception(get_error());
+    }
+
+    _thread.join();
+
+    int first = _db->add_record_slots(_records.size());
+
+    for(size_t i = 0; i < _records.size(); ++i) {
+        _db->set_record(first + i, _records[i]);
+    }
+
+    _records.clear();
+    return _db.release();
+}
+
+void progressive_reader::run()
+{
+    try {
+        _reader->visit(*this);
+    } catch(const pws_io_exception &ex) {
+        finish(INVALID, ex.error_code());
+    } catch(...) {
+        // Cancelled or out of memory.
+        finish(INVALID, UNSPECIFIED);
+    }
+}
+
+void progressive_reader::on_header_field(int type, const char *data,
+    size_t len)
+{
+    _db->get_header().get_fields().add_raw_field(type,
+        std::string(data, len));
+}
+
+void progressive_reader::on_record_begin()
+{
+    {
+        scoped_lock lock(_mutex);
+
+        if(_cancel) {
+            throw cancelled();
+        }
+
+        if(!_header_ready) {
+            _header_ready = true;
+            _changed.broadcast();
+        }
+    }
+
+    _current.reset(_db->create_empty_record());
+}
+
+void progressive_reader::on_field(int type, const char *data, size_t len)
+{
+    _current->get_fields().add_raw_field(type, std::string(data, len));
+}
+
+void progressive_reader::on_record_end()
+{
+    scoped_lock lock(_mutex);
+
+    _records.push_back(_current.get());
+    _current.release();
+    _changed.broadcast();
+}
+
+void progressive_reader::on_verified()
+{
+    _current.reset(0);
+    finish(VERIFIED, UNSPECIFIED);
+}
+
+void progressive_reader::finish(state_t state, io_error_code_t error)
+{
+    scoped_lock lock(_mutex);
+
+    _header_ready = true;
+    _state = state;
+    _error = error;
+    _changed.broadcast();
+}
+
+}
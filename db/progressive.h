@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_PROGRESSIVE_H_
+#define _PWS_PROGRESSIVE_H_
+
+#include <vector>
+
+#include "db_reader.h"
+#include "db_visitor.h"
+#include "exception.h"
+#include "thread.h"
+#include "util.h"
+
+namespace pws {
+
+class pws_db;
+class pws_header;
+class pws_record;
+
+// Reads a database on a background thread and lets the records be used
+// while the rest of the file is still being read. Everything handed out
+// is provisional until the whole file has been authenticated, which
+// switches the state from LOADING to VERIFIED. If reading fails the
+// state switches to INVALID and none of the records are handed out any
+// more.
+class progressive_reader : private db_visitor, private runnable {
+public:
+    enum state_t {
+        LOADING,
+        VERIFIED,
+        INVALID
+    };
+
+    // Takes ownership of the reader and starts reading right away.
+    explicit progressive_reader(db_reader *reader);
+
+    // Stops reading if it is still in progress.
+    ~progressive_reader();
+
+    state_t get_state() const;
+
+    // The reason the database is invalid, only meaningful in the INVALID
+    // state.
+    io_error_code_t get_error() const;
+
+    // Returns 0 until the whole header has been read.
+    const pws_header *get_header() const;
+
+    // Number of records read so far, 0 once the database is invalid.
+    int num_records() const;
+
+    // Returns 0 once the database is invalid. The records stay allocated
+    // until the reader is destroyed or the database is released, so the
+    // ones handed out earlier are safe to access but no longer to trust.
+    const pws_record *get_record_by_index(int index) const;
+
+    // Blocks until at least n records have been read or reading is over,
+    // returns the number of records read.
+    int wait_for_records(int n) const;
+
+    // Blocks until reading is over and returns the final state.
+    state_t wait() const;
+
+    // Waits for reading to finish and hands over the database with all
+    // the records. Throws pws_io_exception if the database is invalid.
+    // The caller assumes ownership of the database, the reader cannot
+    // be used afterwards.
+    pws_db *release();
+
+private:
+    progressive_reader(const progressive_reader &);
+    progressive_reader &operator= (const progressive_reader &);
+
+    // Thrown from the visitor to stop reading early.
+    struct cancelled {};
+
+    virtual void run();
+
+    virtual void on_header_field(int type, const char *data, size_t len);
+    virtual void on_record_begin();
+    virtual void on_field(int type, const char *data, size_t len);
+    virtual void on_record_end();
+    virtual void on_verified();
+
+    // Switches to the final state and wakes up everyone waiting.
+    void finish(state_t state, io_error_code_t error);
+
+    scoped_ptr<db_reader> _reader;
+
+    // Only the loading thread touches the database and the record being
+    // built until the header is ready and the reading is over
+    // respectively.
+    scoped_ptr<pws_db> _db;
+    scoped_ptr<pws_record> _current;
+
+    std::vector<pws_record *> _records;
+    bool _header_ready;
+    bool _cancel;
+    state_t _state;
+    io_error_code_t _error;
+
+    mutable mutex _mutex;
+    mutable condition _changed;
+
+    thread _thread;
+};
+
+}
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <string.h>
+
+#include "record_index.h"
+#include "byteio.h"
+#include "crypto.h"
+#include "drbg.h"
+#include "exception.h"
+#include "platform.h"
+#include "util.h"
+
+namespace pws {
+
+namespace {
+
+const int BLOCK_SIZE = twofish_ecb::block_size;
+
+const char index_tag[] = {'P', 'W', 'S', 'I'};
+
+// Size of an entry in the index: the UUID, the first block and the
+// number of blocks (4 bytes each) and the MAC.
+const size_t entry_size = 16 + 4 + 4 + 32;
+
+bool uuid_less(const record_location &a, const record_location &b)
+{
+    return memcmp(a.uuid, b.uuid, sizeof(uuid_t)) < 0;
+}
+
+} // namespace
+
+
+record_index::record_index(const unsigned char *k, const unsigned char *l)
+    : _sorted(true)
+{
+    derive_key(k, key_size, "PWS3 record index encryption", _enc_key);
+    derive_key(l, key_size, "PWS3 record index authentication",
+        _mac_key);
+}
+
+record_index::~record_index()
+{
+    wipe(_enc_key, sizeof(_enc_key));
+    wipe(_mac_key, sizeof(_mac_key));
+}
+
+void record_index::record_mac(const unsigned char *data, size_t len,
+    unsigned char *mac) const
+{
+    hmac_sha256 hmac;
+
+    hmac.set_key(_mac_key, key_size);
+    hmac.update(data, len);
+    hmac.final(mac);
+}
+
+void record_index::add(const record_location &location)
+{
+    _locations.push_back(location);
+    _sorted = false;
+}
+
+const record_location *record_index::find(const uuid_t uuid)
+{
+    sort();
+
+    record_location key;
+    memcpy(key.uuid, uuid, sizeof(uuid_t));
+
+    std::vector<record_location>::const_iterator i = std::lower_bound(
+        _locations.begin(), _locations.end(), key, uuid_less);
+
+    if(i == _locations.end() || memcmp(i->uuid, uuid, sizeof(uuid_t)) != 0) {
+        return 0;
+    }
+
+    return &*i;
+}
+
+void record_index::sort()
+{
+    if(!_sorted) {
+        std::sort(_locations.begin(), _locations.end(), uuid_less);
+        _sorted = true;
+    }
+}
+
+void record_index::save(byte_sink &sink, const unsigned char *db_hmac)
+{
+    sort();
+
+    // The plaintext is the database HMAC, the number of entries and the
+    // entries, padded with zeros to the block size.
+    size_t len = mac_size + 4 + _locations.size() * entry_size;
+    len = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * BLOCK_SIZE;
+
+    std::vector<unsigned char> plain(len, 0);
+    unsigned char *p = &plain[0];
+
+    memcpy(p, db_hmac, mac_size);
+    put_int32le(_locations.size(), p + mac_size);
+    p += mac_size + 4;
+
+    for(size_t i = 0; i < _locations.size(); ++i) {
+        const record_location &loc = _locations[i];
+
+        memcpy(p, loc.uuid, sizeof(uuid_t));
+        put_int32le(loc.first_block, p + 16);
+        put_int32le(loc.n_blocks, p + 20);
+        memcpy(p + 24, loc.mac, sizeof(loc.mac));
+        p += entry_size;
+    }
+
+    drbg rng;
+    unsigned char iv[BLOCK_SIZE];
+    rng.generate(iv, sizeof(iv));
+
+    std::vector<unsigned char> out(sizeof(index_tag) + sizeof(iv) + len);
+    memcpy(&out[0], index_tag, sizeof(index_tag));
+    memcpy(&out[sizeof(index_tag)], iv, sizeof(iv));
+
+    twofish_cbc_encryption cipher;
+    cipher.set_key_with_iv(_enc_key, key_size, iv);
+    cipher.process(&out[sizeof(index_tag) + sizeof(iv)], &plain[0], len);
+    wipe(plain);
+
+    unsigned char mac[mac_size];
+    record_mac(&out[0], out.size(), mac);
+
+    sink.write(&out[0], out.size());
+    sink.write(mac, sizeof(mac));
+    sink.flush();
+}
+
+void record_index::load(byte_source &source, const unsigned char *db_hmac)
+{
+    size_t len;
+    const unsigned char *data = source.read_rest(len);
+    const size_t overhead = sizeof(index_tag) + BLOCK_SIZE + mac_size;
+
+    if(len < overhead || (len - overhead) % BLOCK_SIZE != 0
+            || memcmp(data, index_tag, sizeof(index_tag)) != 0) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    unsigned char mac[mac_size];
+    record_mac(data, len - mac_size, mac);
+
+    // Each save of the database picks new keys, so an index that does
+    // not authenticate most likely belongs to an earlier version.
+    if(memcmp(mac, data + len - mac_size, mac_size) != 0) {
+        throw pws_io_exception(STALE_INDEX);
+    }
+
+    size_t plain_len = len - overhead;
+    std::vector<unsigned char> plain(plain_len);
+
+    if(plain_len < mac_size + 4) {
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    twofish_cbc_decryption cipher;
+    cipher.set_key_with_iv(_enc_key, key_size, data + sizeof(index_tag));
+    cipher.process(&plain[0], data + sizeof(index_tag) + BLOCK_SIZE,
+        plain_len);
+
+    if(memcmp(&plain[0], db_hmac, mac_size) != 0) {
+        wipe(plain);
+        throw pws_io_exception(STALE_INDEX);
+    }
+
+    size_t n = get_int32le(&plain[mac_size]);
+
+    if(n > (plain_len - mac_size - 4) / entry_size) {
+        wipe(plain);
+        throw pws_io_exception(MALFORMED_FILE);
+    }
+
+    const unsigned char *p = &plain[mac_size + 4];
+
+    _locations.resize(n);
+
+    for(size_t i = 0; i < n; ++i) {
+        record_location &loc = _locations[i];
+
+        memcpy(loc.uuid, p, sizeof(uuid_t));
+        loc.first_block = get_int32le(p + 16);
+        loc.n_blocks = get_int32le(p + 20);
+        memcpy(loc.mac, p + 24, sizeof(loc.mac));
+        p += entry_size;
+    }
+
+    _sorted = false;
+    wipe(plain);
+}
+
+}
@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_RECORD_INDEX_H_
+#define _PWS_RECORD_INDEX_H_
+
+#include <stddef.h>
+#include <vector>
+#include <uuid/uuid.h>
+
+// A sidecar file that tells where each record of a database file lies,
+// so that a single record can be decrypted without the rest of the
+// file. The index is encrypted and authenticated with keys derived from
+// the K and L keys of the database and is tied to one version of the
+// database file through the file's HMAC.
+
+namespace pws {
+
+class byte_source;
+class byte_sink;
+
+// Location of a record in the encrypted data of the database file, the
+// blocks are counted from the first block after the preamble. The MAC
+// covers the plaintext of all the blocks of the record.
+struct record_location {
+    uuid_t uuid;
+    size_t first_block;
+    size_t n_blocks;
+    unsigned char mac[32];
+};
+
+class record_index {
+public:
+    // Size of the database keys and of the HMAC the index is tied to.
+    static const size_t key_size = 32;
+    static const size_t mac_size = 32;
+
+    // Derives the index keys from the K and L keys of the database.
+    record_index(const unsigned char *k, const unsigned char *l);
+    ~record_index();
+
+    // Calculates the MAC of the plaintext of a record.
+    void record_mac(const unsigned char *data, size_t len,
+        unsigned char *mac) const;
+
+    void add(const record_location &location);
+
+    // Returns 0 if there is no record with the given UUID.
+    const record_location *find(const uuid_t uuid);
+
+    // Throws pws_io_exception(WRITE_ERROR) if the data cannot be written.
+    void save(byte_sink &sink, const unsigned char *db_hmac);
+
+    // Throws pws_io_exception(STALE_INDEX) if the index does not
+    // authenticate with the keys or was made for another version of the
+    // database and pws_io_exception(MALFORMED_FILE) if it is damaged.
+    void load(byte_source &source, const unsigned char *db_hmac);
+
+private:
+    record_index(const record_index &);
+    record_index &operator= (const record_index &);
+
+    void sort();
+
+    unsigned char _enc_key[key_size];
+    unsigned char _mac_key[key_size];
+
+    std::vector<record_location> _locations;
+    bool _sorted;
+};
+
+}
+
+#endif
@@ -0,0 +1,504 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sys/time.h>
+#include <utility>
+#include <vector>
+
+#include "save_scheduler.h"
+#include "db.h"
+#include "exception.h"
+#include "thread.h"
+#include "util.h"
+
+namespace pws {
+
+struct save_future::state {
+    state() : _refs(1), _done(false), _ok(true), _error(UNSPECIFIED) {}
+
+    void complete(bool ok, io_error_code_t error)
+    {
+        scoped_lock lock(_mutex);
+
+        _done = true;
+        _ok = ok;
+        _error = error;
+        _cond.broadcast();
+    }
+
+    // Drops a reference, the last one deletes the state.
+    void release()
+    {
+        bool last;
+
+        {
+            scoped_lock lock(_mutex);
+            last = --_refs == 0;
+        }
+
+        if(last) {
+            delete this;
+        }
+    }
+
+    mutex _mutex;
+    condition _cond;
+    int _refs;
+    bool _done;
+    bool _ok;
+    io_error_code_t _error;
+};
+
+save_future::save_future()
+    : _state(0)
+{
+}
+
+save_future::save_future(state *s)
+    : _state(s)
+{
+    scoped_lock lock(s->_mutex);
+    ++s->_refs;
+}
+
+save_future::save_future(const save_future &other)
+    : _state(0)
+{
+    *this = other;
+}
+
+save_future &save_future::operator= (const save_future &other)
+{
+    if(other._state) {
+        scoped_lock lock(other._state->_mutex);
+        ++other._state->_refs;
+    }
+
+    if(_state) {
+        _state->release();
+    }
+
+    _state = other._state;
+    return *this;
+}
+
+save_future::~save_future()
+{
+    if(_state) {
+        _state->release();
+    }
+}
+
+bool save_future::ready() const
+{
+    if(!_state) {
+        return true;
+    }
+
+    scoped_lock lock(_state->_mutex);
+    return _state->_done;
+}
+
+void save_future::wait() const
+{
+    if(!_state) {
+        return;
+    }
+
+    scoped_lock lock(_state->_mutex);
+
+    while(!_state->_done) {
+        _state->_cond.wait(_state->_mutex);
+    }
+
+    if(!_state->_ok) {
+        throw pws_io_exception(_state->_error);
+    }
+}
+
+
+namespace {
+
+// Milliseconds since the epoch.
+long long now_ms()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+void copy_fields(const field_holder &from, field_holder &to)
+{
+    for(int i = 0; i < from.num_fields(); ++i) {
+        const pws_field &f = from.get_field_by_index(i);
+        to.add_raw_field(f.get_type(),
+            std::string(f.get_bytes(), f.get_size()));
+    }
+}
+
+// The records of the caller's database and their copies, the other way
+// round.
+typedef std::map<const pws_record *, pws_record *> record_map;
+typedef std::map<const pws_record *, const pws_record *> origin_map;
+
+// The requests that go into one write.
+struct batch {
+    batch() : pending(false), since(0), header_changed(false), future(0) {}
+
+    ~batch()
+    {
+        for(record_map::iterator i = changed.begin(); i != changed.end();
+                ++i) {
+            delete i->second;
+        }
+
+        if(future) {
+            future->complete(false, UNSPECIFIED);
+            future->release();
+        }
+    }
+
+    void swap(batch &other)
+    {
+        std::swap(pending, other.pending);
+        std::swap(since, other.since);
+        order.swap(other.order);
+        changed.swap(other.changed);
+        header.swap(other.header);
+        std::swap(header_changed, other.header_changed);
+        std::swap(future, other.future);
+    }
+
+    // Whether there has been a request and when the first one was made.
+    bool pending;
+    long long since;
+
+    // The records of the database as of the last request, the copies of
+    // those that have changed since the previous write and of the header
+    // if it has changed.
+    std::vector<const pws_record *> order;
+    record_map changed;
+    std::vector<std::pair<int, std::string> > header;
+    bool header_changed;
+
+    save_future::state *future;
+};
+
+} // namespace
+
+
+struct save_scheduler::state : public runnable {
+    state(const std::string &file, const std::string &key,
+            const save_options &options, save_hook *hook)
+        : _options(options), _hook(hook),
+          _writer(file, key, options.incremental),
+          _shadow(pws_db::create_empty()), _first(true), _flush(false),
+          _writing(false), _stop(false), _rotate(false), _thread(*this)
+    {
+        _writer.set_hook(hook);
+        _thread.start();
+    }
+
+    ~state()
+    {
+        {
+            scoped_lock lock(_mutex);
+            _stop = true;
+            _cond.broadcast();
+        }
+
+        _thread.join();
+    }
+
+    virtual void run();
+
+    // Brings the copy of the database up to date with the requests.
+    void apply(batch &b);
+
+    // Writes what has been requested without delay and waits until it
+    // has been written, the mutex must be held.
+    void wait_idle();
+
+    save_options _options;
+    save_hook *_hook;
+
+    // Only used by the thread of the scheduler.
+    db_incremental_writer_v3 _writer;
+    scoped_ptr<pws_db> _shadow;
+    origin_map _live_of;
+
+    // The rest is guarded by the mutex.
+    mutex _mutex;
+    condition _cond;
+
+    // The requests that have not been written yet.
+    batch _next;
+
+    // Whether the next request is the first one, whether the requests
+    // are to be written without delay, whether a write is under way.
+    bool _first;
+    bool _flush;
+    bool _writing;
+    bool _stop;
+    bool _rotate;
+
+    thread _thread;
+};
+
+void save_scheduler::state::run()
+{
+    _mutex.lock();
+
+    for(;;) {
+        while(!_next.pending && !_stop) {
+            _cond.wait(_mutex);
+        }
+
+        if(!_next.pending) {
+            break;
+        }
+
+        // Waits for more requests to come along.
+        while(!_flush && !_stop) {
+            long long left = _next.since + _options.delay_ms - now_ms();
+
+            if(left <= 0) {
+                break;
+            }
+
+            _cond.wait(_mutex, (unsigned int)left);
+        }
+
+        batch b;
+        bool rotate = _rotate;
+
+        b.swap(_next);
+        _rotate = false;
+        _writing = true;
+
+        if(_hook) {
+            _hook->write_started();
+        }
+
+        _mutex.unlock();
+
+        bool ok = true;
+        io_error_code_t error = UNSPECIFIED;
+
+        try {
+            apply(b);
+
+            if(rotate) {
+                _writer.rotate_keys();
+            }
+
+            _writer.save(*_shadow);
+        } catch(pws_io_exception &e) {
+            ok = false;
+            error = e.error_code();
+        } catch(std::exception &) {
+            ok = false;
+        }
+
+        b.future->complete(ok, error);
+        b.future->release();
+        b.future = 0;
+
+        _mutex.lock();
+        _writing = false;
+        _cond.broadcast();
+    }
+
+    _mutex.unlock();
+}
+
+void save_scheduler::state::apply(batch &b)
+{
+    if(b.header_changed) {
+        field_holder &header = _shadow->get_header().get_fields();
+
+        header.clear();
+
+        for(size_t i = 0; i < b.header.size(); ++i) {
+            header.add_raw_field(b.header[i].first, b.header[i].second);
+        }
+    }
+
+    std::set<const pws_record *> live(b.order.begin(), b.order.end());
+    std::set<const pws_record *> kept;
+    std::vector<pws_record *> records;
+    std::vector<pws_record *> dropped;
+    origin_map live_of;
+
+    records.reserve(b.order.size());
+
+    // The records keep their places in the copy, the writer may have
+    // moved them.
+    for(int i = 0; i < _shadow->num_records(); ++i) {
+        pws_record *copy = &_shadow->get_record_by_index(i);
+        const pws_record *r = _live_of[copy];
+
+        if(live.count(r) == 0) {
+            dropped.push_back(copy);
+            continue;
+        }
+
+        record_map::iterator c = b.changed.find(r);
+
+        if(c != b.changed.end()) {
+            dropped.push_back(copy);
+            copy = c->second;
+            b.changed.erase(c);
+        }
+
+        records.push_back(copy);
+        live_of[copy] = r;
+        kept.insert(r);
+    }
+
+    // The new ones go to the end.
+    for(size_t i = 0; i < b.order.size(); ++i) {
+        const pws_record *r = b.order[i];
+        record_map::iterator c = b.changed.find(r);
+
+        if(kept.count(r) == 0 && c != b.changed.end()) {
+            records.push_back(c->second);
+            live_of[c->second] = r;
+            b.changed.erase(c);
+        }
+    }
+
+    _shadow->swap_records(records);
+    _live_of.swap(live_of);
+
+    for(size_t i = 0; i < dropped.size(); ++i) {
+        delete dropped[i];
+    }
+}
+
+void save_scheduler::state::wait_idle()
+{
+    _flush = true;
+    _cond.broadcast();
+
+    while(_next.pending || _writing) {
+        _cond.wait(_mutex);
+    }
+
+    _flush = false;
+}
+
+
+save_scheduler::save_scheduler(const std::string &file,
+        const std::string &key, const save_options &options, save_hook *hook)
+    : _state(new state(file, key, options, hook))
+{
+}
+
+save_scheduler::~save_scheduler()
+{
+    delete _state;
+}
+
+save_future save_scheduler::save(pws_db &db)
+{
+    state &s = *_state;
+    scoped_lock lock(s._mutex);
+    batch &b = s._next;
+
+    if(!b.pending) {
+        b.pending = true;
+        b.since = now_ms();
+        b.future = new save_future::state;
+    }
+
+    b.order.clear();
+    b.order.reserve(db.num_records());
+
+    for(int i = 0; i < db.num_records(); ++i) {
+        pws_record &r = db.get_record_by_index(i);
+        field_holder &fields = r.get_fields();
+
+        b.order.push_back(&r);
+
+        if(!s._first && !fields.changed()) {
+            continue;
+        }
+
+        pws_record *copy = db.create_empty_record();
+        pws_record *&slot = b.changed[&r];
+
+        copy_fields(fields, copy->get_fields());
+        delete slot;
+        slot = copy;
+        fields.mark_unchanged();
+    }
+
+    field_holder &header = db.get_header().get_fields();
+
+    if(s._first || header.changed()) {
+        b.header.clear();
+
+        for(int i = 0; i < header.num_fields(); ++i) {
+            const pws_field &f = header.get_field_by_index(i);
+            b.header.push_back(std::make_pair(f.get_type(),
+                std::string(f.get_bytes(), f.get_size())));
+        }
+
+        b.header_changed = true;
+        header.mark_unchanged();
+    }
+
+    s._first = false;
+    s._cond.broadcast();
+
+    return save_future(b.future);
+}
+
+void save_scheduler::flush()
+{
+    scoped_lock lock(_state->_mutex);
+    _state->wait_idle();
+}
+
+void save_scheduler::rotate_keys()
+{
+    scoped_lock lock(_state->_mutex);
+    _state->_rotate = true;
+}
+
+void save_scheduler::change_key(const std::string &key)
+{
+    scoped_lock lock(_state->_mutex);
+
+    // No write can start while the lock is held.
+    _state->wait_idle();
+    _state->_writer.change_key(key);
+}
+
+}
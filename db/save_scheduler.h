@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_SAVE_SCHEDULER_H_
+#define _PWS_SAVE_SCHEDULER_H_
+
+#include <string>
+
+#include "dbiov3.h"
+
+// Saves a database on a thread of its own. A save request costs the
+// caller a copy of the records that have changed, the file is written
+// from that copy later on, so the time an edit takes does not depend on
+// the size of the database. Requests that come in quick succession are
+// written together.
+
+namespace pws {
+
+class pws_db;
+
+// The outcome of a save request. The requests written together share it.
+class save_future {
+public:
+    // A future that is ready and has succeeded.
+    save_future();
+    save_future(const save_future &other);
+    save_future &operator= (const save_future &other);
+    ~save_future();
+
+    bool ready() const;
+
+    // Waits until the save has been written, throws the
+    // pws_io_exception it has failed with.
+    void wait() const;
+
+    // Shared by the futures of the requests written together, see
+    // save_scheduler.cc.
+    struct state;
+
+private:
+    explicit save_future(state *s);
+
+    state *_state;
+
+    friend class save_scheduler;
+};
+
+
+// Lets the owner of a save_scheduler act as the file is written. The
+// methods are called on the thread of the scheduler and must not call
+// the scheduler.
+class save_hook : public replace_hook {
+public:
+    // Called when a write starts, it has the requests made up to then.
+    // No request can be made until it returns. Must not throw.
+    virtual void write_started() {}
+};
+
+
+// Writes the database with a db_incremental_writer_v3 over a copy of it
+// the scheduler keeps, which a request brings up to date. A record is
+// copied if field_holder::changed() says so and is marked unchanged
+// afterwards, the first request copies them all. The records keep their
+// places in the copy, which options.incremental.move_changed_to_tail
+// changes, new ones are added at the end. The file is synced before it
+// replaces the old one and the directory after.
+class save_scheduler {
+public:
+    // The hook, if not null, must outlive the scheduler.
+    save_scheduler(const std::string &file, const std::string &key,
+        const save_options &options = save_options(), save_hook *hook = 0);
+
+    // Writes what has been requested and stops the thread.
+    ~save_scheduler();
+
+    // Takes a snapshot of the database for the next write and returns
+    // without waiting for it. All the requests must be of the same
+    // database and nothing else may mark its fields unchanged.
+    save_future save(pws_db &db);
+
+    // Writes what has been requested without waiting for the delay and
+    // waits until it has been written. The outcome goes to the futures.
+    void flush();
+
+    // Makes the next write the whole file with new keys.
+    void rotate_keys();
+
+    // Waits until what has been requested is written, then changes the
+    // password of the file with db_incremental_writer_v3::change_key().
+    void change_key(const std::string &key);
+
+private:
+    save_scheduler(const save_scheduler &);
+    save_scheduler &operator= (const save_scheduler &);
+
+    struct state;
+    state *_state;
+};
+
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#include <errno.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "exception.h"
+#include "thread.h"
+
+
+namespace {
+
+void *thread_main(void *arg)
+{
+    static_cast<pws::runnable *>(arg)->run();
+    return 0;
+}
+
+} // namespace
+
+
+pws::thread::thread(runnable &r)
+    : _runnable(r), _running(false)
+{
+}
+
+pws::thread::~thread()
+{
+    join();
+}
+
+void pws::thread::start()
+{
+    if(pthread_create(&_thread, 0, thread_main, &_runnable) != 0) {
+        throw pws_io_exception();
+    }
+
+    _running = true;
+}
+
+void pws::thread::join()
+{
+    if(_running) {
+        pthread_join(_thread, 0);
+        _running = false;
+    }
+}
+
+bool pws::condition::wait(mutex &m, unsigned int ms)
+{
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    long long usec = now.tv_usec + (long long)(ms % 1000) * 1000;
+    struct timespec until;
+    until.tv_sec = now.tv_sec + ms / 1000 + (time_t)(usec / 1000000);
+    until.tv_nsec = (long)(usec % 1000000) * 1000;
+
+    return pthread_cond_timedwait(&_cond, &m._mutex, &until) != ETIMEDOUT;
+}
+
+void pws::run_parallel(const std::vector<runnable *> &tasks)
+{
+    std::vector<pthread_t> threads(tasks.size());
+    std::vector<bool> started(tasks.size(), false);
+
+    for(size_t i = 1; i < tasks.size(); ++i) {
+        started[i] = pthread_create(&threads[i], 0, thread_main,
+            tasks[i]) == 0;
+    }
+
+    for(size_t i = 0; i < tasks.size(); ++i) {
+        if(!started[i]) {
+            tasks[i]->run();
+        }
+    }
+
+    for(size_t i = 1; i < tasks.size(); ++i) {
+        if(started[i]) {
+            pthread_join(threads[i], 0);
+        }
+    }
+}
+
+int pws::num_cpus()
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
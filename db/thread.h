@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _PWS_THREAD_H_
+#define _PWS_THREAD_H_
+
+#include <pthread.h>
+#include <vector>
+
+// Thin wrappers around pthreads used by the database code to spread
+// work over several cores.
+
+namespace pws {
+
+// A piece of work to be executed on a thread. The run() method must not
+// throw, failures have to be reported through the runnable itself.
+struct runnable {
+    virtual ~runnable() {}
+    virtual void run() = 0;
+};
+
+
+// A thread that executes the given runnable. The runnable must outlive
+// the thread. The thread is joined on destruction if it is still
+// running.
+class thread {
+public:
+    explicit thread(runnable &r);
+    ~thread();
+
+    // Throws pws_io_exception() if the thread cannot be created.
+    void start();
+    void join();
+
+private:
+    thread(const thread &);
+    thread &operator= (const thread &);
+
+    runnable &_runnable;
+    pthread_t _thread;
+    bool _running;
+};
+
+
+class mutex {
+public:
+    mutex() { pthread_mutex_init(&_mutex, 0); }
+    ~mutex() { pthread_mutex_destroy(&_mutex); }
+
+    void lock() { pthread_mutex_lock(&_mutex); }
+    void unlock() { pthread_mutex_unlock(&_mutex); }
+
+private:
+    mutex(const mutex &);
+    mutex &operator= (const mutex &);
+
+    pthread_mutex_t _mutex;
+
+    friend class condition;
+};
+
+
+// Locks the given mutex for the lifetime of the object.
+class scoped_lock {
+public:
+    explicit scoped_lock(mutex &m) : _mutex(m) { _mutex.lock(); }
+    ~scoped_lock() { _mutex.unlock(); }
+
+private:
+    scoped_lock(const scoped_lock &);
+    scoped_lock &operator= (const scoped_lock &);
+
+    mutex &_mutex;
+};
+
+
+class condition {
+public:
+    condition() { pthread_cond_init(&_cond, 0); }
+    ~condition() { pthread_cond_destroy(&_cond); }
+
+    // The mutex must be locked by the caller.
+    void wait(mutex &m) { pthread_cond_wait(&_cond, &m._mutex); }
+
+    // Waits for at most the given number of milliseconds, returns false
+    // if the time ran out.
+    bool wait(mutex &m, unsigned int ms);
+
+    void signal() { pthread_cond_signal(&_cond); }
+    void broadcast() { pthread_cond_broadcast(&_cond); }
+
+private:
+    condition(const condition &);
+    condition &operator= (const condition &);
+
+    pthread_cond_t _cond;
+};
+
+
+// A fixed capacity FIFO queue (a ring buffer) to pass items between
+// threads. Pushing into a full queue and popping from an empty one
+// block until there is room or an item to pop.
+template<class T>
+class bounded_queue {
+public:
+    explicit bounded_queue(size_t capacity)
+        : _items(capacity), _head(0), _size(0), _closed(false)
+    {
+    }
+
+    // Returns false without adding the item if the queue was closed.
+    bool push(const T &item)
+    {
+        scoped_lock lock(_mutex);
+
+        while(_size == _items.size() && !_closed) {
+            _not_full.wait(_mutex);
+        }
+
+        if(_closed) {
+            return false;
+        }
+
+        _items[(_head + _size) % _items.size()] = item;
+        ++_size;
+        _not_empty.signal();
+        return true;
+    }
+
+    // Returns false if the queue was closed, the items left in the
+    // queue are not handed out after that.
+    bool pop(T &item)
+    {
+        scoped_lock lock(_mutex);
+
+        while(_size == 0 && !_closed) {
+            _not_empty.wait(_mutex);
+        }
+
+        if(_closed) {
+            return false;
+        }
+
+        item = _items[_head];
+        _head = (_head + 1) % _items.size();
+        --_size;
+        _not_full.signal();
+        return true;
+    }
+
+    // Wakes up all the waiting threads and makes all the subsequent
+    // calls fail.
+    void close()
+    {
+        scoped_lock lock(_mutex);
+
+        _closed = true;
+        _not_full.broadcast();
+        _not_empty.broadcast();
+    }
+
+private:
+    bounded_queue(const bounded_queue &);
+    bounded_queue &operator= (const bounded_queue &);
+
+    std::vector<T> _items;
+    size_t _head;
+    size_t _size;
+    bool _closed;
+
+    mutex _mutex;
+    condition _not_full;
+    condition _not_empty;
+};
+
+
+// Runs the given tasks in parallel and returns when all of them are
+// done. The first task is run on the calling thread, and so is any task
+// a thread could not be created for.
+void run_parallel(const std::vector<runnable *> &tasks);
+
+// Returns the number of processors available to the process, at
+// least 1.
+int num_cpus();
+
+}
+
+#endif
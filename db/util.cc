@@ -23,6 +23,9 @@
  * OTHER DEALINGS IN THE SOFTWARE.
  */
 
+#include <errno.h>
+#include <fcntl.h>
+
 #include "util.h"
 
 
@@ -43,3 +46,86 @@ std::string pws::filename(const std::string &path)
     return pos == std::string::npos ? path : path.substr(pos + 1);
 }
 
+void pws::wipe(std::vector<unsigned char> &buf)
+{
+    wipe(buf.empty() ? 0 : &buf[0], buf.size());
+}
+
+void pws::wipe(void *buf, size_t len)
+{
+    volatile unsigned char *p = (volatile unsigned char *)buf;
+
+    for(size_t i = 0; i < len; ++i) {
+        p[i] = 0;
+    }
+}
+
+bool pws::preallocate(int fd, size_t len)
+{
+    if(len == 0) {
+        return true;
+    }
+
+#if defined(F_PREALLOCATE)
+    // Contiguous space first, any space if there is not enough of it.
+    fstore_t store;
+
+    store.fst_flags = F_ALLOCATECONTIG | F_ALLOCATEALL;
+    store.fst_posmode = F_PEOFPOSMODE;
+    store.fst_offset = 0;
+    store.fst_length = len;
+    store.fst_bytesalloc = 0;
+
+    if(fcntl(fd, F_PREALLOCATE, &store) == 0) {
+        return true;
+    }
+
+    store.fst_flags = F_ALLOCATEALL;
+
+    if(fcntl(fd, F_PREALLOCATE, &store) == 0) {
+        return true;
+    }
+
+    return errno != ENOSPC;
+#elif defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO > 0
+    int err;
+
+    while((err = posix_fallocate(fd, 0, len)) == EINTR) {
+    }
+
+    return err != ENOSPC;
+#else
+    return true;
+#endif
+}
+
+bool pws::sync_file(int fd)
+{
+#if defined(F_FULLFSYNC)
+    // Not every file system supports it, fsync() is the fallback.
+    if(fcntl(fd, F_FULLFSYNC) == 0) {
+        return true;
+    }
+#endif
+
+    return fsync(fd) == 0;
+}
+
+bool pws::rename_synced(const std::string &from, const std::string &to)
+{
+    if(rename(from.c_str(), to.c_str()) != 0) {
+        return false;
+    }
+
+    std::string dir = dirname(to);
+    if(dir.empty()) {
+        dir = to.compare(0, 1, "/") == 0 ? "/" : ".";
+    }
+
+    fd_guard d(open(dir.c_str(), O_RDONLY));
+    if(d.fd() >= 0) {
+        sync_file(d.fd());
+    }
+
+    return true;
+}
@@ -28,6 +28,8 @@
 
 #include <stdio.h>
 #include <string>
+#include <unistd.h>
+#include <vector>
 
 namespace pws {
 
@@ -38,6 +40,27 @@ std::string dirname(const std::string &path);
 // Returns the file name after the last '/' from the given path.
 std::string filename(const std::string &path);
 
+// Overwrites the contents of the buffer with zeros in a way that is not
+// optimized away, used for the memory that held decrypted data.
+void wipe(std::vector<unsigned char> &buf);
+void wipe(void *buf, size_t len);
+
+// Reserves the disk space for the first len bytes of the file, so that
+// running out of it shows before anything is written. Returns false if
+// there is not enough space, true if the space has been reserved or the
+// file system cannot reserve it in advance.
+bool preallocate(int fd, size_t len);
+
+// Makes sure that what has been written to the file is on the disk,
+// past the cache of the drive where the system allows it (F_FULLFSYNC).
+// Returns false if it cannot be done.
+bool sync_file(int fd);
+
+// Renames the file and syncs the directory it is in, so that the rename
+// too survives a crash. Returns false if the file cannot be renamed, not
+// every file system lets a directory be synced so that is not checked.
+bool rename_synced(const std::string &from, const std::string &to);
+
 
 // A helper class that ensures that a file stream is closed
 // when going out of scope.
@@ -56,6 +79,23 @@ private:
 };
 
 
+// A helper class that ensures that a file descriptor is closed
+// when going out of scope.
+class fd_guard {
+public:
+    explicit fd_guard(int fd) : _fd(fd) {}
+    ~fd_guard() { if(_fd >= 0) close(_fd); }
+
+    int fd() { return _fd; }
+
+private:
+    fd_guard(const fd_guard &);
+    fd_guard &operator= (const fd_guard &);
+
+    int _fd;
+};
+
+
 // A very simple smart pointer that deletes the pointer it owns
 // when going out of scope.
 template<class T>
@@ -68,6 +108,7 @@ public:
     const T &operator* () const { return *_ptr; }
     T *operator-> () { return _ptr; }
     const T *operator-> () const { return _ptr; }
+    T *get() const { return _ptr; }
 
     T *release() {
         T *ret = _ptr;
@@ -0,0 +1,660 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Checks the cryptographic primitives against known answers and every
+// implementation of them against the portable one, over the block
+// counts that fill the vector lanes and those that leave a tail, and
+// over buffers that are not aligned. To build and run it, type this
+// as one command at the top of the tree:
+//
+//   c++ -O2 -I. -pthread -o crypto_test tests/crypto_test.cc
+//       db/crypto.cc db/crypto_x86.cc db/util.cc && ./crypto_test
+//
+// Every implementation the processor can run is tested in turn. With
+// PWS_CRYPTO_BACKEND set only that one is, after checking that it is
+// the one in use, so that each can be forced the way the application
+// would be:
+//
+//   for b in `./crypto_test -l`; do PWS_CRYPTO_BACKEND=$b ./crypto_test; done
+//
+// Prints what fails and exits with 1 if anything does.
+
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#include "db/crypto.h"
+
+using namespace pws;
+
+namespace {
+
+int failures = 0;
+std::string current = "portable";
+
+void check(bool ok, const std::string &what)
+{
+    if(!ok) {
+        printf("FAILED: %s: %s\n", current.c_str(), what.c_str());
+        ++failures;
+    }
+}
+
+// The implementations with the processor features they need. One that
+// the processor can run but crypto_backends() does not list has failed
+// its self-check.
+const struct {
+    const char *name;
+    unsigned int features;
+} known_backends[] = {
+    {"shani", CPU_SSSE3 | CPU_SHA},
+    {"avx512", CPU_AVX512},
+    {"avx2", CPU_AVX2},
+    {"sse2", CPU_SSE2},
+    {"portable", 0},
+};
+
+std::string from_hex(const char *hex)
+{
+    std::string out;
+
+    for(size_t i = 0; hex[i] && hex[i + 1]; i += 2) {
+        char byte[3] = {hex[i], hex[i + 1], 0};
+        out += (char)strtoul(byte, 0, 16);
+    }
+
+    return out;
+}
+
+std::string to_hex(const unsigned char *data, size_t len)
+{
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+
+    for(size_t i = 0; i < len; ++i) {
+        out += digits[data[i] >> 4];
+        out += digits[data[i] & 0xf];
+    }
+
+    return out;
+}
+
+std::string format(const char *fmt, size_t a, size_t b = 0, size_t c = 0)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), fmt, a, b, c);
+    return buf;
+}
+
+// The data for the comparisons, the same on every run.
+class random_bytes {
+public:
+    random_bytes() : _x(0x2545f4914f6cdd1dULL) {}
+
+    unsigned int next()
+    {
+        _x ^= _x << 13;
+        _x ^= _x >> 7;
+        _x ^= _x << 17;
+        return (unsigned int)(_x >> 32);
+    }
+
+    void fill(unsigned char *buf, size_t len)
+    {
+        for(size_t i = 0; i < len; ++i) {
+            buf[i] = (unsigned char)next();
+        }
+    }
+
+    std::string bytes(size_t len)
+    {
+        std::string out(len, 0);
+
+        for(size_t i = 0; i < len; ++i) {
+            out[i] = (char)next();
+        }
+
+        return out;
+    }
+
+private:
+    unsigned long long _x;
+};
+
+// Hashes the message in pieces of the given size, 0 for in one go.
+std::string sha256_hex(const std::string &msg, size_t piece)
+{
+    sha256 h;
+    unsigned char digest[sha256::digest_size];
+
+    if(piece == 0) {
+        piece = msg.size() + 1;
+    }
+
+    for(size_t pos = 0; pos < msg.size(); pos += piece) {
+        h.update(msg.data() + pos, std::min(piece, msg.size() - pos));
+    }
+
+    h.final(digest);
+    return to_hex(digest, sizeof(digest));
+}
+
+std::string hmac_hex(const std::string &key, const std::string &msg,
+    size_t piece)
+{
+    hmac_sha256 h;
+    unsigned char mac[hmac_sha256::digest_size];
+
+    if(piece == 0) {
+        piece = msg.size() + 1;
+    }
+
+    h.set_key(key.data(), key.size());
+
+    for(size_t pos = 0; pos < msg.size(); pos += piece) {
+        h.update(msg.data() + pos, std::min(piece, msg.size() - pos));
+    }
+
+    h.final(mac);
+    return to_hex(mac, sizeof(mac));
+}
+
+// FIPS 180-2 and the usual long messages.
+void test_sha256_kat()
+{
+    static const struct {
+        const char *msg;
+        size_t repeat;
+        const char *digest;
+    } kat[] = {
+        {"", 1, "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b"
+            "7852b855"},
+        {"abc", 1, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61"
+            "f20015ad"},
+        {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+            "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db"
+            "06c1"},
+        {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+            "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", 1,
+            "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afe"
+            "e9d1"},
+        {"a", 1000000, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d"
+            "39ccc7112cd0"},
+    };
+
+    static const size_t pieces[] = {0, 1, 3, 63, 64, 65, 997};
+
+    for(size_t i = 0; i < sizeof(kat) / sizeof(kat[0]); ++i) {
+        std::string msg;
+
+        for(size_t j = 0; j < kat[i].repeat; ++j) {
+            msg += kat[i].msg;
+        }
+
+        for(size_t j = 0; j < sizeof(pieces) / sizeof(pieces[0]); ++j) {
+            // Byte by byte is slow enough for the long message.
+            if(msg.size() > 1000 && pieces[j] < 63) {
+                continue;
+            }
+
+            check(sha256_hex(msg, pieces[j]) == kat[i].digest,
+                format("sha256 known answer %zu in pieces of %zu", i,
+                    pieces[j]));
+        }
+    }
+}
+
+// RFC 4231, the cases with the full length MAC.
+void test_hmac_kat()
+{
+    static const struct {
+        const char *key;
+        const char *msg;
+        const char *mac;
+    } kat[] = {
+        {"0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b0b", "4869205468657265",
+            "b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32"
+            "cff7"},
+        {"4a656665", "7768617420646f2079612077616e7420666f72206e6f7468696e"
+            "673f",
+            "5bdcc146bf60754e6a042426089575c75a003f089d2739839dec58b964ec"
+            "3843"},
+        {"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa",
+            "dddddddddddddddddddddddddddddddddddddddddddddddddddddddddddd"
+            "dddddddddddddddddddddddddddddddddddddddd",
+            "773ea91e36800e46854db8ebd09181a72959098b3ef8c122d9635514ced5"
+            "65fe"},
+        {"0102030405060708090a0b0c0d0e0f10111213141516171819",
+            "cdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcd"
+            "cdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcdcd",
+            "82558a389a443c0ea4cc819899f2083a85f0faa3e578f8077a2e3ff46729"
+            "665b"},
+    };
+
+    for(size_t i = 0; i < sizeof(kat) / sizeof(kat[0]); ++i) {
+        check(hmac_hex(from_hex(kat[i].key), from_hex(kat[i].msg), 0)
+                == kat[i].mac, format("hmac known answer %zu", i));
+        check(hmac_hex(from_hex(kat[i].key), from_hex(kat[i].msg), 7)
+                == kat[i].mac, format("hmac known answer %zu in pieces", i));
+    }
+
+    // The two with a key longer than a block.
+    std::string long_key(131, (char)0xaa);
+
+    check(hmac_hex(long_key, "Test Using Larger Than Block-Size Key - Hash "
+            "Key First", 0) == "60e431591ee0b67f0d8a26aacbf5b77f8e0bc62137"
+            "28c5140546040f0ee37f54", "hmac with a long key");
+    check(hmac_hex(long_key, "This is a test using a larger than block-size "
+            "key and a larger than block-size data. The key needs to be "
+            "hashed before being used by the HMAC algorithm.", 0)
+            == "9b09ffa71b942fcb27635fbcd5b0e944bfdc63644f0713938a7f51535c3a"
+            "35e2", "hmac with a long key and data");
+
+    // A restored checkpoint carries on as if the data had been given
+    // again, and the MAC restarts with the same key after final().
+    hmac_sha256 h;
+    hmac_sha256::checkpoint cp;
+    unsigned char mac[hmac_sha256::digest_size];
+    std::string expected = hmac_hex("key", "first part, second part", 0);
+
+    h.set_key("key", 3);
+    h.update("first part, ", 12);
+    h.save(cp);
+    h.update("second part", 11);
+    h.final(mac);
+    check(to_hex(mac, sizeof(mac)) == expected, "hmac before the restore");
+
+    h.restore(cp);
+    h.update("second part", 11);
+    h.final(mac);
+    check(to_hex(mac, sizeof(mac)) == expected, "hmac after the restore");
+
+    h.update("first part, second part", 23);
+    h.final(mac);
+    check(to_hex(mac, sizeof(mac)) == expected, "hmac after final");
+}
+
+std::string twofish_encrypt_hex(const std::string &key,
+    const std::string &plain)
+{
+    twofish_ecb ecb;
+    unsigned char out[twofish_ecb::block_size];
+
+    ecb.set_key(key.data(), key.size());
+    ecb.encrypt(out, (const unsigned char *)plain.data(), sizeof(out));
+    return to_hex(out, sizeof(out));
+}
+
+// The values from the Twofish paper: the zero key of each size, the
+// keys counting up, and the last of the 49 iterations of ecb_tbl.txt,
+// where each plaintext is the previous ciphertext and each key is made
+// of the previous plaintext followed by the previous key.
+void test_twofish_kat()
+{
+    static const struct {
+        const char *key;
+        const char *cipher;
+    } kat[] = {
+        {"00000000000000000000000000000000",
+            "9f589f5cf6122c32b6bfec2f2ae8c35a"},
+        {"000000000000000000000000000000000000000000000000",
+            "efa71f788965bd4453f860178fc19101"},
+        {"0000000000000000000000000000000000000000000000000000000000000000",
+            "57ff739d4dc92c1bd7fc01700cc8216f"},
+        {"0123456789abcdeffedcba98765432100011223344556677",
+            "cfd1d2e5a9be9cdf501f13b892bd2248"},
+        {"0123456789abcdeffedcba987654321000112233445566778899aabbccddeeff",
+            "37527be0052334b89f0cfccae87cfa20"},
+    };
+
+    std::string zero(twofish_ecb::block_size, 0);
+
+    for(size_t i = 0; i < sizeof(kat) / sizeof(kat[0]); ++i) {
+        check(twofish_encrypt_hex(from_hex(kat[i].key), zero)
+                == kat[i].cipher, format("twofish known answer %zu", i));
+    }
+
+    static const char *const iterated[] = {
+        "5d9d4eeffa9151575524f115815a12e0",
+        "e75449212beef9f4a390bd860a640941",
+        "37fe26ff1cf66175f5ddf4c33b97a205",
+    };
+
+    for(size_t i = 0; i < 3; ++i) {
+        std::string key(16 + 8 * i, 0);
+        std::string plain = zero;
+        std::string cipher;
+
+        for(int j = 0; j < 49; ++j) {
+            cipher = from_hex(twofish_encrypt_hex(key, plain).c_str());
+            key = (plain + key).substr(0, key.size());
+            plain = cipher;
+        }
+
+        check(to_hex((const unsigned char *)cipher.data(), cipher.size())
+                == iterated[i], format("twofish %zu bit table",
+                    128 + 64 * i));
+    }
+
+    // Decryption undoes encryption for each key size.
+    for(size_t i = 0; i < sizeof(kat) / sizeof(kat[0]); ++i) {
+        std::string key = from_hex(kat[i].key);
+        std::string cipher = from_hex(kat[i].cipher);
+        twofish_ecb ecb;
+        unsigned char out[twofish_ecb::block_size];
+
+        ecb.set_key(key.data(), key.size());
+        ecb.decrypt(out, (const unsigned char *)cipher.data(), sizeof(out));
+        check(memcmp(out, zero.data(), sizeof(out)) == 0,
+            format("twofish decryption %zu", i));
+    }
+}
+
+// CBC against the chaining done by hand over ECB, in pieces of
+// different sizes and in place.
+void test_twofish_cbc()
+{
+    random_bytes rnd;
+    const size_t bs = twofish_ecb::block_size;
+
+    for(size_t key_len = 16; key_len <= 32; key_len += 8) {
+        std::string key = rnd.bytes(key_len);
+        std::string iv = rnd.bytes(bs);
+        std::string plain = rnd.bytes(100 * bs);
+        std::string expected(plain.size(), 0);
+        twofish_ecb ecb;
+        unsigned char chain[bs];
+
+        ecb.set_key(key.data(), key.size());
+        memcpy(chain, iv.data(), bs);
+
+        for(size_t pos = 0; pos < plain.size(); pos += bs) {
+            for(size_t i = 0; i < bs; ++i) {
+                chain[i] ^= plain[pos + i];
+            }
+
+            ecb.encrypt(chain, chain, bs);
+            memcpy(&expected[pos], chain, bs);
+        }
+
+        std::vector<unsigned char> buf(plain.begin(), plain.end());
+        twofish_cbc_encryption enc;
+        twofish_cbc_decryption dec;
+        size_t piece = 1;
+
+        enc.set_key_with_iv(key.data(), key.size(),
+            (const unsigned char *)iv.data());
+
+        for(size_t pos = 0; pos < buf.size(); pos += piece * bs) {
+            piece = piece % 13 + 1;
+            size_t len = std::min(piece * bs, buf.size() - pos);
+            enc.process(&buf[pos], &buf[pos], len);
+        }
+
+        check(std::string(buf.begin(), buf.end()) == expected,
+            format("twofish cbc encryption with a %zu byte key", key_len));
+
+        dec.set_key_with_iv(key.data(), key.size(),
+            (const unsigned char *)iv.data());
+
+        for(size_t pos = 0; pos < buf.size(); pos += piece * bs) {
+            piece = piece % 17 + 1;
+            size_t len = std::min(piece * bs, buf.size() - pos);
+            dec.process(&buf[pos], &buf[pos], len);
+        }
+
+        check(std::string(buf.begin(), buf.end()) == plain,
+            format("twofish cbc decryption with a %zu byte key", key_len));
+    }
+}
+
+// Runs every function of the implementation in use and of the portable
+// one on the same data and compares the results.
+void test_against_portable(const crypto_backend &impl,
+    const crypto_backend &ref)
+{
+    random_bytes rnd;
+
+    // Up to two blocks past the widest lanes, from every alignment.
+    const size_t max_blocks = 2 * 16 + 2;
+
+    {
+        std::vector<unsigned char> buf(max_blocks * sha256::block_size + 8);
+        rnd.fill(&buf[0], buf.size());
+
+        for(size_t n = 0; n <= max_blocks; ++n) {
+            for(size_t off = 0; off < 8; ++off) {
+                unsigned int a[8], b[8];
+
+                for(int i = 0; i < 8; ++i) {
+                    a[i] = b[i] = rnd.next();
+                }
+
+                impl.sha256_compress(a, &buf[off], n);
+                ref.sha256_compress(b, &buf[off], n);
+                check(memcmp(a, b, sizeof(a)) == 0,
+                    format("sha256_compress of %zu blocks at offset %zu",
+                        n, off));
+            }
+        }
+    }
+
+    static const unsigned int iterations[] = {0, 1, 2, 3, 64, 1000};
+    const size_t n_iterations = sizeof(iterations) / sizeof(iterations[0]);
+
+    for(size_t k = 0; k < n_iterations; ++k) {
+        unsigned int a[8], b[8];
+
+        for(int i = 0; i < 8; ++i) {
+            a[i] = b[i] = rnd.next();
+        }
+
+        impl.sha256_stretch(a, iterations[k]);
+        ref.sha256_stretch(b, iterations[k]);
+        check(memcmp(a, b, sizeof(a)) == 0,
+            format("sha256_stretch of %zu iterations", iterations[k]));
+    }
+
+    // Every lane starts from its own digest, the iterations are split
+    // between two calls as the key stretching may do.
+    for(size_t k = 0; k < n_iterations; ++k) {
+        size_t lanes = impl.sha256_lanes;
+        std::vector<unsigned int> digests(8 * lanes);
+        std::vector<unsigned int> start(digests.size());
+
+        for(size_t i = 0; i < digests.size(); ++i) {
+            digests[i] = start[i] = rnd.next();
+        }
+
+        unsigned int first = iterations[k] / 3;
+
+        impl.sha256_stretch_lanes(&digests[0], first);
+        impl.sha256_stretch_lanes(&digests[0], iterations[k] - first);
+
+        for(size_t j = 0; j < lanes; ++j) {
+            unsigned int ref_digest[8];
+            bool same = true;
+
+            for(int i = 0; i < 8; ++i) {
+                ref_digest[i] = start[i * lanes + j];
+            }
+
+            ref.sha256_stretch(ref_digest, iterations[k]);
+
+            for(int i = 0; i < 8; ++i) {
+                same = same && digests[i * lanes + j] == ref_digest[i];
+            }
+
+            check(same, format("sha256_stretch_lanes lane %zu of %zu, %zu "
+                "iterations", j, lanes, iterations[k]));
+        }
+    }
+
+    const size_t bs = twofish_ecb::block_size;
+
+    for(size_t key_len = 16; key_len <= 32; key_len += 8) {
+        unsigned char key_data[32];
+        twofish_key key;
+
+        rnd.fill(key_data, key_len);
+        twofish_setup(key, key_data, key_len);
+
+        std::vector<unsigned char> in(max_blocks * bs + bs);
+        std::vector<unsigned char> a(in.size()), b(in.size());
+        rnd.fill(&in[0], in.size());
+
+        for(size_t n = 0; n <= max_blocks; ++n) {
+            for(size_t off = 0; off < bs; off += 3) {
+                size_t out_off = (off * 7) % bs;
+
+                impl.twofish_encrypt(key, &a[out_off], &in[off], n);
+                ref.twofish_encrypt(key, &b[0], &in[off], n);
+                check(memcmp(&a[out_off], &b[0], n * bs) == 0,
+                    format("twofish_encrypt of %zu blocks at offsets %zu, "
+                        "%zu", n, off, out_off));
+
+                impl.twofish_decrypt(key, &a[out_off], &in[off], n);
+                ref.twofish_decrypt(key, &b[0], &in[off], n);
+                check(memcmp(&a[out_off], &b[0], n * bs) == 0,
+                    format("twofish_decrypt of %zu blocks at offsets %zu, "
+                        "%zu", n, off, out_off));
+
+                // In place, which is what the readers do.
+                memcpy(&a[off], &in[off], n * bs);
+                impl.twofish_decrypt(key, &a[off], &a[off], n);
+                check(memcmp(&a[off], &b[0], n * bs) == 0,
+                    format("twofish_decrypt of %zu blocks in place at "
+                        "offset %zu", n, off));
+
+                memcpy(&a[off], &in[off], n * bs);
+                impl.twofish_encrypt(key, &a[off], &a[off], n);
+                ref.twofish_encrypt(key, &b[0], &in[off], n);
+                check(memcmp(&a[off], &b[0], n * bs) == 0,
+                    format("twofish_encrypt of %zu blocks in place at "
+                        "offset %zu", n, off));
+            }
+        }
+    }
+}
+
+// Hashes and MACs of every length up to a few blocks through the public
+// classes, with the same data for every implementation.
+std::string hash_battery()
+{
+    random_bytes rnd;
+    std::string out;
+
+    for(size_t len = 0; len < 300; ++len) {
+        std::string msg = rnd.bytes(len);
+        std::string key = rnd.bytes(len % 100);
+
+        out += sha256_hex(msg, len % 70);
+        out += hmac_hex(key, msg, len % 33);
+    }
+
+    return out;
+}
+
+void test_backend(const std::string &name, const crypto_backend &ref,
+    const std::string &battery)
+{
+    current = name;
+
+    test_sha256_kat();
+    test_hmac_kat();
+    test_twofish_kat();
+    test_twofish_cbc();
+
+    if(name != "portable") {
+        test_against_portable(crypto(), ref);
+        check(hash_battery() == battery, "hashes of every length");
+    }
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<std::string> names = crypto_backends();
+
+    if(argc > 1 && strcmp(argv[1], "-l") == 0) {
+        for(size_t i = 0; i < names.size(); ++i) {
+            printf("%s\n", names[i].c_str());
+        }
+
+        return 0;
+    }
+
+    unsigned int features = cpu_features();
+
+    for(size_t i = 0; i < sizeof(known_backends) / sizeof(known_backends[0]);
+            ++i) {
+        const char *name = known_backends[i].name;
+        unsigned int needs = known_backends[i].features;
+
+        if((features & needs) == needs) {
+            current = name;
+            check(std::find(names.begin(), names.end(), name) != names.end(),
+                "not usable on a processor that supports it");
+        }
+    }
+
+    // The variable is read on the first use of the primitives.
+    const char *forced = getenv("PWS_CRYPTO_BACKEND");
+
+    if(forced) {
+        current = forced;
+        check(crypto().name == std::string(forced),
+            "not in use with PWS_CRYPTO_BACKEND set");
+        names.assign(1, forced);
+    }
+
+    if(!select_crypto_backend("portable")) {
+        printf("FAILED: no portable implementation\n");
+        return 1;
+    }
+
+    const crypto_backend ref = crypto();
+    std::string battery = hash_battery();
+
+    for(size_t i = 0; i < names.size(); ++i) {
+        if(!select_crypto_backend(names[i])) {
+            current = names[i];
+            check(false, "cannot be selected");
+            continue;
+        }
+
+        int before = failures;
+
+        test_backend(names[i], ref, battery);
+        printf("%s: %s\n", names[i].c_str(),
+            failures == before ? "ok" : "failed");
+    }
+
+    return failures ? 1 : 0;
+}
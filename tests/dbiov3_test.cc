@@ -0,0 +1,728 @@
+/*
+ * Copyright (c) 2009 Alex Raschepkin
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+// Writes V3 databases and reads them back with every way of reading and
+// every implementation of the primitives, also reading what one
+// implementation wrote with the portable one, then checks the incremental
+// writer against full writes, the journal and the save scheduler. To
+// build and run it, type this as one command at the top of the tree:
+//
+//   c++ -O2 -I. -pthread -o dbiov3_test tests/dbiov3_test.cc db/*.cc
+//       -lcryptopp && ./dbiov3_test
+//
+// PWS_CRYPTO_BACKEND limits the test to that implementation, as for
+// tests/crypto_test.cc. Prints what fails and exits with 1 if anything
+// does.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "db/byteio.h"
+#include "db/crypto.h"
+#include "db/db.h"
+#include "db/db_reader.h"
+#include "db/dbio.h"
+#include "db/dbiov3.h"
+#include "db/exception.h"
+#include "db/journal.h"
+#include "db/platform.h"
+#include "db/save_scheduler.h"
+#include "db/util.h"
+
+using namespace pws;
+
+namespace {
+
+int failures = 0;
+std::string current;
+
+void check(bool ok, const std::string &what)
+{
+    if(!ok) {
+        printf("FAILED: %s: %s\n", current.c_str(), what.c_str());
+        ++failures;
+    }
+}
+
+std::string random_string(size_t len)
+{
+    std::string out(len, 0);
+
+    for(size_t i = 0; i < len; ++i) {
+        out[i] = (char)(' ' + rand() % 95);
+    }
+
+    return out;
+}
+
+// Records with fields around the block boundaries, empty ones, and a few
+// that span many blocks.
+pws_db *make_db()
+{
+    pws_db *db = new pws_db(0x0305);
+
+    srand(1);
+
+    for(int i = 0; i < 3000; ++i) {
+        pws_record *r = db->create_record(random_string(rand() % 40),
+            random_string(rand() % 20));
+
+        r->set_username(random_string(i % 30));
+        r->set_group(i % 7 ? random_string(5) : "");
+
+        if(i % 3 == 0) {
+            r->set_notes(random_string(rand() % 300));
+        }
+
+        db->add_record(r);
+    }
+
+    db->get_record_by_index(10).set_notes(random_string(200 * 1024));
+    db->get_record_by_index(2999).set_notes(random_string(70 * 1024));
+    return db;
+}
+
+bool same_fields(const field_holder &a, const field_holder &b)
+{
+    if(a.num_fields() != b.num_fields()) {
+        return false;
+    }
+
+    for(int i = 0; i < a.num_fields(); ++i) {
+        const pws_field &x = a.get_field_by_index(i);
+        const pws_field &y = b.get_field_by_index(i);
+
+        if(x.get_type() != y.get_type() || x.get_size() != y.get_size()
+                || memcmp(x.get_bytes(), y.get_bytes(), x.get_size()) != 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool same_db(const pws_db &a, const pws_db &b)
+{
+    if(!same_fields(a.get_header().get_fields(),
+            b.get_header().get_fields())
+            || a.num_records() != b.num_records()) {
+        return false;
+    }
+
+    for(int i = 0; i < a.num_records(); ++i) {
+        if(!same_fields(a.get_record_by_index(i).get_fields(),
+                b.get_record_by_index(i).get_fields())) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+std::string write_db(pws_db &db, const std::string &key)
+{
+    std::string out;
+    memory_sink sink(out);
+    db_writer_v3 writer;
+
+    writer.write(db, sink, key);
+    check(out.size() == writer.size_estimate(db), "size estimate");
+    return out;
+}
+
+// Returns the error code of reading the file, UNSPECIFIED if it reads.
+io_error_code_t read_error(const std::string &file, const std::string &key)
+{
+    memory_source source(file.data(), file.size());
+    scoped_ptr<db_reader> reader(create_reader(source, key));
+    pws_db *db;
+    io_error_code_t error = UNSPECIFIED;
+
+    if(reader->try_read(db, error)) {
+        delete db;
+    }
+
+    return error;
+}
+
+const char *const mode_names[] = {
+    "stream", "bulk", "bulk on one thread", "pipeline", "zero copy", "lazy"
+};
+
+const size_t n_modes = sizeof(mode_names) / sizeof(mode_names[0]);
+
+read_options mode_options(size_t mode)
+{
+    read_options options;
+
+    switch(mode) {
+    case 1: options.bulk = true; break;
+    case 2: options.bulk = true; options.threads = 1; break;
+    case 3: options.pipeline = true; break;
+    case 4: options.zero_copy = true; break;
+    case 5: options.lazy = true; break;
+    }
+
+    return options;
+}
+
+void test_round_trip(const pws_db &db, const std::string &file)
+{
+    for(size_t mode = 0; mode < n_modes; ++mode) {
+        memory_source source(file.data(), file.size());
+        scoped_ptr<db_reader> reader(create_reader(source, "password",
+            mode_options(mode)));
+
+        try {
+            scoped_ptr<pws_db> read(reader->read());
+            check(same_db(db, *read), std::string("read back, ")
+                + mode_names[mode]);
+        } catch(const pws_io_exception &ex) {
+            check(false, std::string("read back, ") + mode_names[mode]
+                + ": " + ex.what());
+        }
+    }
+}
+
+void test_damage(const std::string &file)
+{
+    check(read_error(file, "wrong") == INVALID_PASSWORD, "wrong password");
+
+    // A changed byte in the records or in the HMAC.
+    size_t offsets[] = {200, file.size() / 2, file.size() - 1};
+
+    for(size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+        std::string damaged = file;
+
+        damaged[offsets[i]] ^= 1;
+        check(read_error(damaged, "password") != UNSPECIFIED,
+            "a changed byte is not noticed");
+    }
+
+    check(read_error(file.substr(0, file.size() - 1), "password")
+        != UNSPECIFIED, "a truncated file is not noticed");
+}
+
+// Returns the name of a new empty temporary file, empty if it cannot be
+// created.
+std::string temp_file()
+{
+    char name[] = "/tmp/dbiov3_test.XXXXXX";
+    int fd = mkstemp(name);
+
+    if(fd < 0) {
+        check(false, "cannot create a temporary file");
+        return std::string();
+    }
+
+    close(fd);
+    return name;
+}
+
+std::string load_file(const std::string &name)
+{
+    std::string out;
+    FILE *f = fopen(name.c_str(), "rb");
+
+    if(f == 0) {
+        return out;
+    }
+
+    file_guard guard(f);
+    char buf[65536];
+    size_t n;
+
+    while((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        out.append(buf, n);
+    }
+
+    return out;
+}
+
+void store_file(const std::string &name, const std::string &data)
+{
+    FILE *f = fopen(name.c_str(), "wb");
+
+    if(f == 0) {
+        check(false, "cannot write " + name);
+        return;
+    }
+
+    file_guard guard(f);
+    fwrite(data.data(), 1, data.size(), f);
+}
+
+// Reads a copy of the database from its contents as written by
+// write_db().
+pws_db *read_db(const std::string &file)
+{
+    memory_source source(file.data(), file.size());
+    scoped_ptr<db_reader> reader(create_reader(source, "password"));
+    return reader->read();
+}
+
+// Reads the file in every mode and compares it with the database.
+void test_read_file(const pws_db &db, const std::string &name,
+    const std::string &key, const std::string &what)
+{
+    for(size_t mode = 0; mode < n_modes; ++mode) {
+        try {
+            scoped_ptr<db_reader> reader(create_reader(name, key,
+                mode_options(mode)));
+            scoped_ptr<pws_db> read(reader->read());
+            check(same_db(db, *read), what + ", " + mode_names[mode]);
+        } catch(const pws_io_exception &ex) {
+            check(false, what + ", " + mode_names[mode] + ": " + ex.what());
+        }
+    }
+}
+
+// Writes through a file, changes its password and reads it again.
+void test_file(pws_db &db)
+{
+    std::string name = temp_file();
+
+    if(name.empty()) {
+        return;
+    }
+
+    try {
+        db_writer_v3 writer;
+        writer.write(db, name, "password");
+        change_key_v3(name, "password", "new password");
+
+        scoped_ptr<db_reader> reader(create_reader(name, "new password"));
+        scoped_ptr<pws_db> read(reader->read());
+        check(same_db(db, *read), "read back after changing the password");
+    } catch(const pws_io_exception &ex) {
+        check(false, std::string("file: ") + ex.what());
+    }
+
+    unlink(name.c_str());
+}
+
+// Saves, then edits, adds and deletes records and saves again, which
+// rewrites only the end of the file with the keys, the chaining and the
+// HMAC state of the first save. The files have to read the same as a
+// full write of the database in every mode. A file replaced behind the
+// writer's back, here by one of the same size written within the same
+// second, has to be written in full.
+void test_incremental(pws_db &db)
+{
+    std::string name = temp_file();
+
+    if(name.empty()) {
+        return;
+    }
+
+    const size_t preamble_size = 152;
+
+    try {
+        db_incremental_writer_v3 writer(name, "password");
+
+        writer.save(db);
+        test_read_file(db, name, "password", "first save");
+
+        std::string before = load_file(name);
+
+        db.get_record_by_index(db.num_records() - 3).set_title("edited");
+        db.get_record_by_index(db.num_records() - 1).set_notes(
+            random_string(5000));
+
+        for(int i = 0; i < 5; ++i) {
+            db.add_record(db.create_record(random_string(10),
+                random_string(10)));
+        }
+
+        writer.save(db);
+
+        std::string after = load_file(name);
+
+        check(before.compare(0, preamble_size, after, 0, preamble_size) == 0,
+            "an edit at the end wrote the whole file");
+        test_read_file(db, name, "password", "incremental save");
+
+        db.delete_record_by_index(db.num_records() - 2);
+        db.get_record_by_index(db.num_records() / 2).set_username("middle");
+        writer.save(db);
+        test_read_file(db, name, "password", "second incremental save");
+
+        // The same database as a full write reads the same.
+        std::string full = write_db(db, "password");
+        scoped_ptr<pws_db> full_db(read_db(full));
+        scoped_ptr<db_reader> reader(create_reader(name, "password"));
+        scoped_ptr<pws_db> saved(reader->read());
+        check(same_db(*full_db, *saved), "differs from a full write");
+
+        // Someone else writes the file, with other keys but the same
+        // size, then a record at the end changes.
+        db_writer_v3 other;
+        other.write(db, name, "password");
+
+        std::string replaced = load_file(name);
+
+        db.get_record_by_index(db.num_records() - 1).set_title("x");
+        writer.save(db);
+
+        after = load_file(name);
+        check(replaced.compare(0, preamble_size, after, 0, preamble_size)
+            != 0, "a file changed underneath was not written in full");
+        test_read_file(db, name, "password", "save over a replaced file");
+    } catch(const pws_io_exception &ex) {
+        check(false, std::string("incremental: ") + ex.what());
+    }
+
+    unlink(name.c_str());
+}
+
+// Returns the error code of replaying the journal file into the
+// database, UNSPECIFIED if it replays.
+io_error_code_t replay_error(const std::string &file, pws_db &db,
+    const unsigned char *k, const unsigned char *l,
+    const unsigned char *hmac)
+{
+    journal j(k, l, hmac);
+
+    try {
+        check(j.replay(file, db), "the journal is not replayed");
+    } catch(const pws_io_exception &ex) {
+        return ex.error_code();
+    }
+
+    return UNSPECIFIED;
+}
+
+// Commits an entry of each kind, one at a time, and replays them into a
+// copy of the database as it was. Damage is made to the entries at the
+// offsets the commits leave the file at: an entry starts with its
+// length, then comes the IV and the ciphertext.
+void test_journal()
+{
+    std::string name = temp_file();
+    std::string other = temp_file();
+
+    if(name.empty() || other.empty()) {
+        return;
+    }
+
+    unlink(name.c_str());
+
+    unsigned char k[journal::key_size], l[journal::key_size];
+    unsigned char hmac[journal::mac_size], new_hmac[journal::mac_size];
+
+    memset(k, 1, sizeof(k));
+    memset(l, 2, sizeof(l));
+    memset(hmac, 3, sizeof(hmac));
+    memset(new_hmac, 4, sizeof(new_hmac));
+
+    pws_db db(0x0305);
+
+    for(int i = 0; i < 5; ++i) {
+        db.add_record(db.create_record(random_string(10), random_string(10)));
+    }
+
+    try {
+        std::string base = write_db(db, "password");
+        std::vector<size_t> ends;
+        journal::position after_first;
+        journal j(k, l, hmac);
+        uuid_t uuid;
+
+        db.get_record_by_index(1).set_title("one");
+        j.put_record(db.get_record_by_index(1));
+        j.commit(name);
+        ends.push_back(j.size());
+        j.get_position(after_first);
+
+        // The state the database is written in by a rebase.
+        std::string snapshot = write_db(db, "password");
+
+        db.get_record_by_index(2).get_uuid(uuid);
+        db.get_record_by_index(2).set_username("two");
+        j.set_field(uuid, pws_record::USERNAME, "two");
+        db.get_record_by_index(2).get_fields().remove_field(
+            pws_record::NOTES);
+        j.remove_field(uuid, pws_record::NOTES);
+        j.commit(name);
+        ends.push_back(j.size());
+
+        db.get_record_by_index(3).get_uuid(uuid);
+        db.delete_record_by_index(3);
+        j.delete_record(uuid);
+        j.commit(name);
+        ends.push_back(j.size());
+
+        pws_record *added = db.create_record("new", "record");
+        db.add_record(added);
+        j.put_record(*added);
+        j.commit(name);
+        ends.push_back(j.size());
+
+        std::string file = load_file(name);
+        check(file.size() == ends.back(), "journal size");
+
+        {
+            scoped_ptr<pws_db> read(read_db(base));
+            check(replay_error(name, *read, k, l, hmac) == UNSPECIFIED
+                && same_db(db, *read), "replayed journal");
+        }
+
+        {
+            scoped_ptr<pws_db> read(read_db(base));
+            scoped_ptr<pws_db> unchanged(read_db(base));
+            journal j2(k, l, new_hmac);
+            check(!j2.replay(name, *read) && same_db(*unchanged, *read),
+                "a journal of another database is replayed");
+        }
+
+        // A changed byte in an entry in the middle, or in the last one.
+        for(size_t i = 0; i + 1 < ends.size(); ++i) {
+            std::string damaged = file;
+            damaged[ends[i] + 4 + 16 + 1] ^= 1;
+            store_file(other, damaged);
+
+            scoped_ptr<pws_db> read(read_db(base));
+            check(replay_error(other, *read, k, l, hmac)
+                == HMAC_DID_NOT_MATCH, "a changed entry is not noticed");
+        }
+
+        // Lengths no entry can have.
+        size_t bad_lengths[] = {0, 17};
+
+        for(size_t i = 0; i < 2; ++i) {
+            std::string damaged = file;
+            put_int32le(bad_lengths[i],
+                (unsigned char *)&damaged[ends[0]]);
+            store_file(other, damaged);
+
+            scoped_ptr<pws_db> read(read_db(base));
+            check(replay_error(other, *read, k, l, hmac) == MALFORMED_FILE,
+                "a bad entry length is not noticed");
+        }
+
+        // The last entry cut short by a crash is skipped and left in the
+        // file, the next commit writes over it.
+        {
+            size_t torn = (ends[2] + ends[3]) / 2;
+            store_file(other, file.substr(0, torn));
+
+            scoped_ptr<pws_db> read(read_db(base));
+            journal j2(k, l, hmac);
+
+            check(j2.replay(other, *read) && j2.size() == ends[2]
+                && load_file(other).size() == torn,
+                "a torn entry is not skipped");
+
+            read->get_record_by_index(0).set_title("zero");
+            j2.put_record(read->get_record_by_index(0));
+            j2.commit(other);
+
+            scoped_ptr<pws_db> again(read_db(base));
+            check(replay_error(other, *again, k, l, hmac) == UNSPECIFIED
+                && same_db(*read, *again),
+                "a commit after a torn entry");
+        }
+
+        // The entries after the first go over to the journal of the
+        // snapshot, with a queued one.
+        {
+            scoped_ptr<pws_db> read(read_db(base));
+            journal j2(k, l, hmac);
+
+            check(j2.replay(name, *read), "the journal is not replayed");
+            read->get_record_by_index(0).set_notes("queued");
+            j2.put_record(read->get_record_by_index(0));
+            unlink(other.c_str());
+
+            scoped_ptr<journal> rebased(j2.rebase(l, k, new_hmac,
+                after_first, name, other));
+            scoped_ptr<pws_db> written(read_db(snapshot));
+
+            check(replay_error(other, *written, l, k, new_hmac)
+                == UNSPECIFIED && same_db(*read, *written),
+                "rebased journal");
+            check(load_file(name) == file, "rebase changed the journal");
+        }
+    } catch(const pws_io_exception &ex) {
+        check(false, std::string("journal: ") + ex.what());
+    }
+
+    unlink(name.c_str());
+    unlink(other.c_str());
+}
+
+// Counts the writes of a save_scheduler.
+class counting_hook : public save_hook {
+public:
+    counting_hook() : writes(0) {}
+
+    virtual void write_started() { ++writes; }
+    virtual void before_replace(const unsigned char *,
+        const unsigned char *, const unsigned char *) {}
+    virtual void after_replace(bool) {}
+
+    int writes;
+};
+
+// Requests made within the delay are written at once with the last
+// snapshot, an error reaches the futures, and a change of password
+// waits for the requests before it.
+void test_scheduler()
+{
+    std::string name = temp_file();
+
+    if(name.empty()) {
+        return;
+    }
+
+    pws_db db(0x0305);
+
+    for(int i = 0; i < 20; ++i) {
+        db.add_record(db.create_record(random_string(10), random_string(10)));
+    }
+
+    save_options options;
+    options.delay_ms = 200;
+
+    try {
+        counting_hook hook;
+        save_scheduler scheduler(name, "password", options, &hook);
+        std::vector<save_future> futures;
+
+        for(int i = 0; i < 3; ++i) {
+            db.get_record_by_index(i).set_title("edit " + random_string(5));
+            db.add_record(db.create_record(random_string(10), "added"));
+            futures.push_back(scheduler.save(db));
+        }
+
+        futures.back().wait();
+        check(hook.writes == 1, "requests within the delay are not "
+            "written together");
+
+        for(size_t i = 0; i < futures.size(); ++i) {
+            check(futures[i].ready(), "a request written together is not "
+                "ready");
+        }
+
+        test_read_file(db, name, "password", "scheduled save");
+
+        db.get_record_by_index(5).set_notes("before the new password");
+        scheduler.save(db);
+        scheduler.change_key("new password");
+
+        std::string file = load_file(name);
+        check(read_error(file, "password") == INVALID_PASSWORD,
+            "the old password still opens the file");
+        test_read_file(db, name, "new password", "changed password");
+
+        db.get_record_by_index(6).set_notes("after the new password");
+        scheduler.save(db).wait();
+        test_read_file(db, name, "new password",
+            "save after changing the password");
+    } catch(const pws_io_exception &ex) {
+        check(false, std::string("scheduler: ") + ex.what());
+    }
+
+    unlink(name.c_str());
+
+    // A file that cannot be written.
+    {
+        options.delay_ms = 0;
+        save_scheduler scheduler(name + ".missing/file", "password",
+            options);
+        save_future future = scheduler.save(db);
+        bool thrown = false;
+
+        try {
+            future.wait();
+        } catch(const pws_io_exception &) {
+            thrown = true;
+        }
+
+        check(thrown, "a write error does not reach the future");
+    }
+}
+
+}
+
+int main()
+{
+    scoped_ptr<pws_db> db(make_db());
+    std::vector<std::string> names = crypto_backends();
+
+    if(getenv("PWS_CRYPTO_BACKEND")) {
+        names.assign(1, crypto().name);
+    }
+
+    for(size_t i = 0; i < names.size(); ++i) {
+        current = names[i];
+
+        if(!select_crypto_backend(names[i])) {
+            check(false, "cannot be selected");
+            continue;
+        }
+
+        int before = failures;
+        std::string file = write_db(*db, "password");
+
+        test_round_trip(*db, file);
+        test_damage(file);
+        test_file(*db);
+
+        // What this implementation wrote, read by the portable one.
+        if(names[i] != "portable" && select_crypto_backend("portable")) {
+            current = names[i] + " read by portable";
+            test_round_trip(*db, file);
+            current = names[i];
+        }
+
+        printf("%s: %s\n", names[i].c_str(),
+            failures == before ? "ok" : "failed");
+    }
+
+    // The rest does not depend on the implementation.
+    current = "incremental";
+    select_crypto_backend(names[0]);
+    test_incremental(*db);
+    printf("%s: %s\n", current.c_str(), failures ? "failed" : "ok");
+
+    int before = failures;
+    current = "journal";
+    test_journal();
+    printf("%s: %s\n", current.c_str(),
+        failures == before ? "ok" : "failed");
+
+    before = failures;
+    current = "scheduler";
+    test_scheduler();
+    printf("%s: %s\n", current.c_str(),
+        failures == before ? "ok" : "failed");
+
+    return failures ? 1 : 0;
+}